@@ -0,0 +1,573 @@
+#if defined(__linux__)
+#define _DEFAULT_SOURCE /* strdup(), strtok_r() and sysconf() are hidden by -std=c2x */
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "lc3.h"
+
+/**
+ * lc3-batch: run a manifest of LC-3 programs on all cores (Linux/macOS).
+ *
+ * Every line of the manifest (`-`: stdin) is one job, `#` starts a comment:
+ *
+ *     image.obj [more.obj ...] [< input] [> output]
+ *
+ * The job reads its keyboard from `input` (nothing: end of input right away) and writes its output to `output`
+ * (nothing: discarded). No terminal is involved.
+ *
+ * Every worker thread keeps a few jobs in a deque and runs them round-robin, `--slice` instructions at a time
+ * (lc3_run() returns after exactly that many). A worker whose deque runs dry starts the next job of the manifest,
+ * and once all of them have been started it steals queued jobs from the other workers, so a few long programs
+ * do not leave cores idle. `--max-steps` and `--time-limit` (milliseconds per job) stop programs that never halt.
+ * The result of every job is printed in manifest order: `halted|limit|timeout|crashed|failed <instructions> <line>`.
+ *
+ * `--metrics=FILE` rewrites FILE every `--metrics-ms` (default 1000) with the live counters of every job started so
+ * far in the Prometheus text format (lc3_write_metrics(), label `job="<manifest index>"`), for a node exporter's
+ * textfile collector or a plain `watch cat`; the last write happens after all jobs finished.
+ */
+
+#define BATCH_MAX_IMAGES 16
+#define BATCH_PER_WORKER 4 /* jobs one worker runs in turns; more only cost memory */
+
+enum
+{
+    JOB_PENDING = 0,
+    JOB_HALTED,
+    JOB_LIMIT,   /* ran into --max-steps */
+    JOB_TIMEOUT, /* ran into --time-limit */
+    JOB_CRASHED, /* the guest faulted */
+    JOB_FAILED,  /* an image, the input or the output could not be opened */
+};
+
+struct job
+{
+    char *line; /* manifest line, for the report */
+    char *images[BATCH_MAX_IMAGES];
+    int image_count;
+    const char *input_path;
+    const char *output_path;
+
+    struct lc3_vm *vm; /* while running */
+    FILE *input;
+    FILE *output;
+    int status;
+    uint64_t retired;
+    struct lc3_metrics metrics; /* written by the worker running the job, read by the reporter */
+};
+
+/**
+ * Jobs of one worker. Other workers steal from it, hence the lock.
+ */
+struct deque
+{
+    pthread_mutex_t lock;
+    struct job *jobs[BATCH_PER_WORKER];
+    int head;
+    int count;
+};
+
+struct batch
+{
+    struct lc3_config config; /* engine and image cache of every VM */
+    uint64_t slice;
+    uint64_t max_steps;
+    uint64_t time_limit;
+
+    struct job *jobs;
+    int job_count;
+    _Atomic int next_job; /* first job not started yet */
+    _Atomic int finished;
+
+    struct deque *deques;
+    int worker_count;
+
+    const char *metrics_path;
+    uint64_t metrics_ms;
+};
+
+struct worker
+{
+    struct batch *batch;
+    int index;
+};
+
+void deque_push(struct deque *q, struct job *job)
+{
+    pthread_mutex_lock(&q->lock);
+    q->jobs[(q->head + q->count++) % BATCH_PER_WORKER] = job;
+    pthread_mutex_unlock(&q->lock);
+}
+
+/** the owner takes the oldest job, round-robin */
+struct job *deque_pop(struct deque *q)
+{
+    struct job *job = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0)
+    {
+        job = q->jobs[q->head];
+        q->head = (q->head + 1) % BATCH_PER_WORKER;
+        --q->count;
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+/** a thief takes the newest job */
+struct job *deque_steal(struct deque *q)
+{
+    struct job *job = NULL;
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0)
+    {
+        job = q->jobs[(q->head + --q->count) % BATCH_PER_WORKER];
+    }
+    pthread_mutex_unlock(&q->lock);
+    return job;
+}
+
+int deque_count(struct deque *q)
+{
+    pthread_mutex_lock(&q->lock);
+    int count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+/**
+ * Split a manifest line into a job, returns 0 for blank lines and comments
+ */
+int parse_job(char *line, struct job *job)
+{
+    memset(job, 0, sizeof(*job));
+    char *comment = strchr(line, '#');
+    if (comment)
+    {
+        *comment = '\0';
+    }
+    line[strcspn(line, "\r\n")] = '\0';
+    job->line = strdup(line);
+
+    char *save = NULL;
+    for (char *token = strtok_r(line, " \t", &save); token; token = strtok_r(NULL, " \t", &save))
+    {
+        if (strcmp(token, "<") == 0 || strcmp(token, ">") == 0)
+        {
+            char *path = strtok_r(NULL, " \t", &save);
+            if (!path)
+            {
+                job->status = JOB_FAILED;
+                break;
+            }
+            *(token[0] == '<' ? &job->input_path : &job->output_path) = path;
+        }
+        else if (job->image_count < BATCH_MAX_IMAGES)
+        {
+            job->images[job->image_count++] = token;
+        }
+        else
+        {
+            job->status = JOB_FAILED;
+        }
+    }
+    if (job->image_count == 0)
+    {
+        free(job->line);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Read the manifest; the job strings point into `text`, which has to stay around
+ */
+int read_manifest(const char *path, struct batch *b, char **text)
+{
+    FILE *file = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+    if (!file)
+    {
+        return 0;
+    }
+    size_t size = 0, capacity = 0;
+    int ok = 1;
+    while (ok && !feof(file))
+    {
+        if (size + 4096 + 1 > capacity)
+        {
+            capacity = capacity * 2 + 4096 + 1;
+            char *grown = realloc(*text, capacity);
+            ok = grown != NULL;
+            *text = ok ? grown : *text;
+        }
+        size += ok ? fread(*text + size, 1, capacity - size - 1, file) : 0;
+        ok = ok && !ferror(file);
+    }
+    if (file != stdin)
+    {
+        fclose(file);
+    }
+    if (!ok)
+    {
+        return 0;
+    }
+    (*text)[size] = '\0';
+
+    int lines = 1;
+    for (size_t i = 0; i < size; ++i)
+    {
+        lines += (*text)[i] == '\n';
+    }
+    b->jobs = calloc((size_t)lines, sizeof(struct job));
+    if (!b->jobs)
+    {
+        return 0;
+    }
+
+    char *save = NULL;
+    for (char *line = strtok_r(*text, "\n", &save); line; line = strtok_r(NULL, "\n", &save))
+    {
+        b->job_count += parse_job(line, &b->jobs[b->job_count]);
+    }
+    return 1;
+}
+
+/**
+ * Create the VM of a job, returns 0 if the job failed right away
+ */
+int job_start(struct batch *b, struct job *job)
+{
+    if (job->status == JOB_FAILED)
+    {
+        return 0;
+    }
+
+    job->input = job->input_path ? fopen(job->input_path, "rb") : NULL; /* none: headless, end of input */
+    struct lc3_config config = b->config;
+    config.input = job->input;
+    config.metrics = &job->metrics;
+    job->vm = job->input || !job->input_path ? lc3_create(&config) : NULL;
+
+    int ok = job->vm != NULL;
+    for (int i = 0; ok && i < job->image_count; ++i)
+    {
+        ok = lc3_load_image(job->vm, job->images[i]);
+    }
+    /* only now, so a job that cannot start leaves an existing output file alone */
+    if (ok)
+    {
+        job->output = fopen(job->output_path ? job->output_path : "/dev/null", "wb");
+        ok = job->output != NULL;
+    }
+    if (!ok)
+    {
+        job->status = JOB_FAILED;
+    }
+    else
+    {
+        lc3_set_output(job->vm, job->output);
+        lc3_set_deadline(job->vm, b->time_limit); /* wall clock from the start, also while it waits for its turn */
+    }
+    return ok;
+}
+
+void job_finish(struct batch *b, struct job *job)
+{
+    if (job->vm)
+    {
+        lc3_flush(job->vm);
+        job->retired = lc3_retired(job->vm);
+        lc3_destroy(job->vm);
+        job->vm = NULL;
+    }
+    if (job->input)
+    {
+        fclose(job->input);
+    }
+    if (job->output)
+    {
+        fclose(job->output);
+    }
+    atomic_fetch_add(&b->finished, 1);
+}
+
+/**
+ * Run one time slice of a job, returns 1 if it has to run again
+ */
+int job_slice(struct batch *b, struct job *job)
+{
+    uint64_t steps = b->slice;
+    if (b->max_steps)
+    {
+        uint64_t left = b->max_steps - lc3_retired(job->vm);
+        steps = left < steps ? left : steps;
+    }
+
+    switch (lc3_run(job->vm, steps))
+    {
+    case LC3_HALTED:
+        job->status = JOB_HALTED;
+        return 0;
+    case LC3_DEADLINE:
+        job->status = JOB_TIMEOUT;
+        return 0;
+    case LC3_FAULT:
+        job->status = JOB_CRASHED;
+        return 0;
+    }
+    if (b->max_steps && lc3_retired(job->vm) >= b->max_steps)
+    {
+        job->status = JOB_LIMIT;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Next job for worker `w`: a new one while its deque has room, then its own, then a stolen one
+ */
+struct job *next_job(struct batch *b, int w)
+{
+    struct deque *own = &b->deques[w];
+    while (deque_count(own) < BATCH_PER_WORKER && atomic_load(&b->next_job) < b->job_count)
+    {
+        int i = atomic_fetch_add(&b->next_job, 1);
+        if (i >= b->job_count)
+        {
+            break;
+        }
+        struct job *job = &b->jobs[i];
+        if (job_start(b, job))
+        {
+            return job;
+        }
+        job_finish(b, job);
+    }
+
+    struct job *job = deque_pop(own);
+    for (int i = 1; !job && i < b->worker_count; ++i)
+    {
+        job = deque_steal(&b->deques[(w + i) % b->worker_count]);
+    }
+    return job;
+}
+
+void *worker_main(void *arg)
+{
+    struct worker *worker = arg;
+    struct batch *b = worker->batch;
+    while (atomic_load(&b->finished) < b->job_count)
+    {
+        struct job *job = next_job(b, worker->index);
+        if (!job)
+        {
+            sched_yield(); /* the remaining jobs are running on other workers */
+            continue;
+        }
+        if (job_slice(b, job))
+        {
+            deque_push(&b->deques[worker->index], job);
+        }
+        else
+        {
+            job_finish(b, job);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Write the counters of all jobs started so far to `--metrics`, through a temporary file so readers never see half of it
+ */
+void write_metrics(struct batch *b)
+{
+    int started = atomic_load(&b->next_job);
+    started = started < b->job_count ? started : b->job_count;
+    const struct lc3_metrics **metrics = calloc((size_t)started + 1, sizeof(*metrics));
+    char **labels = calloc((size_t)started + 1, sizeof(*labels));
+    size_t length = strlen(b->metrics_path);
+    char *tmp = malloc(length + 5);
+    FILE *file = NULL;
+    if (metrics && labels && tmp)
+    {
+        for (int i = 0; i < started; ++i)
+        {
+            metrics[i] = &b->jobs[i].metrics;
+            labels[i] = malloc(24);
+            if (labels[i])
+            {
+                snprintf(labels[i], 24, "job=\"%d\"", i);
+            }
+        }
+        memcpy(tmp, b->metrics_path, length);
+        memcpy(tmp + length, ".tmp", 5);
+        file = fopen(tmp, "wb");
+    }
+    if (file)
+    {
+        int ok = lc3_write_metrics(file, metrics, (const char *const *)labels, (size_t)started);
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(tmp, b->metrics_path) != 0)
+        {
+            remove(tmp);
+        }
+    }
+    for (int i = 0; labels && i < started; ++i)
+    {
+        free(labels[i]);
+    }
+    free(labels);
+    free(metrics);
+    free(tmp);
+}
+
+void *reporter_main(void *arg)
+{
+    struct batch *b = arg;
+    struct timespec tick = {0, 10 * 1000000}; /* notice the end of the batch quickly, whatever the period */
+    for (uint64_t waited = b->metrics_ms; atomic_load(&b->finished) < b->job_count; waited += 10)
+    {
+        if (waited >= b->metrics_ms)
+        {
+            write_metrics(b);
+            waited = 0;
+        }
+        nanosleep(&tick, NULL);
+    }
+    return NULL;
+}
+
+int main(int argc, const char *argv[])
+{
+    struct batch b;
+    memset(&b, 0, sizeof(b));
+    lc3_default_config(&b.config);
+    b.config.flush_policy = 0; /* nobody watches, flush on halt and when the buffer is full */
+    b.config.share_images = 1; /* jobs running the same program share its pages */
+    b.config.headless = 1;     /* jobs never touch the terminal */
+    b.slice = 100000;
+    b.metrics_ms = 1000;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    b.worker_count = cpus > 0 ? (int)cpus : 1;
+    const char *manifest = NULL;
+
+    for (int j = 1; j < argc; ++j)
+    {
+        if (strncmp(argv[j], "--engine=", 9) == 0)
+        {
+            if (!lc3_parse_engine(argv[j] + 9, &b.config.engine))
+            {
+                printf("unknown engine: %s\n", argv[j] + 9);
+                exit(2);
+            }
+        }
+        else if (strncmp(argv[j], "--jobs=", 7) == 0)
+        {
+            b.worker_count = atoi(argv[j] + 7);
+        }
+        else if (strncmp(argv[j], "--slice=", 8) == 0)
+        {
+            b.slice = strtoull(argv[j] + 8, NULL, 10);
+        }
+        else if (strncmp(argv[j], "--max-steps=", 12) == 0)
+        {
+            b.max_steps = strtoull(argv[j] + 12, NULL, 10);
+        }
+        else if (strncmp(argv[j], "--time-limit=", 13) == 0)
+        {
+            b.time_limit = strtoull(argv[j] + 13, NULL, 10);
+        }
+        else if (strncmp(argv[j], "--metrics=", 10) == 0)
+        {
+            b.metrics_path = argv[j] + 10;
+        }
+        else if (strncmp(argv[j], "--metrics-ms=", 13) == 0)
+        {
+            b.metrics_ms = strtoull(argv[j] + 13, NULL, 10);
+        }
+        else if (strcmp(argv[j], "--image-cache") == 0)
+        {
+            b.config.image_cache = 1;
+        }
+        else
+        {
+            manifest = argv[j];
+        }
+    }
+    if (!manifest || b.worker_count < 1 || b.slice == 0 || b.metrics_ms == 0)
+    {
+        printf("lc3-batch [--engine=switch|threaded|jit] [--jobs=N] [--slice=N] [--max-steps=N] [--time-limit=MS] [--image-cache]\n"
+               "          [--metrics=FILE] [--metrics-ms=MS] manifest\n");
+        exit(2);
+    }
+
+    char *text = NULL;
+    if (!read_manifest(manifest, &b, &text))
+    {
+        printf("failed to read manifest: %s\n", manifest);
+        exit(1);
+    }
+
+    if (b.worker_count > b.job_count)
+    {
+        b.worker_count = b.job_count > 0 ? b.job_count : 1;
+    }
+    b.deques = calloc((size_t)b.worker_count, sizeof(struct deque));
+    struct worker *workers = calloc((size_t)b.worker_count, sizeof(struct worker));
+    pthread_t *threads = calloc((size_t)b.worker_count, sizeof(pthread_t));
+    if (!b.deques || !workers || !threads)
+    {
+        printf("out of memory\n");
+        exit(1);
+    }
+    for (int w = 0; w < b.worker_count; ++w)
+    {
+        pthread_mutex_init(&b.deques[w].lock, NULL);
+        workers[w] = (struct worker){.batch = &b, .index = w};
+    }
+
+    pthread_t reporter;
+    if (b.metrics_path && pthread_create(&reporter, NULL, reporter_main, &b) != 0)
+    {
+        printf("failed to start the metrics reporter\n");
+        exit(1);
+    }
+
+    /* the calling thread is worker 0 */
+    for (int w = 1; w < b.worker_count; ++w)
+    {
+        if (pthread_create(&threads[w], NULL, worker_main, &workers[w]) != 0)
+        {
+            printf("failed to start worker %d\n", w);
+            exit(1);
+        }
+    }
+    worker_main(&workers[0]);
+    for (int w = 1; w < b.worker_count; ++w)
+    {
+        pthread_join(threads[w], NULL);
+    }
+    if (b.metrics_path)
+    {
+        pthread_join(reporter, NULL);
+        write_metrics(&b);
+    }
+
+    static const char *names[] = {"pending", "halted", "limit", "timeout", "crashed", "failed"};
+    int all_halted = 1;
+    for (int i = 0; i < b.job_count; ++i)
+    {
+        struct job *job = &b.jobs[i];
+        printf("%s %llu %s\n", names[job->status], (unsigned long long)job->retired, job->line);
+        all_halted &= job->status == JOB_HALTED;
+        free(job->line);
+    }
+    return all_halted ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,423 @@
+#if defined(__linux__)
+#define _DEFAULT_SOURCE /* clock_gettime() is hidden by -std=c2x */
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "lc3.h"
+
+/**
+ * lc3-bench: instructions per second of every engine (make bench).
+ *
+ *     lc3-bench [--engine=NAME] [--runs=N] [--no-fuse] [--kernel=NAME]
+ *     lc3-bench [--engine=NAME] [--runs=N] [--no-fuse] [--steps=N] [--input=FILE] image.obj ...
+ *
+ * The first form runs the built-in kernels below, the second one the given program, e.g. one of the games
+ * with its keyboard scripted by `--input`. It stops when it halts, when it has read the whole script or after about `--steps`
+ * instructions (default 100 000 000, 0: no limit), checked every BENCH_SLICE instructions.
+ * Every kernel runs `--runs` times (default 5) in a fresh VM, output goes to a null device.
+ * The report gives mean and standard deviation of MIPS and the mean ns per instruction.
+ */
+
+/* instruction encoders for the kernels, PC-relative offsets count from the next instruction */
+#define ADD(d, a, b) (uint16_t)(0x1000 | (d) << 9 | (a) << 6 | (b))
+#define ADDI(d, a, imm) (uint16_t)(0x1000 | (d) << 9 | (a) << 6 | 0x20 | ((imm) & 0x1F))
+#define AND(d, a, b) (uint16_t)(0x5000 | (d) << 9 | (a) << 6 | (b))
+#define ANDI(d, a, imm) (uint16_t)(0x5000 | (d) << 9 | (a) << 6 | 0x20 | ((imm) & 0x1F))
+#define NOT(d, a) (uint16_t)(0x903F | (d) << 9 | (a) << 6)
+#define BRZ(off) (uint16_t)(0x0400 | ((off) & 0x1FF))
+#define BRP(off) (uint16_t)(0x0200 | ((off) & 0x1FF))
+#define LD(d, off) (uint16_t)(0x2000 | (d) << 9 | ((off) & 0x1FF))
+#define LDI(d, off) (uint16_t)(0xA000 | (d) << 9 | ((off) & 0x1FF))
+#define LDR(d, b, off) (uint16_t)(0x6000 | (d) << 9 | (b) << 6 | ((off) & 0x3F))
+#define LEA(d, off) (uint16_t)(0xE000 | (d) << 9 | ((off) & 0x1FF))
+#define ST(s, off) (uint16_t)(0x3000 | (s) << 9 | ((off) & 0x1FF))
+#define STI(s, off) (uint16_t)(0xB000 | (s) << 9 | ((off) & 0x1FF))
+#define STR(s, b, off) (uint16_t)(0x7000 | (s) << 9 | (b) << 6 | ((off) & 0x3F))
+#define JSR(off) (uint16_t)(0x4800 | ((off) & 0x7FF))
+#define JSRR(b) (uint16_t)(0x4000 | (b) << 6)
+#define RET 0xC1C0
+#define PUTS 0xF022
+#define HALT 0xF025
+
+/* tight ALU loop: 70 000 inner iterations of ADD/AND/NOT */
+const uint16_t kernel_alu[] = {
+    LD(5, 12),       /* x3000       LD R5, OUTER */
+    LD(4, 10),       /* x3001 outer LD R4, INNER */
+    ADD(0, 0, 1),    /* x3002 inner ADD R0, R0, R1 */
+    ADDI(1, 1, 1),   /* x3003       ADD R1, R1, #1 */
+    AND(2, 0, 1),    /* x3004       AND R2, R0, R1 */
+    NOT(3, 2),       /* x3005       NOT R3, R2 */
+    ADD(0, 0, 3),    /* x3006       ADD R0, R0, R3 */
+    ADDI(4, 4, -1),  /* x3007       ADD R4, R4, #-1 */
+    BRP(-7),         /* x3008       BRp inner */
+    ADDI(5, 5, -1),  /* x3009       ADD R5, R5, #-1 */
+    BRP(-10),        /* x300A       BRp outer */
+    HALT,            /* x300B */
+    10000,           /* x300C INNER */
+    500,             /* x300D OUTER */
+};
+
+/* memory copy: 4096 words from x4000 to x5000 with LDR/STR, 1000 times */
+const uint16_t kernel_copy[] = {
+    LD(5, 15),       /* x3000       LD R5, REPS */
+    LD(1, 11),       /* x3001 outer LD R1, SRC */
+    LD(2, 11),       /* x3002       LD R2, DST */
+    LD(3, 11),       /* x3003       LD R3, COUNT */
+    LDR(0, 1, 0),    /* x3004 copy  LDR R0, R1, #0 */
+    STR(0, 2, 0),    /* x3005       STR R0, R2, #0 */
+    ADDI(1, 1, 1),   /* x3006       ADD R1, R1, #1 */
+    ADDI(2, 2, 1),   /* x3007       ADD R2, R2, #1 */
+    ADDI(3, 3, -1),  /* x3008       ADD R3, R3, #-1 */
+    BRP(-6),         /* x3009       BRp copy */
+    ADDI(5, 5, -1),  /* x300A       ADD R5, R5, #-1 */
+    BRP(-11),        /* x300B       BRp outer */
+    HALT,            /* x300C */
+    0x4000,          /* x300D SRC */
+    0x5000,          /* x300E DST */
+    4096,            /* x300F COUNT */
+    1000,            /* x3010 REPS */
+};
+
+/* pointer chasing with LDI/STI through a ring of 4096 cells at x4000, each pointing 1597 cells further */
+const uint16_t kernel_chase[] = {
+    LD(1, 25),       /* x3000       LD R1, BASE */
+    ANDI(2, 2, 0),   /* x3001       AND R2, R2, #0 */
+    LD(6, 24),       /* x3002       LD R6, COUNT */
+    LD(5, 24),       /* x3003 init  LD R5, STEP */
+    ADD(3, 2, 5),    /* x3004       ADD R3, R2, R5 */
+    LD(5, 23),       /* x3005       LD R5, MASK */
+    AND(3, 3, 5),    /* x3006       AND R3, R3, R5 */
+    LD(5, 18),       /* x3007       LD R5, BASE */
+    ADD(3, 3, 5),    /* x3008       ADD R3, R3, R5 */
+    STR(3, 1, 0),    /* x3009       STR R3, R1, #0 */
+    ADDI(1, 1, 1),   /* x300A       ADD R1, R1, #1 */
+    ADDI(2, 2, 1),   /* x300B       ADD R2, R2, #1 */
+    ADDI(6, 6, -1),  /* x300C       ADD R6, R6, #-1 */
+    BRP(-11),        /* x300D       BRp init */
+    LD(0, 11),       /* x300E       LD R0, BASE */
+    ST(0, 14),       /* x300F       ST R0, P */
+    LD(4, 16),       /* x3010       LD R4, OUTER */
+    LD(6, 14),       /* x3011 outer LD R6, INNER */
+    LDI(0, 11),      /* x3012 chase LDI R0, P */
+    ST(0, 10),       /* x3013       ST R0, P */
+    STI(6, 10),      /* x3014       STI R6, Q */
+    ADDI(6, 6, -1),  /* x3015       ADD R6, R6, #-1 */
+    BRP(-5),         /* x3016       BRp chase */
+    ADDI(4, 4, -1),  /* x3017       ADD R4, R4, #-1 */
+    BRP(-8),         /* x3018       BRp outer */
+    HALT,            /* x3019 */
+    0x4000,          /* x301A BASE */
+    4096,            /* x301B COUNT */
+    1597,            /* x301C STEP */
+    0x0FFF,          /* x301D MASK */
+    0,               /* x301E P */
+    0x6000,          /* x301F Q */
+    10000,           /* x3020 INNER */
+    600,             /* x3021 OUTER */
+};
+
+/* call chains: a recursive subroutine 100 levels deep with R7 saved on the stack, 30000 times */
+const uint16_t kernel_calls[] = {
+    LD(6, 14),       /* x3000       LD R6, STACK */
+    LD(4, 14),       /* x3001       LD R4, OUTER */
+    LD(0, 14),       /* x3002 loop  LD R0, DEPTH */
+    JSR(3),          /* x3003       JSR REC */
+    ADDI(4, 4, -1),  /* x3004       ADD R4, R4, #-1 */
+    BRP(-4),         /* x3005       BRp loop */
+    HALT,            /* x3006 */
+    ADDI(6, 6, -1),  /* x3007 REC   ADD R6, R6, #-1 */
+    STR(7, 6, 0),    /* x3008       STR R7, R6, #0 */
+    ADDI(0, 0, -1),  /* x3009       ADD R0, R0, #-1 */
+    BRZ(1),          /* x300A       BRz done */
+    JSR(-5),         /* x300B       JSR REC */
+    LDR(7, 6, 0),    /* x300C done  LDR R7, R6, #0 */
+    ADDI(6, 6, 1),   /* x300D       ADD R6, R6, #1 */
+    RET,             /* x300E */
+    0xF000,          /* x300F STACK */
+    30000,           /* x3010 OUTER */
+    100,             /* x3011 DEPTH */
+};
+
+/* output: 200 000 PUTS of a 64 character line, MSG follows the code */
+const uint16_t kernel_puts[] = {
+    LD(5, 9),        /* x3000       LD R5, OUTER */
+    LD(4, 7),        /* x3001 outer LD R4, INNER */
+    LEA(0, 8),       /* x3002 loop  LEA R0, MSG */
+    PUTS,            /* x3003 */
+    ADDI(4, 4, -1),  /* x3004       ADD R4, R4, #-1 */
+    BRP(-4),         /* x3005       BRp loop */
+    ADDI(5, 5, -1),  /* x3006       ADD R5, R5, #-1 */
+    BRP(-7),         /* x3007       BRp outer */
+    HALT,            /* x3008 */
+    10000,           /* x3009 INNER */
+    20,              /* x300A OUTER */
+};
+
+/* JSR and JSRR right after an instruction setting the flags from R7, an ALU result or a load: the linkage
+   overwrites R7, not the flags, so every BRz is taken on every engine and the early HALTs never run */
+const uint16_t kernel_linkage[] = {
+    LD(5, 26),       /* x3000       LD R5, OUTER */
+    LD(4, 24),       /* x3001 outer LD R4, INNER */
+    ANDI(7, 7, 0),   /* x3002 loop  AND R7, R7, #0 */
+    JSR(20),         /* x3003       JSR SUB */
+    BRZ(1),          /* x3004       BRz +1 */
+    HALT,            /* x3005 */
+    LEA(1, 17),      /* x3006       LEA R1, SUB */
+    ANDI(7, 7, 0),   /* x3007       AND R7, R7, #0 */
+    JSRR(1),         /* x3008       JSRR R1 */
+    BRZ(1),          /* x3009       BRz +1 */
+    HALT,            /* x300A */
+    LDR(7, 1, 1),    /* x300B       LDR R7, R1, #1 ; ZERO */
+    JSRR(1),         /* x300C       JSRR R1 */
+    BRZ(1),          /* x300D       BRz +1 */
+    HALT,            /* x300E */
+    LDR(7, 1, 1),    /* x300F       LDR R7, R1, #1 ; ZERO */
+    JSR(7),          /* x3010       JSR SUB */
+    BRZ(1),          /* x3011       BRz +1 */
+    HALT,            /* x3012 */
+    ADDI(4, 4, -1),  /* x3013       ADD R4, R4, #-1 */
+    BRP(-19),        /* x3014       BRp loop */
+    ADDI(5, 5, -1),  /* x3015       ADD R5, R5, #-1 */
+    BRP(-22),        /* x3016       BRp outer */
+    HALT,            /* x3017 */
+    RET,             /* x3018 SUB */
+    0,               /* x3019 ZERO */
+    10000,           /* x301A INNER */
+    200,             /* x301B OUTER */
+};
+
+/* reading the condition codes through the PSR register (xFFFC) right after an ADD set them: while R1 counts up to 0
+   the PSR has N, only when R1 reaches 0 it has Z, otherwise the early HALT runs */
+const uint16_t kernel_psr[] = {
+    LD(5, 13),        /* x3000       LD R5, OUTER */
+    LD(1, 11),        /* x3001 outer LD R1, START */
+    ADDI(1, 1, 1),    /* x3002 loop  ADD R1, R1, #1 */
+    LDI(0, 8),        /* x3003       LDI R0, PSR */
+    ANDI(0, 0, 2),    /* x3004       AND R0, R0, #2 ; Z */
+    BRZ(-4),          /* x3005       BRz loop */
+    ADDI(1, 1, 0),    /* x3006       ADD R1, R1, #0 */
+    BRZ(1),           /* x3007       BRz +1 */
+    HALT,             /* x3008 */
+    ADDI(5, 5, -1),   /* x3009       ADD R5, R5, #-1 */
+    BRP(-10),         /* x300A       BRp outer */
+    HALT,             /* x300B */
+    0xFFFC,           /* x300C PSR */
+    (uint16_t)-10000, /* x300D START */
+    100,              /* x300E OUTER */
+};
+
+struct kernel
+{
+    const char *name;
+    const uint16_t *code; /* at x3000 */
+    size_t count;
+    const char *text;     /* appended as a zero-terminated string */
+    uint64_t expected;    /* instructions up to and including HALT */
+};
+
+#define KERNEL(name, text, expected) {#name, kernel_##name, sizeof(kernel_##name) / sizeof(uint16_t), text, expected}
+
+const struct kernel kernels[] = {
+    KERNEL(alu, NULL, 1 + 500 * (1 + 10000 * 7 + 2) + 1),
+    KERNEL(copy, NULL, 1 + 1000 * (3 + 4096 * 6 + 2) + 1),
+    KERNEL(chase, NULL, 3 + 4096 * 11 + 3 + 600 * (1 + 10000 * 5 + 2) + 1),
+    KERNEL(calls, NULL, 2 + 30000 * (4 + 99 * 8 + 7) + 1),
+    KERNEL(linkage, NULL, 1 + 200 * (1 + 10000 * 19 + 2) + 1),
+    KERNEL(psr, NULL, 1 + 100 * (1 + 10000 * 4 + 4) + 1),
+    KERNEL(puts, "The quick brown fox jumps over the lazy dog. 0123456789 ABCDEF.\n", 1 + 20 * (1 + 10000 * 4 + 2) + 1),
+};
+
+#define BENCH_SLICE 100000
+
+struct bench
+{
+    int runs;
+    int fuse;
+    uint64_t max_steps;     /* images only, 0: no limit */
+    const char *input_path; /* images only */
+    const char **images;
+    int image_count;
+};
+
+double seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/**
+ * Run a kernel (`k`) or the images once, returns the instructions executed and their time; 0 on failure
+ */
+uint64_t run_once(const struct bench *b, int engine, const struct kernel *k, double *elapsed)
+{
+    struct lc3_config config;
+    lc3_default_config(&config);
+    config.engine = engine;
+    config.flush_policy = 0;
+    config.fuse = b->fuse;
+    config.output = fopen("/dev/null", "wb");
+    config.input = fopen(b->input_path && !k ? b->input_path : "/dev/null", "rb");
+    struct lc3_vm *vm = config.output && config.input ? lc3_create(&config) : NULL;
+
+    int ok = vm != NULL;
+    if (ok && k)
+    {
+        uint16_t image[1 << 16];
+        size_t count = k->count, len = k->text ? strlen(k->text) : 0;
+        memcpy(image, k->code, count * sizeof(uint16_t));
+        for (size_t i = 0; k->text && i <= len; ++i)
+        {
+            image[count++] = (uint8_t)k->text[i];
+        }
+        ok = lc3_load_words(vm, 0x3000, image, count);
+    }
+    for (int i = 0; ok && !k && i < b->image_count; ++i)
+    {
+        ok = lc3_load_image(vm, b->images[i]);
+    }
+
+    uint64_t retired = 0;
+    if (ok)
+    {
+        double start = seconds();
+        if (k)
+        {
+            lc3_run(vm, 0);
+        }
+        else
+        {
+            /* a game waiting for keys after the script ended only measures its input loop */
+            while (lc3_run(vm, BENCH_SLICE) == LC3_YIELD && !feof(config.input) &&
+                   (!b->max_steps || lc3_retired(vm) < b->max_steps))
+                ;
+        }
+        lc3_flush(vm);
+        *elapsed = seconds() - start;
+        retired = lc3_retired(vm);
+    }
+    lc3_destroy(vm);
+    if (config.output)
+    {
+        fclose(config.output);
+    }
+    if (config.input)
+    {
+        fclose(config.input);
+    }
+    return retired;
+}
+
+/**
+ * Run a kernel (or the images) `runs` times on one engine and print a line of the report
+ */
+int bench_engine(const struct bench *b, const char *engine_name, int engine, const struct kernel *k)
+{
+    double mips[64], ns = 0, mean = 0, var = 0;
+    uint64_t retired = 0;
+    int runs = b->runs;
+    for (int r = 0; r < runs; ++r)
+    {
+        double elapsed = 0;
+        retired = run_once(b, engine, k, &elapsed);
+        if (retired == 0 || (k && retired != k->expected))
+        {
+            printf("%-8s %-9s failed: %llu instructions\n", k ? k->name : b->images[0], engine_name, (unsigned long long)retired);
+            return 0;
+        }
+        mips[r] = retired / elapsed / 1e6;
+        ns += elapsed * 1e9 / retired;
+        mean += mips[r];
+    }
+    mean /= runs;
+    for (int r = 0; r < runs; ++r)
+    {
+        var += (mips[r] - mean) * (mips[r] - mean);
+    }
+    var = runs > 1 ? var / (runs - 1) : 0;
+
+    printf("%-8s %-9s %9.1f %8.1f %9.3f %13llu\n", k ? k->name : b->images[0], engine_name, mean, sqrt(var), ns / runs,
+           (unsigned long long)retired);
+    return 1;
+}
+
+int main(int argc, const char *argv[])
+{
+    static const char *const engine_names[] = {"switch", "threaded", "jit"};
+    struct bench b = {.runs = 5, .fuse = 1, .max_steps = 100000000};
+    const char *only_engine = NULL, *only_kernel = NULL;
+    b.images = calloc((size_t)argc, sizeof(const char *));
+
+    for (int j = 1; j < argc; ++j)
+    {
+        int engine;
+        if (strncmp(argv[j], "--engine=", 9) == 0)
+        {
+            only_engine = argv[j] + 9;
+            if (!lc3_parse_engine(only_engine, &engine))
+            {
+                printf("unknown engine: %s\n", only_engine);
+                exit(2);
+            }
+        }
+        else if (strncmp(argv[j], "--runs=", 7) == 0)
+        {
+            b.runs = atoi(argv[j] + 7);
+        }
+        else if (strncmp(argv[j], "--kernel=", 9) == 0)
+        {
+            only_kernel = argv[j] + 9;
+        }
+        else if (strncmp(argv[j], "--steps=", 8) == 0)
+        {
+            b.max_steps = strtoull(argv[j] + 8, NULL, 10);
+        }
+        else if (strcmp(argv[j], "--no-fuse") == 0)
+        {
+            b.fuse = 0;
+        }
+        else if (strncmp(argv[j], "--input=", 8) == 0)
+        {
+            b.input_path = argv[j] + 8;
+        }
+        else
+        {
+            b.images[b.image_count++] = argv[j];
+        }
+    }
+    if (b.runs < 1 || b.runs > 64)
+    {
+        printf("lc3-bench [--engine=switch|threaded|jit] [--runs=1..64] [--no-fuse] [--kernel=NAME] [--steps=N] [--input=FILE] [image-file1 ...]\n");
+        exit(2);
+    }
+
+    int ok = 1;
+    printf("%-8s %-9s %9s %8s %9s %13s\n", "program", "engine", "MIPS", "+-", "ns/instr", "instructions");
+    for (int e = 0; e < 3; ++e)
+    {
+        int engine;
+        if (!lc3_parse_engine(engine_names[e], &engine) || (only_engine && strcmp(only_engine, engine_names[e]) != 0))
+        {
+            continue; /* not in this build, or not asked for */
+        }
+        if (b.image_count > 0)
+        {
+            ok &= bench_engine(&b, engine_names[e], engine, NULL);
+            continue;
+        }
+        for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); ++i)
+        {
+            if (!only_kernel || strcmp(only_kernel, kernels[i].name) == 0)
+            {
+                ok &= bench_engine(&b, engine_names[e], engine, &kernels[i]);
+            }
+        }
+    }
+    free(b.images);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,6464 @@
+#if defined(__linux__)
+#define _GNU_SOURCE /* POSIX/BSD/GNU extensions such as MAP_ANONYMOUS and memfd_create() are hidden by -std=c2x */
+#endif
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#if defined(__APPLE__) || defined(__linux__)
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/time.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#else
+#include <Windows.h>
+#include <conio.h> // _kbhit
+#endif
+
+#include "lc3.h"
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LC3_INLINE static inline __attribute__((always_inline))
+#define LC3_HAVE_THREADED 1 /* labels-as-values are available */
+#define LC3_CTZ(x) __builtin_ctz(x)
+#define LC3_CTZ64(x) __builtin_ctzll(x)
+#else
+#include <intrin.h>
+#define LC3_INLINE static __forceinline
+LC3_INLINE int LC3_CTZ(uint32_t x)
+{
+    unsigned long i;
+    _BitScanForward(&i, x);
+    return (int)i;
+}
+LC3_INLINE int LC3_CTZ64(uint64_t x)
+{
+    unsigned long i;
+    _BitScanForward64(&i, x);
+    return (int)i;
+}
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define LC3_HAVE_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define LC3_HAVE_NEON 1
+#endif
+
+#if defined(__x86_64__) && (defined(__APPLE__) || defined(__linux__))
+#define LC3_HAVE_JIT 1 /* native code generation, see region JIT */
+#endif
+
+// LC-3 has 65536 memory locations,
+// each of which stores a 16-bit value.
+
+#define MEMORY_MAX (1 << 16 /* 65_536 */)
+
+/**
+ * LC-3 has 10 total register, each of which is 16 bits.
+ * Most of them are general purpose, but a few have designated roles:
+ * - 8 general purpose registers (R0-R7) can be used to perform any program calculations.
+ * - 1 program counter (PC) register.
+ * - 1 condition flags (COND) register tells us information about the previous calculation.
+ */
+enum
+{
+#pragma region General purpose registers
+    R_R0 = 0,
+    R_R1,
+    R_R2,
+    R_R3,
+    R_R4,
+    R_R5,
+    R_R6,
+    R_R7,
+#pragma endregion
+    R_PC,   /* Program counter */
+    R_COND, /* Condition flags. The R_COND register stores condition flags which provide information about the most recently executed calculation. This allows programs to check logical conditions such as if (x > 0) { ... }. */
+
+    R_COUNT /* Just contain total number of registers */
+};
+
+/**
+ * There are just 16 opcodes in LC-3.
+ * Each instruction is 16 bits long, with the left 4 bits storing the opcode.
+ * The rest of the bits are used to store the parameters.
+ */
+enum
+{
+    OP_BR = 0, /* branch */
+    OP_ADD,    /* add  */
+    OP_LD,     /* load */
+    OP_ST,     /* store */
+    OP_JSR,    /* jump register */
+    OP_AND,    /* bitwise and */
+    OP_LDR,    /* load register */
+    OP_STR,    /* store register */
+    OP_RTI,    /* return from interrupt, see region Interrupts */
+    OP_NOT,    /* bitwise not */
+    OP_LDI,    /* load indirect */
+    OP_STI,    /* store indirect */
+    OP_JMP,    /* jump */
+    OP_RES,    /* reserved (unused) */
+    OP_LEA,    /* load effective address */
+    OP_TRAP    /* execute trap */
+};
+
+/**
+ * The LC-3 uses only 3 condition flags which indicate the sign of the previous calculation.
+ */
+enum
+{
+    FL_POS = 1 << 0, /* P */
+    FL_ZRO = 1 << 1, /* Z */
+    FL_NEG = 1 << 2, /* N */
+};
+
+/**
+ *
+ */
+enum
+{
+    TRAP_GETC = 0x20,  /* get character from keyboard, not echoed onto the terminal */
+    TRAP_OUT = 0x21,   /* output a character */
+    TRAP_PUTS = 0x22,  /* output a word string */
+    TRAP_IN = 0x23,    /* get character from keyboard, echoed onto the terminal */
+    TRAP_PUTSP = 0x24, /* output a byte string */
+    TRAP_HALT = 0x25,  /* halt the program */
+    /* host calls (config.host_calls), see region Traps */
+    TRAP_MEMCPY = 0x30, /* copy R2 words from R1 to R0, overlapping or not */
+    TRAP_MEMSET = 0x31, /* store R1 into R2 words from R0 */
+    TRAP_MUL = 0x32,    /* R0 = R0 * R1 */
+    TRAP_DIV = 0x33,    /* R0 = R0 / R1, R1 = R0 % R1, signed and truncating */
+    TRAP_PUTD = 0x34,   /* output R0 as a signed decimal */
+};
+
+/**
+ * Memory mapped register
+ */
+enum
+{
+    MR_KBSR = 0xFE00, /* keyboard status */
+    MR_KBDR = 0xFE02, /* keyboard data */
+    MR_PSR = 0xFFFC,  /* processor status, read only; see region Interrupts */
+};
+
+#define KBSR_READY (1 << 15)
+#define KBSR_IE (1 << 14) /* keyboard interrupt enable, see region Interrupts */
+
+/**
+ * Memory is split into 256 pages of 256 words.
+ * The attributes of a page decide whether an access can go straight to `memory`:
+ * ordinary RAM is one array access, only device pages pay for a handler call.
+ */
+#define PAGE_SHIFT 8
+#define PAGE_COUNT (MEMORY_MAX >> PAGE_SHIFT)
+#define PAGE_WORDS (1 << PAGE_SHIFT)
+
+enum
+{
+    PAGE_DEVICE = 1 << 0, /* accesses go through the handlers in device_map */
+    PAGE_JIT = 1 << 1,    /* holds translated instructions, see region JIT */
+    PAGE_CLEAN = 1 << 2,  /* not written since the images were loaded, the next store marks it in page_dirty */
+    PAGE_WATCH = 1 << 3,  /* has a watchpoint, see region Debugger */
+};
+
+typedef uint16_t (*device_read_fn)(struct lc3_vm *vm, uint16_t addr);
+typedef void (*device_write_fn)(struct lc3_vm *vm, uint16_t addr, uint16_t val);
+
+/**
+ * Handlers of a device page
+ */
+struct device
+{
+    device_read_fn read;
+    device_write_fn write;
+};
+
+/**
+ * Handlers of the pre-decoded instruction cache.
+ * A handler is more specific than an opcode: it already knows the addressing mode
+ * (register or immediate ADD/AND, JSR or JSRR), so executing it never looks at the raw instruction bits again.
+ * H_DECODE must stay 0 so that a zero-initialized cache entry means "not decoded yet".
+ */
+enum
+{
+    H_DECODE = 0, /* empty entry, the instruction must be fetched and decoded first */
+    H_BR,
+    H_ADD,  /* ADD DR, SR1, SR2 */
+    H_ADDI, /* ADD DR, SR1, imm5 */
+    H_AND,  /* AND DR, SR1, SR2 */
+    H_ANDI, /* AND DR, SR1, imm5 */
+    H_NOT,
+    H_LD,
+    H_LDI,
+    H_LDR,
+    H_LEA,
+    H_ST,
+    H_STI,
+    H_STR,
+    H_JMP,
+    H_JSR,  /* JSR PCoffset11 */
+    H_JSRR, /* JSRR BaseR */
+    H_JSR_NATIVE, /* JSR to a known subroutine, `r2` says which, see region Native routines */
+    H_TRAP,
+    H_BAD,   /* OP_RES, OP_RTI */
+    H_BREAK, /* the instruction has a breakpoint or a watchpoint stop is due, see debug_break() */
+
+    /* superinstructions, see fuse() */
+    H_LOAD_CONST,   /* AND R, R, #0; ADD R, R, #imm */
+    H_ADDI_BR,      /* ADD DR, SR1, imm5; BR */
+    H_LDR_ADDI_STR, /* LDR R1, B, #off; ADD R2, R1, #imm; STR R2, B, #off */
+    H_NEG,          /* NOT R, SR; ADD R, R, #1 */
+    H_COUNT
+};
+
+#define FUSED_FIRST H_LOAD_CONST
+#define FUSED_COUNT (H_COUNT - FUSED_FIRST)
+
+/* the subroutines of region Native routines */
+enum
+{
+    ROUTINE_DIV,
+    ROUTINE_MUL,
+    ROUTINE_MOD,
+    ROUTINE_COUNT
+};
+
+/**
+ * An instruction split into its operands.
+ * Entries are filled lazily the first time an address is fetched and dropped again by mem_write().
+ */
+struct decoded_instr
+{
+    uint8_t handler; /* H_* */
+    uint8_t r0;      /* DR, SR of stores, or the nzp mask of BR - bit 9..11 */
+    uint8_t r1;      /* SR1 / BaseR - bit 6..8 */
+    uint8_t r2;      /* SR2 - bit 0..2 */
+    uint16_t imm;    /* sign-extended imm5 / offset6, trapvect8, or the already computed target address of PC-relative instructions */
+    uint16_t instr;  /* raw instruction */
+};
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+#define INPUT_RING_SIZE 256 /* power of two */
+#define INPUT_EOF 0xFFFF
+
+#define IDLE_SPINS 4096    /* KBSR reads without a key before input_idle() looks at the clock */
+#define IDLE_WINDOW_MS 10  /* ... and they came faster than this: the guest is only polling */
+#define IDLE_TIMEOUT_MS 10 /* longest sleep of an idle guest, it is polling for a reason */
+#define IDLE_RESPINS 64    /* reads before the next sleep of a guest that stayed idle */
+
+struct input_ring
+{
+    _Atomic uint32_t head; /* next slot to fill, only moved by the producer */
+    _Atomic uint32_t tail; /* next slot to read, only moved by the consumer */
+    uint16_t data[INPUT_RING_SIZE];
+};
+
+#ifdef LC3_HAVE_JIT
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 32 /* block entries before the block gets translated */
+#endif
+#define JIT_MAX_BLOCK_LEN 64          /* LC-3 instructions per block */
+#define JIT_MAX_BLOCKS 8192           /* translated blocks before the whole cache is flushed */
+#define JIT_CODE_SIZE (4 << 20)       /* size of the executable buffer */
+#define JIT_MAX_CODE_PER_INSTR 256    /* upper bound of the native code of one instruction, exits included */
+
+typedef void (*jit_fn)(uint16_t *reg, uint16_t *memory);
+
+struct trap_handler
+{
+    lc3_trap_fn fn;
+    void *user;
+};
+
+struct jit_block
+{
+    jit_fn code;        /* NULL once invalidated */
+    uint8_t *body;      /* code after the prologue, where chained blocks jump to */
+    uint16_t start;     /* address of the first instruction */
+    uint16_t end;       /* address of the last instruction */
+    uint16_t chain[2];  /* blocks this block jumps to directly */
+    uint8_t chain_count;
+};
+#endif
+
+/**
+ * Everything one VM owns.
+ * `memory` comes first: lc3_create() allocates page-aligned, so cached images can be mapped over it.
+ */
+struct lc3_vm
+{
+    uint16_t memory[MEMORY_MAX]; /* 65_536 memory locations */
+    uint16_t reg[R_COUNT];
+    uint16_t cond_value;  /* result of the last flag-setting instruction, see update_flags() */
+    int running;          /* cleared by TRAP_HALT, a bad opcode, and for a moment by input_block() */
+    uint64_t steps_left;  /* instructions the current lc3_run() may still execute */
+    uint64_t deadline;    /* now_ms() at which lc3_run() returns LC3_DEADLINE, 0: none; see lc3_set_deadline() */
+    uint64_t retired;     /* instructions of all earlier lc3_run() calls */
+    struct lc3_metrics *metrics; /* config.metrics or `own_metrics`, see region Metrics */
+    struct lc3_metrics own_metrics;
+    struct lc3_config config;
+    struct lc3_profile *profile; /* region Profile, NULL unless config.profile */
+    struct lc3_trace_record *trace; /* region Trace, a ring of config.trace_size records; NULL without a trace */
+    uint64_t trace_count;           /* records written to it */
+
+    /* region Debugger */
+    uint8_t break_bits[MEMORY_MAX >> 3]; /* addresses with a breakpoint, one bit each; their entries decode to H_BREAK */
+    uint8_t watch_kinds[MEMORY_MAX];     /* lc3_watch bits by address */
+    uint16_t page_watches[PAGE_COUNT];   /* watched addresses by page, pages with any have PAGE_WATCH */
+    unsigned debug_points;               /* breakpoints and watched addresses; while there are any nothing is fused or translated */
+    int break_resume;                    /* the next H_BREAK runs its instruction: lc3_run() started on a breakpoint */
+    int watch_pending;                   /* a watchpoint was hit, decoded[watch_stop_pc] holds H_BREAK until the stop */
+    uint16_t watch_stop_pc;
+    uint16_t watch_addr;                 /* the access that hit it */
+    unsigned watch_kind;
+    int stop;                            /* lc3_status for lc3_run() when a breakpoint, a watchpoint, a bad opcode or input ended the engine */
+
+    /* region Traps */
+    struct trap_handler traps[256]; /* by vector, no `fn`: unknown trap */
+
+    /* region Interrupts */
+    uint16_t psr;        /* PSR_USER and the priority; the condition codes stay in reg[R_COND] */
+    uint16_t saved_ssp;  /* R6 of the other mode */
+    uint16_t saved_usp;
+    struct lc3_fault fault; /* why the guest died, code LC3_FAULT_NONE while it has not */
+
+    /* region Memory */
+    uint8_t page_flags[PAGE_COUNT];
+    uint8_t page_dirty[PAGE_COUNT >> 3]; /* RAM pages written since the images were loaded, one bit per page */
+    struct device device_map[PAGE_COUNT];
+    struct decoded_instr decoded_guard[2];    /* stores clear the two entries before theirs, these are below address 0 */
+    struct decoded_instr decoded[MEMORY_MAX]; /* one entry per memory location */
+    struct decoded_instr uncached;            /* scratch entry for fetches from device pages */
+    uint32_t fused_formed[FUSED_COUNT];       /* superinstructions made by fuse(), by H_* - FUSED_FIRST */
+    uint64_t fused_runs[FUSED_COUNT];         /* and how often they ran */
+    uint64_t routine_keys[ROUTINE_COUNT];     /* routine_key() of each known subroutine, see region Native routines */
+    uint32_t routine_sites[ROUTINE_COUNT];    /* JSRs decoded to H_JSR_NATIVE, by ROUTINE_* */
+    uint64_t routine_runs[ROUTINE_COUNT];     /* and the calls that ran natively */
+
+    /* region Output */
+    char output_buffer[OUTPUT_BUFFER_SIZE];
+    size_t output_len;
+    uint64_t output_since;  /* time of the oldest buffered byte */
+    unsigned output_writes; /* the clock is only looked at on every 64th write */
+    char *captured;         /* config.capture_output, see lc3_output() */
+    size_t captured_len;
+    size_t captured_cap;
+
+    /* region Input */
+    struct input_ring input_ring;
+    _Atomic int input_eof; /* the producer reached end of input */
+    unsigned input_polls;  /* KBSR reads since the host was last polled */
+    unsigned idle_polls;   /* KBSR reads without a key, see input_idle() */
+    uint64_t idle_since;   /* when they were last counted */
+    int input_started;     /* see lc3_start_input() */
+    size_t input_pos;      /* next byte of config.input_data */
+    uint64_t input_reads;  /* KBSR reads and input traps of the guest, the clock of recordings */
+    uint64_t record_last;  /* input_reads at the last recorded key */
+    int record_eof;        /* the end of input is recorded */
+    int replaying;         /* lc3_replay() */
+    uint8_t *replay_data;
+    size_t replay_size;
+    size_t replay_pos;     /* of the event after the next one */
+    int replay_pending;    /* replay_at and replay_key hold the next event */
+    uint64_t replay_at;
+    uint16_t replay_key;
+#if defined(__APPLE__) || defined(__linux__)
+    pthread_mutex_t input_lock;
+    pthread_cond_t input_arrived;
+#else
+    CRITICAL_SECTION input_lock;
+    CONDITION_VARIABLE input_arrived;
+#endif
+
+    /* region Image loading and region Snapshot */
+    uint8_t image_pages[PAGE_COUNT]; /* pages already written by an image, a mapping over them would lose data */
+    uint16_t image_first;            /* the words the last image put into memory */
+    uint32_t image_count;
+    int tracking;                    /* stores are tracked in page_dirty, see snapshot_begin() */
+    int snapshot_taken;
+    uint64_t snapshot_base_hash;
+    char **snapshot_images; /* paths of the loaded images, in load order */
+    uint16_t snapshot_image_count;
+
+    /* region Analysis */
+    uint8_t analysis[MEMORY_MAX]; /* ANALYSIS_* bits by address */
+    int analyzed;                 /* the cache holds entries decoded ahead of time, maybe translated blocks as well */
+
+#ifdef LC3_HAVE_JIT
+    /* region JIT; mem_write() uses PAGE_JIT and the bit map to find out cheaply whether a store hit translated code */
+    jit_fn jit_entry[MEMORY_MAX];           /* native code of the block starting at each address */
+    uint8_t jit_code_bits[MEMORY_MAX >> 3]; /* translated instructions, one bit per address */
+    uint8_t jit_counter[MEMORY_MAX];        /* entries of not yet translated blocks */
+    int jit_native;                         /* translated code is running, it keeps the guest registers in host registers */
+    struct jit_block jit_blocks[JIT_MAX_BLOCKS];
+    int jit_block_count;
+    uint8_t *jit_code; /* mmap'd executable buffer */
+    size_t jit_code_used;
+    unsigned jit_generation; /* bumped by every invalidation */
+#endif
+};
+
+#ifdef LC3_HAVE_JIT
+void jit_invalidate(struct lc3_vm *vm, uint16_t addr);
+#endif
+void trace_dump(struct lc3_vm *vm);
+void debug_watch_hit(struct lc3_vm *vm, uint16_t addr, unsigned kind);
+int routine_find(const struct lc3_vm *vm, uint16_t addr);
+
+/**
+ * Condition flags are evaluated lazily.
+ * Instead of working out N/Z/P after every ALU and load instruction,
+ * the VM only remembers the value they depend on (`cond_value`). reg[R_COND] is brought up to date by get_cond().
+ */
+
+/**
+ * N/Z/P of a result
+ */
+LC3_INLINE uint16_t cond_flags(uint16_t value)
+{
+    return ((value >> 15) << 2 /* a `1` in the left-most bit indicates negative number in `Two's complement` */)
+           | ((value == 0) << 1)
+           | ((int16_t)value > 0);
+}
+
+/**
+ * Update register R_COND, lazily: only the result is recorded
+ */
+LC3_INLINE void update_flags(struct lc3_vm *vm, uint16_t r)
+{
+    vm->cond_value = vm->reg[r];
+}
+
+/**
+ * Work out the condition flags, for anything that reads reg[R_COND]
+ */
+uint16_t get_cond(struct lc3_vm *vm)
+{
+    vm->reg[R_COND] = cond_flags(vm->cond_value);
+    return vm->reg[R_COND];
+}
+
+/**
+ * Set the condition flags, for anything that writes reg[R_COND]
+ */
+void set_cond(struct lc3_vm *vm, uint16_t flags)
+{
+    vm->cond_value = (flags & FL_NEG) ? 0x8000 : (flags & FL_ZRO) ? 0 : 1;
+    vm->reg[R_COND] = flags;
+}
+
+uint16_t sign_extend(uint16_t x, int bit_count)
+{
+    if ((x >> (bit_count - 1)) & 1 /* a `1` in the left-most bit indicates negative number in `Two's complement` */)
+    {
+        x |= (0xFFFF << bit_count); /* Fill missing bit to 1 upto 16 bits for negative number */
+    }
+    return x /* Keep x if x is positive*/;
+}
+
+/**
+ * Record the first store into a page, see region Snapshot
+ */
+void mem_mark_dirty(struct lc3_vm *vm, uint16_t page)
+{
+    vm->page_dirty[page >> 3] |= 1 << (page & 7);
+    vm->page_flags[page] &= ~PAGE_CLEAN;
+}
+
+uint16_t swap16(uint16_t x)
+{
+    return (x << 8) | (x >> 8);
+}
+
+/**
+ * Copy `count` big-endian words from `src` into `dst`, swapping them to host order.
+ * `src` needs no alignment, so it can point straight into a mapped image file.
+ */
+void swap16_copy(uint16_t *dst, const uint8_t *src, size_t count)
+{
+    size_t i = 0;
+#if defined(LC3_HAVE_SSE2)
+    /* SSE2 has no byte shuffle, but a swap inside 16-bit lanes is just two shifts */
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 2 * i + 16));
+        a = _mm_or_si128(_mm_slli_epi16(a, 8), _mm_srli_epi16(a, 8));
+        b = _mm_or_si128(_mm_slli_epi16(b, 8), _mm_srli_epi16(b, 8));
+        _mm_storeu_si128((__m128i *)(dst + i), a);
+        _mm_storeu_si128((__m128i *)(dst + i + 8), b);
+    }
+#elif defined(LC3_HAVE_NEON)
+    for (; i + 16 <= count; i += 16)
+    {
+        uint8x16_t a = vrev16q_u8(vld1q_u8(src + 2 * i));
+        uint8x16_t b = vrev16q_u8(vld1q_u8(src + 2 * i + 16));
+        vst1q_u16(dst + i, vreinterpretq_u16_u8(a));
+        vst1q_u16(dst + i + 8, vreinterpretq_u16_u8(b));
+    }
+#endif
+    for (; i < count; ++i)
+    {
+        dst[i] = (uint16_t)((src[2 * i] << 8) | src[2 * i + 1]);
+    }
+}
+
+/**
+ * FNV-1a, to recognize images and cached data
+ */
+uint64_t fnv1a(const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; ++i)
+    {
+        h = (h ^ p[i]) * 0x100000001b3ull;
+    }
+    return h;
+}
+
+/**
+ * Load program into address
+ *
+ * The first 16 bits of the program file specify the address in memory where the program should start.
+ * This address is called the origin. It must be read first,
+ * after which the rest of the data can be read from the file into memory starting at the origin address.
+ */
+void read_image_file(struct lc3_vm *vm, FILE *file)
+{
+    /* the origin tells us where in memory to place the image */
+    uint8_t head[2];
+    if (fread(head, sizeof(head), 1, file) != 1)
+    {
+        return;
+    }
+    uint16_t origin = (uint16_t)((head[0] << 8) | head[1]);
+
+    /* we know the maximum file size so we only need one fread */
+    size_t max_read = MEMORY_MAX - origin;
+    uint16_t *p = vm->memory + origin;
+    size_t read = fread(p, sizeof(uint16_t), max_read, file);
+
+    /* swap to little endian */
+    /* LC-3 programs are big-endian, but most modern computers are little-endian. So, we need to swap each uint16 that is loaded. */
+    swap16_copy(p, (const uint8_t *)p, read);
+    vm->image_first = origin;
+    vm->image_count = (uint32_t)read;
+}
+
+#if defined(__APPLE__) || defined(__linux__)
+/**
+ * Image cache (--image-cache)
+ *
+ * Next to `prog.obj` the VM keeps `prog.obj.lc3c`: the image already in host byte order,
+ * laid out so that its words start at a page-aligned file offset and a page-aligned address.
+ * A later run maps it over `memory` with MAP_PRIVATE|MAP_FIXED:
+ * loading costs a few system calls, and stores of the program only copy the pages they touch.
+ * The cache is rebuilt whenever the .obj changes: its inode, size, or modification or status change time
+ * to the nanosecond. A rewrite always moves the status change time, even one that restores the old mtime.
+ */
+#define IMAGE_CACHE_MAGIC 0x4333434Cu /* "LC3C", a cache written by a host of the other byte order does not match */
+#define IMAGE_CACHE_VERSION 2
+
+int64_t stat_mtime_ns(const struct stat *st)
+{
+#if defined(__APPLE__)
+    return (int64_t)st->st_mtimespec.tv_sec * 1000000000 + st->st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+#endif
+}
+
+int64_t stat_ctime_ns(const struct stat *st)
+{
+#if defined(__APPLE__)
+    return (int64_t)st->st_ctimespec.tv_sec * 1000000000 + st->st_ctimespec.tv_nsec;
+#else
+    return (int64_t)st->st_ctim.tv_sec * 1000000000 + st->st_ctim.tv_nsec;
+#endif
+}
+
+struct image_cache_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t page_size;       /* host page size the cache was built for, the words start at this file offset */
+    uint16_t origin;          /* first address of the image */
+    uint16_t base;            /* first address stored in the file: the origin rounded down to a host page */
+    uint32_t words;           /* number of words stored, counted from `base` */
+    uint32_t reserved;
+    uint64_t source_size;     /* the .obj the cache was built from */
+    uint64_t source_ino;
+    int64_t source_mtime_ns;
+    int64_t source_ctime_ns;
+    uint64_t checksum;        /* FNV-1a of the stored words */
+    uint64_t header_checksum; /* FNV-1a of all fields above */
+};
+
+/** every load of an image ends here, which also remembers it for analyze_image() */
+void image_mark_pages(struct lc3_vm *vm, size_t first, size_t count)
+{
+    vm->image_first = (uint16_t)first;
+    vm->image_count = (uint32_t)count;
+    for (size_t page = first >> PAGE_SHIFT; page <= (first + count - 1) >> PAGE_SHIFT; ++page)
+    {
+        vm->image_pages[page] = 1;
+    }
+}
+
+int image_pages_free(struct lc3_vm *vm, size_t first, size_t count)
+{
+    for (size_t page = first >> PAGE_SHIFT; page <= (first + count - 1) >> PAGE_SHIFT; ++page)
+    {
+        if (vm->image_pages[page])
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void image_cache_path(char *buf, size_t size, const char *image_path)
+{
+    snprintf(buf, size, "%s.lc3c", image_path);
+}
+
+/**
+ * Map the image in cache layout in `fd` into memory if it was built from `source`, returns 0 otherwise.
+ * `fd` stays open.
+ */
+int image_cache_map(struct lc3_vm *vm, int fd, const struct stat *source)
+{
+    struct image_cache_header h;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    struct stat st;
+    int ok = pread(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) && fstat(fd, &st) == 0 &&
+             h.magic == IMAGE_CACHE_MAGIC && h.version == IMAGE_CACHE_VERSION &&
+             h.header_checksum == fnv1a(&h, offsetof(struct image_cache_header, header_checksum)) &&
+             h.page_size == page_size && h.words > 0 && (size_t)h.base + h.words <= MEMORY_MAX &&
+             h.origin >= h.base && (uint64_t)st.st_size >= h.page_size + 2ull * h.words &&
+             h.source_size == (uint64_t)source->st_size && h.source_ino == (uint64_t)source->st_ino &&
+             h.source_mtime_ns == stat_mtime_ns(source) && h.source_ctime_ns == stat_ctime_ns(source);
+    if (!ok)
+    {
+        return 0;
+    }
+
+    size_t first = h.origin, count = h.words - (h.origin - h.base);
+    size_t bytes = 2 * (size_t)h.words;
+    /* the words are checked before anything is mapped over memory, a damaged cache is never used */
+    const uint8_t *data = mmap(NULL, h.page_size + bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        return 0;
+    }
+    ok = fnv1a(data + h.page_size, bytes) == h.checksum;
+
+    uint16_t *dst = vm->memory + h.base;
+    /* the mapping covers whole pages, so it may only replace memory no other image has written yet */
+    size_t mapped = (bytes + page_size - 1) & ~(page_size - 1);
+    if (ok && (uintptr_t)dst % page_size == 0 && h.base + mapped / 2 <= MEMORY_MAX && image_pages_free(vm, h.base, mapped / 2) &&
+        mmap(dst, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, (off_t)h.page_size) != MAP_FAILED)
+    {
+        image_mark_pages(vm, first, count);
+    }
+    else if (ok)
+    {
+        /* overlapping images: copy the words instead, they are already in host order */
+        memcpy(vm->memory + first, data + h.page_size + 2 * (first - h.base), 2 * count);
+        image_mark_pages(vm, first, count);
+    }
+    munmap((void *)data, h.page_size + bytes);
+    return ok;
+}
+
+/**
+ * Map a valid cache of `image_path` into memory, returns 0 when there is none
+ */
+int read_image_cache(struct lc3_vm *vm, const char *image_path, const struct stat *source)
+{
+    char path[4096];
+    image_cache_path(path, sizeof(path), image_path);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    int ok = image_cache_map(vm, fd, source);
+    close(fd);
+    return ok;
+}
+
+/**
+ * Write the image just loaded from `source` to `fd` in cache layout, returns 0 on failure
+ */
+int image_cache_store(struct lc3_vm *vm, int fd, const struct stat *source, uint16_t origin, size_t count)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    struct image_cache_header h = {0};
+    h.magic = IMAGE_CACHE_MAGIC;
+    h.version = IMAGE_CACHE_VERSION;
+    h.page_size = (uint32_t)page_size;
+    h.origin = origin;
+    h.base = (uint16_t)(origin & ~(page_size / 2 - 1));
+    h.words = (uint32_t)(origin - h.base + count);
+    h.source_size = (uint64_t)source->st_size;
+    h.source_ino = (uint64_t)source->st_ino;
+    h.source_mtime_ns = stat_mtime_ns(source);
+    h.source_ctime_ns = stat_ctime_ns(source);
+    /* the words in front of the origin are stored as zero, like the memory they will be mapped over */
+    uint16_t *words = calloc(h.words, sizeof(uint16_t));
+    if (!words)
+    {
+        return 0;
+    }
+    memcpy(words + (origin - h.base), vm->memory + origin, 2 * count);
+    h.checksum = fnv1a(words, 2 * (size_t)h.words);
+    h.header_checksum = fnv1a(&h, offsetof(struct image_cache_header, header_checksum));
+
+    int ok = pwrite(fd, &h, sizeof(h), 0) == (ssize_t)sizeof(h) &&
+             pwrite(fd, words, 2 * (size_t)h.words, (off_t)page_size) == (ssize_t)(2 * (size_t)h.words);
+    free(words);
+    return ok;
+}
+
+_Atomic unsigned image_cache_serial = 0; /* see write_image_cache() */
+
+/**
+ * Write the cache of an image that was just loaded; failing to do so is not an error
+ */
+void write_image_cache(struct lc3_vm *vm, const char *image_path, const struct stat *source, uint16_t origin, size_t count)
+{
+    /* write a temporary file and rename it, so that a running VM never sees a half written cache;
+       the serial keeps VMs of the same process that cache the same image apart */
+    char path[4096], tmp[4096 + 48];
+    image_cache_path(path, sizeof(path), image_path);
+    snprintf(tmp, sizeof(tmp), "%s.%ld.%u.tmp", path, (long)getpid(), atomic_fetch_add(&image_cache_serial, 1));
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+    {
+        int ok = image_cache_store(vm, fd, source, origin, count);
+        close(fd);
+        if (!ok || rename(tmp, path) != 0)
+        {
+            unlink(tmp);
+        }
+    }
+}
+
+/**
+ * Shared images (config.share_images)
+ *
+ * VMs of one process that load the same .obj share a single copy of it. The first VM to load an image
+ * also stores it in cache layout into an anonymous in-memory file, and every later VM maps that file over
+ * its `memory` with MAP_PRIVATE, exactly like an image cache. Their pages stay shared until a VM stores
+ * into one of them: then the kernel gives that VM a private copy of just that page, mem_write() does not
+ * notice. The files live as long as the process.
+ */
+struct shared_image
+{
+    struct stat source; /* the .obj, as it was when the shared copy was made */
+    int fd;
+    struct shared_image *next;
+};
+
+pthread_mutex_t shared_images_lock = PTHREAD_MUTEX_INITIALIZER;
+struct shared_image *shared_images = NULL;
+
+/** guarded by shared_images_lock */
+struct shared_image *shared_image_find(const struct stat *source)
+{
+    for (struct shared_image *s = shared_images; s; s = s->next)
+    {
+        if (s->source.st_dev == source->st_dev && s->source.st_ino == source->st_ino &&
+            s->source.st_size == source->st_size && stat_mtime_ns(&s->source) == stat_mtime_ns(source) &&
+            stat_ctime_ns(&s->source) == stat_ctime_ns(source)) /* like image_cache_map(), to the nanosecond */
+        {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Map the shared copy of an image, returns 0 when there is none yet
+ */
+int read_shared_image(struct lc3_vm *vm, const struct stat *source)
+{
+    pthread_mutex_lock(&shared_images_lock);
+    struct shared_image *s = shared_image_find(source);
+    pthread_mutex_unlock(&shared_images_lock);
+    return s && image_cache_map(vm, s->fd, source); /* entries are never removed, `s` stays valid */
+}
+
+/**
+ * Make a shared copy of the image just loaded from `source`; failing to do so is not an error
+ */
+void share_image(struct lc3_vm *vm, const struct stat *source, uint16_t origin, size_t count)
+{
+    pthread_mutex_lock(&shared_images_lock);
+    if (!shared_image_find(source)) /* another VM may have been faster */
+    {
+#if defined(__linux__)
+        int fd = memfd_create("lc3-image", MFD_CLOEXEC);
+#else
+        char name[64];
+        snprintf(name, sizeof(name), "/lc3-image-%ld-%u", (long)getpid(), atomic_fetch_add(&image_cache_serial, 1));
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        shm_unlink(name);
+#endif
+        struct shared_image *s = fd >= 0 ? malloc(sizeof(struct shared_image)) : NULL;
+        if (s && image_cache_store(vm, fd, source, origin, count))
+        {
+            *s = (struct shared_image){.source = *source, .fd = fd, .next = shared_images};
+            shared_images = s;
+        }
+        else
+        {
+            free(s);
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+        }
+    }
+    pthread_mutex_unlock(&shared_images_lock);
+}
+
+/**
+ * Load an image through mmap: the words are swapped straight from the page cache into `memory`
+ */
+int read_image(struct lc3_vm *vm, const char *image_path)
+{
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0)
+    {
+        return 0;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < 2)
+    {
+        close(fd);
+        return 0;
+    }
+    if ((vm->config.share_images && read_shared_image(vm, &st)) || (vm->config.image_cache && read_image_cache(vm, image_path, &st)))
+    {
+        close(fd);
+        return 1;
+    }
+
+    const uint8_t *file = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file == MAP_FAILED)
+    {
+        return 0;
+    }
+
+    /* the origin tells us where in memory to place the image */
+    uint16_t origin = (uint16_t)((file[0] << 8) | file[1]);
+    size_t count = ((size_t)st.st_size - 2) / 2;
+    if (count > (size_t)(MEMORY_MAX - origin))
+    {
+        count = MEMORY_MAX - origin;
+    }
+    /* LC-3 programs are big-endian, swap16_copy() turns them into host order on the way */
+    swap16_copy(vm->memory + origin, file + 2, count);
+    munmap((void *)file, (size_t)st.st_size);
+
+    if (count > 0)
+    {
+        image_mark_pages(vm, origin, count);
+        if (vm->config.share_images)
+        {
+            share_image(vm, &st, origin, count);
+        }
+        if (vm->config.image_cache)
+        {
+            write_image_cache(vm, image_path, &st, origin, count);
+        }
+    }
+    return 1;
+}
+#else
+int read_image(struct lc3_vm *vm, const char *image_path)
+{
+    FILE *file = fopen(image_path, "rb");
+    if (!file)
+    {
+        return 0;
+    };
+
+    read_image_file(vm, file);
+    fclose(file);
+    return 1;
+}
+#endif
+
+#pragma region Assembler
+/**
+ * Assembler for `.asm` sources, lc3_load_image() uses it for every path ending in `.asm`.
+ *
+ * Two passes over the source run the same code: the first one only collects the address of every label,
+ * the second one encodes with all of them known. Errors are reported in the second pass only, so each one
+ * shows up once, on stderr as `file:line: message`; every instruction takes its word even when it has an error,
+ * which keeps the addresses of both passes the same. The program goes into a buffer and then into memory
+ * like an image.
+ *
+ * Opcodes, trap aliases and directives are case-insensitive, labels are not. Numbers are `#-12`, `x3000`
+ * or `0x3000`, or plain decimal. A numeric operand of BR, LD, JSR etc. is the offset itself, a label the address.
+ */
+#define ASM_MAX_TOKENS 8 /* label, mnemonic and operands of one line */
+
+enum asm_form
+{
+    ASM_ALU,     /* ADD, AND: DR, SR1, SR2 or imm5 */
+    ASM_NOT,     /* DR, SR */
+    ASM_BR,      /* label or offset9 */
+    ASM_JMP,     /* BaseR */
+    ASM_JSR,     /* label or offset11 */
+    ASM_JSRR,    /* BaseR */
+    ASM_PCREL,   /* LD, LDI, LEA, ST, STI: DR or SR, label or offset9 */
+    ASM_BASE,    /* LDR, STR: DR or SR, BaseR, offset6 */
+    ASM_TRAP,    /* trapvect8 */
+    ASM_FIXED,   /* RET, RTI and the trap aliases: no operands */
+    ASM_ORIG,    /* .ORIG address */
+    ASM_FILL,    /* .FILL value or label */
+    ASM_BLKW,    /* .BLKW count */
+    ASM_STRINGZ, /* .STRINGZ "text" */
+    ASM_END,     /* .END */
+};
+
+static const uint8_t asm_operands[] = {
+    [ASM_ALU] = 3, [ASM_NOT] = 2, [ASM_BR] = 1, [ASM_JMP] = 1, [ASM_JSR] = 1, [ASM_JSRR] = 1, [ASM_PCREL] = 2, [ASM_BASE] = 3,
+    [ASM_TRAP] = 1, [ASM_FIXED] = 0, [ASM_ORIG] = 1, [ASM_FILL] = 1, [ASM_BLKW] = 1, [ASM_STRINGZ] = 1, [ASM_END] = 0,
+};
+
+struct asm_op
+{
+    const char *name;
+    uint8_t form; /* asm_form */
+    uint16_t bits; /* the instruction without its operands */
+};
+
+static const struct asm_op asm_ops[] = {
+    {"ADD", ASM_ALU, 0x1000},     {"AND", ASM_ALU, 0x5000},    {"NOT", ASM_NOT, 0x903F},     {"JMP", ASM_JMP, 0xC000},
+    {"RET", ASM_FIXED, 0xC1C0},   {"JSR", ASM_JSR, 0x4800},    {"JSRR", ASM_JSRR, 0x4000},   {"LD", ASM_PCREL, 0x2000},
+    {"LDI", ASM_PCREL, 0xA000},   {"LEA", ASM_PCREL, 0xE000},  {"ST", ASM_PCREL, 0x3000},    {"STI", ASM_PCREL, 0xB000},
+    {"LDR", ASM_BASE, 0x6000},    {"STR", ASM_BASE, 0x7000},   {"TRAP", ASM_TRAP, 0xF000},   {"RTI", ASM_FIXED, 0x8000},
+    {"GETC", ASM_FIXED, 0xF020},  {"OUT", ASM_FIXED, 0xF021},  {"PUTS", ASM_FIXED, 0xF022},  {"IN", ASM_FIXED, 0xF023},
+    {"PUTSP", ASM_FIXED, 0xF024}, {"HALT", ASM_FIXED, 0xF025}, {".ORIG", ASM_ORIG, 0},       {".FILL", ASM_FILL, 0},
+    {".BLKW", ASM_BLKW, 0},       {".STRINGZ", ASM_STRINGZ, 0}, {".END", ASM_END, 0},
+};
+
+struct asm_token
+{
+    const char *s;
+    size_t n;
+};
+
+struct asm_label
+{
+    const char *name; /* points into the source */
+    size_t len;
+    int line;         /* where it is defined */
+    uint16_t addr;
+};
+
+struct assembler
+{
+    const char *path; /* for error messages */
+    int pass;         /* 1: collect labels, 2: encode */
+    int line;
+    int errors;
+    int started;      /* .ORIG seen */
+    uint16_t origin;
+    size_t count;     /* words so far, the next one goes to origin + count */
+    uint16_t *words;  /* MEMORY_MAX of them */
+    struct asm_label *labels; /* open addressing by fnv1a() of the name, `label_cap` is a power of two */
+    size_t label_count;
+    size_t label_cap;
+};
+
+void asm_error(struct assembler *a, const char *format, ...)
+{
+    ++a->errors;
+    if (a->pass != 2)
+    {
+        return; /* the second pass finds it again */
+    }
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, a->line ? "%s:%d: " : "%s: ", a->path, a->line);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+/** `t` is `name`, ignoring case */
+int asm_token_is(struct asm_token t, const char *name)
+{
+    size_t i = 0;
+    for (; i < t.n && name[i]; ++i)
+    {
+        if (toupper((unsigned char)t.s[i]) != name[i])
+        {
+            return 0;
+        }
+    }
+    return i == t.n && !name[i];
+}
+
+/**
+ * The opcode or directive `t`, BR with any of n, z and p included; 0 if it is none
+ */
+int asm_find_op(struct asm_token t, struct asm_op *op)
+{
+    for (size_t i = 0; i < sizeof(asm_ops) / sizeof(asm_ops[0]); ++i)
+    {
+        if (asm_token_is(t, asm_ops[i].name))
+        {
+            *op = asm_ops[i];
+            return 1;
+        }
+    }
+    if (t.n < 2 || t.n > 5 || toupper((unsigned char)t.s[0]) != 'B' || toupper((unsigned char)t.s[1]) != 'R')
+    {
+        return 0;
+    }
+    uint16_t nzp = 0;
+    for (size_t i = 2; i < t.n; ++i)
+    {
+        int c = toupper((unsigned char)t.s[i]);
+        uint16_t flag = c == 'N' ? 4 : c == 'Z' ? 2 : c == 'P' ? 1 : 0;
+        if (!flag || (nzp & flag))
+        {
+            return 0;
+        }
+        nzp |= flag;
+    }
+    *op = (struct asm_op){"BR", ASM_BR, (uint16_t)((nzp ? nzp : 7) << 9)}; /* plain BR branches always */
+    return 1;
+}
+
+int asm_is_label(struct asm_token t)
+{
+    if (t.n == 0 || !(isalpha((unsigned char)t.s[0]) || t.s[0] == '_'))
+    {
+        return 0;
+    }
+    for (size_t i = 1; i < t.n; ++i)
+    {
+        if (!(isalnum((unsigned char)t.s[i]) || t.s[i] == '_'))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * `#-12`, `x3000`, `0x3000` or `42`; 0 if `t` is not a number
+ */
+int asm_number(struct asm_token t, int32_t *value)
+{
+    const char *s = t.s;
+    size_t n = t.n;
+    int base = 10;
+    if (n > 0 && s[0] == '#')
+    {
+        ++s, --n;
+    }
+    else if (n > 0 && (s[0] == 'x' || s[0] == 'X'))
+    {
+        base = 16;
+        ++s, --n;
+    }
+    else if (n > 1 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X'))
+    {
+        base = 16;
+        s += 2, n -= 2;
+    }
+    int negative = n > 0 && s[0] == '-';
+    if (n > 0 && (s[0] == '-' || s[0] == '+'))
+    {
+        ++s, --n;
+    }
+    if (n == 0 || n > 6) /* more digits than any 16-bit value needs */
+    {
+        return 0;
+    }
+    int32_t v = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        int c = toupper((unsigned char)s[i]);
+        int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'A' && c <= 'F' ? c - 'A' + 10 : 99;
+        if (digit >= base)
+        {
+            return 0;
+        }
+        v = v * base + digit;
+    }
+    *value = negative ? -v : v;
+    return 1;
+}
+
+struct asm_label *asm_label_find(struct assembler *a, struct asm_token t)
+{
+    if (a->label_cap == 0)
+    {
+        return NULL;
+    }
+    for (size_t i = fnv1a(t.s, t.n) & (a->label_cap - 1);; i = (i + 1) & (a->label_cap - 1))
+    {
+        struct asm_label *l = &a->labels[i];
+        if (!l->name)
+        {
+            return NULL;
+        }
+        if (l->len == t.n && memcmp(l->name, t.s, t.n) == 0)
+        {
+            return l;
+        }
+    }
+}
+
+/**
+ * Define label `t` at the current address; in the second pass only check that it is defined once
+ */
+void asm_label_define(struct assembler *a, struct asm_token t)
+{
+    struct asm_label *l = asm_label_find(a, t);
+    if (a->pass == 2)
+    {
+        if (l && l->line != a->line)
+        {
+            asm_error(a, "duplicate label %.*s, first defined on line %d", (int)t.n, t.s, l->line);
+        }
+        return;
+    }
+    if (l)
+    {
+        return;
+    }
+
+    if (2 * (a->label_count + 1) > a->label_cap)
+    {
+        /* keep the table at most half full */
+        size_t cap = a->label_cap ? 2 * a->label_cap : 256;
+        struct asm_label *labels = calloc(cap, sizeof(struct asm_label));
+        if (!labels)
+        {
+            asm_error(a, "out of memory");
+            return;
+        }
+        for (size_t i = 0; i < a->label_cap; ++i)
+        {
+            if (a->labels[i].name)
+            {
+                size_t j = fnv1a(a->labels[i].name, a->labels[i].len) & (cap - 1);
+                while (labels[j].name)
+                {
+                    j = (j + 1) & (cap - 1);
+                }
+                labels[j] = a->labels[i];
+            }
+        }
+        free(a->labels);
+        a->labels = labels;
+        a->label_cap = cap;
+    }
+    size_t i = fnv1a(t.s, t.n) & (a->label_cap - 1);
+    while (a->labels[i].name)
+    {
+        i = (i + 1) & (a->label_cap - 1);
+    }
+    a->labels[i] = (struct asm_label){.name = t.s, .len = t.n, .line = a->line, .addr = (uint16_t)(a->origin + a->count)};
+    ++a->label_count;
+}
+
+void asm_emit(struct assembler *a, uint16_t word)
+{
+    if ((size_t)a->origin + a->count >= MEMORY_MAX)
+    {
+        if ((size_t)a->origin + a->count == MEMORY_MAX)
+        {
+            asm_error(a, "the program does not fit below xFFFF");
+        }
+        ++a->count; /* report it only once */
+        return;
+    }
+    a->words[a->count++] = word;
+}
+
+int asm_register(struct assembler *a, struct asm_token t, uint16_t *r)
+{
+    if (t.n == 2 && (t.s[0] == 'R' || t.s[0] == 'r') && t.s[1] >= '0' && t.s[1] <= '7')
+    {
+        *r = (uint16_t)(t.s[1] - '0');
+        return 1;
+    }
+    asm_error(a, "expected a register, not %.*s", (int)t.n, t.s);
+    *r = 0;
+    return 0;
+}
+
+/** a signed `bits` wide field */
+uint16_t asm_field(struct assembler *a, int32_t v, int bits, const char *what)
+{
+    if (v < -(1 << (bits - 1)) || v >= (1 << (bits - 1)))
+    {
+        asm_error(a, "%s %d does not fit in %d bits", what, v, bits);
+    }
+    return (uint16_t)v & ((1u << bits) - 1);
+}
+
+/** `#imm` operand of `bits` */
+uint16_t asm_immediate(struct assembler *a, struct asm_token t, int bits)
+{
+    int32_t v;
+    if (!asm_number(t, &v))
+    {
+        asm_error(a, "expected a number, not %.*s", (int)t.n, t.s);
+        return 0;
+    }
+    return asm_field(a, v, bits, "immediate");
+}
+
+/** label or offset operand of PC-relative instructions */
+uint16_t asm_offset(struct assembler *a, struct asm_token t, int bits)
+{
+    int32_t v;
+    if (!asm_number(t, &v))
+    {
+        if (!asm_is_label(t))
+        {
+            asm_error(a, "expected a label or an offset, not %.*s", (int)t.n, t.s);
+            return 0;
+        }
+        struct asm_label *l = asm_label_find(a, t);
+        if (!l)
+        {
+            if (a->pass == 2)
+            {
+                asm_error(a, "undefined label %.*s", (int)t.n, t.s);
+            }
+            return 0; /* the first pass only needs the size */
+        }
+        v = (int32_t)l->addr - (int32_t)(a->origin + a->count + 1);
+    }
+    return asm_field(a, v, bits, "offset");
+}
+
+void asm_stringz(struct assembler *a, struct asm_token t)
+{
+    if (t.s[0] != '"')
+    {
+        asm_error(a, "expected a string in double quotes, not %.*s", (int)t.n, t.s);
+        return;
+    }
+    size_t i = 1;
+    for (; i < t.n && t.s[i] != '"'; ++i)
+    {
+        char c = t.s[i];
+        if (c == '\\' && i + 1 < t.n)
+        {
+            c = t.s[++i];
+            c = c == 'n' ? '\n' : c == 't' ? '\t' : c == 'r' ? '\r' : c == 'e' ? '\033' : c == '0' ? '\0' : c;
+        }
+        asm_emit(a, (uint8_t)c);
+    }
+    asm_emit(a, 0);
+    if (i != t.n - 1)
+    {
+        asm_error(a, "missing closing quote");
+    }
+}
+
+/**
+ * Split a line into label, mnemonic and operands; returns the number of tokens, -1 if there are too many
+ */
+int asm_tokenize(const char *line, size_t n, struct asm_token *tokens)
+{
+    int count = 0;
+    size_t i = 0;
+    while (i < n && line[i] != ';')
+    {
+        if (isspace((unsigned char)line[i]) || line[i] == ',')
+        {
+            ++i;
+            continue;
+        }
+        size_t start = i;
+        if (line[i] == '"')
+        {
+            for (++i; i < n && line[i] != '"'; ++i)
+            {
+                if (line[i] == '\\' && i + 1 < n)
+                {
+                    ++i;
+                }
+            }
+            i += i < n; /* the closing quote, asm_stringz() complains if it is missing */
+        }
+        else
+        {
+            while (i < n && !isspace((unsigned char)line[i]) && line[i] != ',' && line[i] != ';')
+            {
+                ++i;
+            }
+        }
+        if (count == ASM_MAX_TOKENS)
+        {
+            return -1;
+        }
+        tokens[count++] = (struct asm_token){line + start, i - start};
+    }
+    return count;
+}
+
+/**
+ * Assemble one line; returns 0 at .END
+ */
+int asm_line(struct assembler *a, const char *line, size_t n)
+{
+    struct asm_token t[ASM_MAX_TOKENS];
+    int count = asm_tokenize(line, n, t);
+    if (count < 0)
+    {
+        asm_error(a, "too many operands");
+        return 1;
+    }
+    if (count == 0)
+    {
+        return 1;
+    }
+
+    int first = 0;
+    struct asm_op op;
+    if (!asm_find_op(t[0], &op))
+    {
+        struct asm_token label = t[0];
+        if (label.n > 1 && label.s[label.n - 1] == ':')
+        {
+            --label.n;
+        }
+        if (!asm_is_label(label))
+        {
+            asm_error(a, "unknown instruction %.*s", (int)t[0].n, t[0].s);
+            return 1;
+        }
+        if (!a->started)
+        {
+            asm_error(a, "label %.*s before .ORIG", (int)label.n, label.s);
+            return 1;
+        }
+        asm_label_define(a, label);
+        if (count == 1)
+        {
+            return 1;
+        }
+        first = 1;
+        if (!asm_find_op(t[1], &op))
+        {
+            asm_error(a, "unknown instruction %.*s", (int)t[1].n, t[1].s);
+            return 1;
+        }
+    }
+    const struct asm_token *arg = t + first + 1;
+    if (count - first - 1 != asm_operands[op.form])
+    {
+        asm_error(a, "%s takes %d operand%s", op.name, asm_operands[op.form], asm_operands[op.form] == 1 ? "" : "s");
+        if (op.form < ASM_ORIG)
+        {
+            asm_emit(a, 0); /* the word is still taken */
+        }
+        return op.form != ASM_END;
+    }
+    if (op.form == ASM_ORIG)
+    {
+        int32_t v;
+        if (a->started)
+        {
+            asm_error(a, "second .ORIG, one program per file");
+        }
+        else if (!asm_number(arg[0], &v) || v < 0 || v >= MEMORY_MAX)
+        {
+            asm_error(a, "expected an address, not %.*s", (int)arg[0].n, arg[0].s);
+        }
+        else
+        {
+            a->origin = (uint16_t)v;
+            a->started = 1;
+        }
+        return 1;
+    }
+    if (!a->started)
+    {
+        asm_error(a, "%s before .ORIG", op.name);
+        return op.form != ASM_END;
+    }
+
+    uint16_t dr, sr, base;
+    switch (op.form)
+    {
+    case ASM_ALU:
+    {
+        asm_register(a, arg[0], &dr);
+        asm_register(a, arg[1], &sr);
+        uint16_t sr2;
+        if (arg[2].n == 2 && (arg[2].s[0] == 'R' || arg[2].s[0] == 'r'))
+        {
+            asm_register(a, arg[2], &sr2);
+            asm_emit(a, op.bits | dr << 9 | sr << 6 | sr2);
+        }
+        else
+        {
+            asm_emit(a, op.bits | dr << 9 | sr << 6 | 0x20 | asm_immediate(a, arg[2], 5));
+        }
+        break;
+    }
+    case ASM_NOT:
+        asm_register(a, arg[0], &dr);
+        asm_register(a, arg[1], &sr);
+        asm_emit(a, op.bits | dr << 9 | sr << 6);
+        break;
+    case ASM_BR:
+        asm_emit(a, op.bits | asm_offset(a, arg[0], 9));
+        break;
+    case ASM_JMP:
+    case ASM_JSRR:
+        asm_register(a, arg[0], &base);
+        asm_emit(a, op.bits | base << 6);
+        break;
+    case ASM_JSR:
+        asm_emit(a, op.bits | asm_offset(a, arg[0], 11));
+        break;
+    case ASM_PCREL:
+        asm_register(a, arg[0], &dr);
+        asm_emit(a, op.bits | dr << 9 | asm_offset(a, arg[1], 9));
+        break;
+    case ASM_BASE:
+        asm_register(a, arg[0], &dr);
+        asm_register(a, arg[1], &base);
+        asm_emit(a, op.bits | dr << 9 | base << 6 | asm_immediate(a, arg[2], 6));
+        break;
+    case ASM_TRAP:
+    {
+        int32_t v;
+        if (!asm_number(arg[0], &v) || v < 0 || v > 0xFF)
+        {
+            asm_error(a, "expected a trap vector, not %.*s", (int)arg[0].n, arg[0].s);
+            v = 0;
+        }
+        asm_emit(a, op.bits | (uint16_t)v);
+        break;
+    }
+    case ASM_FIXED:
+        asm_emit(a, op.bits);
+        break;
+    case ASM_FILL:
+    {
+        int32_t v = 0;
+        if (!asm_number(arg[0], &v))
+        {
+            struct asm_label *l = asm_is_label(arg[0]) ? asm_label_find(a, arg[0]) : NULL;
+            if (l)
+            {
+                v = l->addr;
+            }
+            else if (a->pass == 2 || !asm_is_label(arg[0]))
+            {
+                asm_error(a, "expected a value or a label, not %.*s", (int)arg[0].n, arg[0].s);
+            }
+        }
+        else if (v < INT16_MIN || v > UINT16_MAX)
+        {
+            asm_error(a, "value %d does not fit in 16 bits", v);
+        }
+        asm_emit(a, (uint16_t)v);
+        break;
+    }
+    case ASM_BLKW:
+    {
+        int32_t v;
+        if (!asm_number(arg[0], &v) || v < 1 || v > MEMORY_MAX)
+        {
+            asm_error(a, "expected a number of words, not %.*s", (int)arg[0].n, arg[0].s);
+            break;
+        }
+        for (int32_t i = 0; i < v; ++i)
+        {
+            asm_emit(a, 0);
+        }
+        break;
+    }
+    case ASM_STRINGZ:
+        asm_stringz(a, arg[0]);
+        break;
+    case ASM_END:
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Assemble `size` bytes of source into `a->words`, returns 0 on errors
+ */
+int assemble(struct assembler *a, const char *source, size_t size)
+{
+    for (a->pass = 1; a->pass <= 2; ++a->pass)
+    {
+        a->line = 0;
+        a->started = 0;
+        a->origin = 0;
+        a->count = 0;
+        a->errors = 0;
+        const char *p = source, *end = source + size;
+        while (p < end)
+        {
+            const char *eol = memchr(p, '\n', (size_t)(end - p));
+            if (!eol)
+            {
+                eol = end;
+            }
+            ++a->line;
+            if (!asm_line(a, p, (size_t)(eol - p)))
+            {
+                break; /* .END */
+            }
+            p = eol < end ? eol + 1 : end;
+        }
+        if (!a->started)
+        {
+            a->line = 0;
+            asm_error(a, "no .ORIG");
+        }
+    }
+    return a->errors == 0 && a->count <= (size_t)(MEMORY_MAX - a->origin);
+}
+
+#if defined(__APPLE__) || defined(__linux__)
+/**
+ * Assembler cache (config.image_cache)
+ *
+ * Next to `prog.asm` the VM keeps `prog.asm.lc3a`, the assembled words in host byte order.
+ * It belongs to the source with the same FNV-1a hash and size, so editing the source, or only touching it, is
+ * noticed without looking at modification times; a hit costs reading both files and hashing the source.
+ */
+#define ASM_CACHE_MAGIC 0x4133434Cu /* "LC3A" */
+#define ASM_CACHE_VERSION 1
+
+struct asm_cache_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t source_hash; /* FNV-1a of the source */
+    uint64_t source_size;
+    uint16_t origin;
+    uint16_t reserved;
+    uint32_t words;
+    uint64_t checksum; /* FNV-1a of the words */
+};
+
+/**
+ * Load the cached assembly of a source with `hash` and `size`, returns 0 when there is none
+ */
+int read_asm_cache(struct lc3_vm *vm, const char *source_path, uint64_t hash, size_t size)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.lc3a", source_path);
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return 0;
+    }
+    struct asm_cache_header h;
+    uint16_t *words = NULL;
+    int ok = fread(&h, sizeof(h), 1, file) == 1 && h.magic == ASM_CACHE_MAGIC && h.version == ASM_CACHE_VERSION &&
+             h.source_hash == hash && h.source_size == size && h.words > 0 && h.words <= (uint32_t)(MEMORY_MAX - h.origin) &&
+             (words = malloc(2 * (size_t)h.words)) && fread(words, 2, h.words, file) == h.words &&
+             fnv1a(words, 2 * (size_t)h.words) == h.checksum && lc3_load_words(vm, h.origin, words, h.words);
+    free(words);
+    fclose(file);
+    return ok;
+}
+
+/**
+ * Write the cache of a source that was just assembled; failing to do so is not an error
+ */
+void write_asm_cache(const char *source_path, uint64_t hash, size_t size, uint16_t origin, const uint16_t *words, size_t count)
+{
+    /* a temporary file and a rename, like write_image_cache() */
+    char path[4096], tmp[4096 + 48];
+    snprintf(path, sizeof(path), "%s.lc3a", source_path);
+    snprintf(tmp, sizeof(tmp), "%s.%ld.%u.tmp", path, (long)getpid(), atomic_fetch_add(&image_cache_serial, 1));
+    FILE *file = fopen(tmp, "wb");
+    if (!file)
+    {
+        return;
+    }
+    struct asm_cache_header h = {.magic = ASM_CACHE_MAGIC,
+                                 .version = ASM_CACHE_VERSION,
+                                 .source_hash = hash,
+                                 .source_size = size,
+                                 .origin = origin,
+                                 .words = (uint32_t)count,
+                                 .checksum = fnv1a(words, 2 * count)};
+    int ok = fwrite(&h, sizeof(h), 1, file) == 1 && fwrite(words, 2, count, file) == count;
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+    }
+}
+#endif
+
+/**
+ * Assemble an .asm file into memory, returns 0 if it cannot be read or has errors
+ */
+int read_source(struct lc3_vm *vm, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return 0;
+    }
+    char *source = NULL;
+    size_t size = 0, cap = 0, read;
+    do
+    {
+        if (size == cap)
+        {
+            cap = cap ? 2 * cap : 64 * 1024;
+            char *grown = realloc(source, cap);
+            if (!grown)
+            {
+                free(source);
+                fclose(file);
+                return 0;
+            }
+            source = grown;
+        }
+        read = fread(source + size, 1, cap - size, file);
+        size += read;
+    } while (read > 0);
+    int ok = !ferror(file);
+    fclose(file);
+
+#if defined(__APPLE__) || defined(__linux__)
+    uint64_t hash = fnv1a(source, size);
+    if (ok && vm->config.image_cache && read_asm_cache(vm, path, hash, size))
+    {
+        free(source);
+        return 1;
+    }
+#endif
+
+    struct assembler a = {.path = path, .words = malloc(MEMORY_MAX * sizeof(uint16_t))};
+    ok = ok && a.words && assemble(&a, source, size) && a.count > 0 && lc3_load_words(vm, a.origin, a.words, a.count);
+#if defined(__APPLE__) || defined(__linux__)
+    if (ok && vm->config.image_cache)
+    {
+        write_asm_cache(path, hash, size, a.origin, a.words, a.count);
+    }
+#endif
+    free(a.labels);
+    free(a.words);
+    free(source);
+    return ok;
+}
+
+/**
+ * Load an image or, for paths ending in `.asm`, assemble the source
+ */
+int load_program(struct lc3_vm *vm, const char *path)
+{
+    size_t len = strlen(path);
+    if (len >= 4 && path[len - 4] == '.' && toupper((unsigned char)path[len - 3]) == 'A' &&
+        toupper((unsigned char)path[len - 2]) == 'S' && toupper((unsigned char)path[len - 1]) == 'M')
+    {
+        return read_source(vm, path);
+    }
+    return read_image(vm, path);
+}
+#pragma endregion
+
+/**
+ * Is a key waiting on stdin? Waits at most `ms` milliseconds for one.
+ */
+#if defined(__APPLE__) || defined(__linux__)
+uint16_t wait_key(unsigned ms)
+{
+    fd_set readfds;
+    FD_ZERO(&readfds);
+    FD_SET(STDIN_FILENO, &readfds);
+
+    struct timeval timeout;
+    timeout.tv_sec = ms / 1000;
+    timeout.tv_usec = (ms % 1000) * 1000;
+    return select(1, &readfds, NULL, NULL, &timeout) > 0;
+}
+#else
+uint16_t wait_key(unsigned ms)
+{
+    return WaitForSingleObject(GetStdHandle(STD_INPUT_HANDLE), ms) == WAIT_OBJECT_0 && _kbhit();
+}
+#endif
+
+/**
+ * Is a key waiting on stdin? Never blocks.
+ */
+uint16_t check_key()
+{
+    return wait_key(0);
+}
+
+#pragma region Metrics
+/**
+ * Live counters (struct lc3_metrics), for watching many VMs while they run.
+ *
+ * Only the thread running a VM writes its block, so an update is a relaxed load and store without a locked
+ * instruction, and any other thread can read the block whenever it likes. Nothing is counted per instruction:
+ * retired instructions are published per slice of lc3_run(), JIT block entries once per run_jit(), the rest
+ * where a trap, an output write, a wait or a translation happens anyway.
+ */
+LC3_INLINE void metric_add(_Atomic uint64_t *counter, uint64_t n)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+LC3_INLINE uint64_t metric_get(const _Atomic uint64_t *counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/**
+ * Monotonic clock in nanoseconds
+ */
+uint64_t now_ns(void)
+{
+#if defined(__APPLE__) || defined(__linux__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+#else
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / frequency.QuadPart * 1000000000 +
+                      counter.QuadPart % frequency.QuadPart * 1000000000 / frequency.QuadPart);
+#endif
+}
+
+/** `name{labels,extra} `, without the braces if there are no labels */
+void metrics_name(FILE *file, const char *name, const char *labels, const char *extra)
+{
+    int own = labels && labels[0], more = extra && extra[0];
+    fprintf(file, "%s%s%s%s%s%s ", name, own || more ? "{" : "", own ? labels : "", own && more ? "," : "",
+            more ? extra : "", own || more ? "}" : "");
+}
+
+int lc3_write_metrics(FILE *file, const struct lc3_metrics *const *metrics, const char *const *labels, size_t count)
+{
+    static const struct
+    {
+        const char *name;
+        const char *help;
+        size_t offset;
+        int seconds; /* the counter is in nanoseconds */
+    } counters[] = {
+        {"lc3_retired_instructions_total", "Guest instructions executed.", offsetof(struct lc3_metrics, retired), 0},
+        {"lc3_run_seconds_total", "Time spent in lc3_run().", offsetof(struct lc3_metrics, run_ns), 1},
+        {"lc3_input_wait_seconds_total", "Time the guest waited for keys.", offsetof(struct lc3_metrics, input_wait_ns), 1},
+        {"lc3_output_bytes_total", "Bytes of guest output.", offsetof(struct lc3_metrics, output_bytes), 0},
+        {"lc3_jit_compiles_total", "Blocks translated.", offsetof(struct lc3_metrics, jit_compiles), 0},
+        {"lc3_jit_invalidations_total", "Stores into translated code.", offsetof(struct lc3_metrics, jit_invalidations), 0},
+        {"lc3_jit_flushes_total", "Times the code buffer ran full.", offsetof(struct lc3_metrics, jit_flushes), 0},
+    };
+    for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); ++c)
+    {
+        fprintf(file, "# HELP %s %s\n# TYPE %s counter\n", counters[c].name, counters[c].help, counters[c].name);
+        for (size_t i = 0; i < count; ++i)
+        {
+            uint64_t v = metric_get((const _Atomic uint64_t *)((const char *)metrics[i] + counters[c].offset));
+            metrics_name(file, counters[c].name, labels ? labels[i] : NULL, NULL);
+            if (counters[c].seconds)
+            {
+                fprintf(file, "%.6f\n", v / 1e9);
+            }
+            else
+            {
+                fprintf(file, "%llu\n", (unsigned long long)v);
+            }
+        }
+    }
+
+    fprintf(file, "# HELP lc3_mips Million instructions per second of run time not spent waiting for keys.\n"
+                  "# TYPE lc3_mips gauge\n");
+    for (size_t i = 0; i < count; ++i)
+    {
+        uint64_t run = metric_get(&metrics[i]->run_ns), wait = metric_get(&metrics[i]->input_wait_ns);
+        metrics_name(file, "lc3_mips", labels ? labels[i] : NULL, NULL);
+        fprintf(file, "%.3f\n", run > wait ? metric_get(&metrics[i]->retired) * 1e3 / (double)(run - wait) : 0.0);
+    }
+
+    fprintf(file, "# HELP lc3_traps_total TRAP instructions run, by vector.\n# TYPE lc3_traps_total counter\n");
+    for (size_t i = 0; i < count; ++i)
+    {
+        for (int vector = 0; vector < 256; ++vector)
+        {
+            uint64_t v = metric_get(&metrics[i]->traps[vector]);
+            if (v)
+            {
+                char extra[32];
+                snprintf(extra, sizeof(extra), "vector=\"x%02X\"", vector);
+                metrics_name(file, "lc3_traps_total", labels ? labels[i] : NULL, extra);
+                fprintf(file, "%llu\n", (unsigned long long)v);
+            }
+        }
+    }
+
+    fprintf(file, "# HELP lc3_jit_block_entries_total Block entries of the JIT engine: translated code (hit) or "
+                  "the interpreter (miss).\n# TYPE lc3_jit_block_entries_total counter\n");
+    for (size_t i = 0; i < count; ++i)
+    {
+        metrics_name(file, "lc3_jit_block_entries_total", labels ? labels[i] : NULL, "result=\"hit\"");
+        fprintf(file, "%llu\n", (unsigned long long)metric_get(&metrics[i]->jit_hits));
+        metrics_name(file, "lc3_jit_block_entries_total", labels ? labels[i] : NULL, "result=\"miss\"");
+        fprintf(file, "%llu\n", (unsigned long long)metric_get(&metrics[i]->jit_misses));
+    }
+    return !ferror(file);
+}
+#pragma endregion
+
+#pragma region Output
+/**
+ * Console output.
+ *
+ * Guest output is collected in `output_buffer` and written with one call when the buffer is full or at
+ * one of the flush points enabled in `config.flush_policy` (lc3_flush bits). Halting the VM always flushes.
+ * `config.unbuffered` restores the old behavior of flushing after every output trap.
+ * The output goes to `config.output`, stdout by default, or into memory with `config.capture_output`.
+ */
+
+/**
+ * Monotonic clock in milliseconds
+ */
+uint64_t now_ms(void)
+{
+#if defined(__APPLE__) || defined(__linux__)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#else
+    return GetTickCount64();
+#endif
+}
+
+FILE *output_stream(struct lc3_vm *vm)
+{
+    return vm->config.output ? vm->config.output : stdout;
+}
+
+/**
+ * Hand `n` bytes to the host: append them to the capture buffer or write them to the stream
+ */
+void output_emit(struct lc3_vm *vm, const char *s, size_t n)
+{
+    if (!vm->config.capture_output)
+    {
+        fwrite(s, 1, n, output_stream(vm));
+        return;
+    }
+    if (vm->captured_len + n > vm->captured_cap)
+    {
+        size_t cap = vm->captured_cap ? vm->captured_cap : OUTPUT_BUFFER_SIZE;
+        while (cap < vm->captured_len + n)
+        {
+            cap *= 2;
+        }
+        char *captured = realloc(vm->captured, cap);
+        if (!captured)
+        {
+            abort(); // Out of memory
+        }
+        vm->captured = captured;
+        vm->captured_cap = cap;
+    }
+    memcpy(vm->captured + vm->captured_len, s, n);
+    vm->captured_len += n;
+}
+
+void output_flush(struct lc3_vm *vm)
+{
+    if (vm->output_len > 0)
+    {
+        output_emit(vm, vm->output_buffer, vm->output_len);
+        vm->output_len = 0;
+    }
+    if (!vm->config.capture_output)
+    {
+        fflush(output_stream(vm));
+    }
+}
+
+/**
+ * Room for `n` more bytes (at most OUTPUT_BUFFER_SIZE) at the end of the buffer.
+ * Fill it and hand the bytes over with output_commit().
+ */
+char *output_reserve(struct lc3_vm *vm, size_t n)
+{
+    if (vm->output_len + n > OUTPUT_BUFFER_SIZE)
+    {
+        output_flush(vm);
+    }
+    if (vm->output_len == 0 && (vm->config.flush_policy & LC3_FLUSH_TIME) && !vm->config.unbuffered)
+    {
+        vm->output_since = now_ms();
+    }
+    return vm->output_buffer + vm->output_len;
+}
+
+/**
+ * Append `n` bytes written to the space of output_reserve(), flushing according to the policy
+ */
+void output_commit(struct lc3_vm *vm, size_t n)
+{
+    const char *s = vm->output_buffer + vm->output_len;
+    vm->output_len += n;
+    metric_add(&vm->metrics->output_bytes, n);
+
+    if (vm->config.unbuffered
+        || ((vm->config.flush_policy & LC3_FLUSH_NEWLINE) && memchr(s, '\n', n))
+        || ((vm->config.flush_policy & LC3_FLUSH_TIME) && (++vm->output_writes & 63) == 0 && now_ms() - vm->output_since >= vm->config.flush_ms))
+    {
+        output_flush(vm);
+    }
+}
+
+/** output buffered under LC3_FLUSH_TIME waits for a flush, run_steps() looks at its age between slices */
+LC3_INLINE int output_timed(const struct lc3_vm *vm)
+{
+    return (vm->config.flush_policy & LC3_FLUSH_TIME) && !vm->config.unbuffered;
+}
+
+/**
+ * Flush output older than `config.flush_ms`. output_commit() looks at the clock only on every 64th write,
+ * so without this a guest that stops writing and computes would keep its last output forever.
+ */
+void output_flush_aged(struct lc3_vm *vm)
+{
+    if (vm->output_len > 0 && output_timed(vm) && now_ms() - vm->output_since >= vm->config.flush_ms)
+    {
+        output_flush(vm);
+    }
+}
+
+/**
+ * Append guest output, flushing according to the policy
+ */
+void output_write(struct lc3_vm *vm, const char *s, size_t n)
+{
+    if (n == 0)
+    {
+        return;
+    }
+    if (n > OUTPUT_BUFFER_SIZE)
+    {
+        metric_add(&vm->metrics->output_bytes, n);
+        output_flush(vm);
+        output_emit(vm, s, n);
+        output_flush(vm);
+        return;
+    }
+
+    memcpy(output_reserve(vm, n), s, n);
+    output_commit(vm, n);
+}
+
+void output_putc(struct lc3_vm *vm, char c)
+{
+    output_write(vm, &c, 1);
+}
+
+/**
+ * Narrow a zero-terminated word string (TRAP_PUTS) into `dst`, one char per word.
+ * Converts at most `n` words, returns how many chars were written and sets `*done` at the terminator.
+ * SSE2/NEON handle 16 words per step: find the first zero word and truncate every word to its low byte.
+ */
+size_t narrow_words(char *dst, const uint16_t *src, size_t n, int *done)
+{
+    size_t i = 0;
+
+#if defined(LC3_HAVE_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i low = _mm_set1_epi16(0x00FF);
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 8));
+        /* packus saturates, masking first makes it a truncation */
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(_mm_and_si128(a, low), _mm_and_si128(b, low)));
+
+        uint32_t zeros = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi16(a, zero))
+                         | ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi16(b, zero)) << 16);
+        if (zeros)
+        {
+            *done = 1;
+            return i + LC3_CTZ(zeros) / 2; /* two mask bits per word */
+        }
+    }
+#elif defined(LC3_HAVE_NEON)
+    for (; i + 16 <= n; i += 16)
+    {
+        uint16x8_t a = vld1q_u16(src + i);
+        uint16x8_t b = vld1q_u16(src + i + 8);
+        vst1q_u8((uint8_t *)dst + i, vcombine_u8(vmovn_u16(a), vmovn_u16(b)));
+
+        uint8x16_t zeros = vcombine_u8(vmovn_u16(vceqzq_u16(a)), vmovn_u16(vceqzq_u16(b)));
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(zeros), 4)), 0);
+        if (mask)
+        {
+            *done = 1;
+            return i + LC3_CTZ64(mask) / 4; /* four mask bits per word */
+        }
+    }
+#endif
+
+    for (; i < n; ++i)
+    {
+        if (!src[i])
+        {
+            *done = 1;
+            return i;
+        }
+        dst[i] = (char)src[i];
+    }
+    return i;
+}
+
+/**
+ * Unpack a zero-terminated byte string (TRAP_PUTSP) into `dst`, two chars per word, low byte first.
+ * A zero high byte ends its word early. Converts at most `n` words into at most 2 * `n` chars.
+ * Words with two non-zero bytes are already the output in memory order,
+ * so SSE2/NEON copy 8 of them at once and leave the rest to the scalar loop.
+ */
+size_t unpack_bytes(char *dst, const uint16_t *src, size_t n, int *done)
+{
+    size_t i = 0;
+    size_t out = 0;
+
+    while (i < n)
+    {
+#if defined(LC3_HAVE_SSE2)
+        if (i + 8 <= n)
+        {
+            const __m128i zero = _mm_setzero_si128();
+            __m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i short_words = _mm_or_si128(_mm_cmpeq_epi16(v, zero),
+                                               _mm_cmpeq_epi16(_mm_and_si128(v, _mm_set1_epi16((short)0xFF00)), zero));
+            if (!_mm_movemask_epi8(short_words))
+            {
+                _mm_storeu_si128((__m128i *)(dst + out), v);
+                i += 8;
+                out += 16;
+                continue;
+            }
+        }
+#elif defined(LC3_HAVE_NEON)
+        if (i + 8 <= n)
+        {
+            uint16x8_t v = vld1q_u16(src + i);
+            uint16x8_t short_words = vorrq_u16(vceqzq_u16(v), vceqzq_u16(vandq_u16(v, vdupq_n_u16(0xFF00))));
+            if (!vmaxvq_u16(short_words))
+            {
+                vst1q_u8((uint8_t *)dst + out, vreinterpretq_u8_u16(v));
+                i += 8;
+                out += 16;
+                continue;
+            }
+        }
+#endif
+
+        uint16_t w = src[i];
+        if (!w)
+        {
+            *done = 1;
+            return out;
+        }
+        dst[out++] = (char)(w & 0xFF);
+        if (w >> 8)
+        {
+            dst[out++] = (char)(w >> 8);
+        }
+        ++i;
+    }
+    return out;
+}
+
+/**
+ * Output the string at `addr` in one of the two guest formats.
+ * Converts straight into the output buffer, in chunks so the buffer never has to grow.
+ * A string without terminator stops at the end of memory.
+ */
+void output_string(struct lc3_vm *vm, uint16_t addr, int packed)
+{
+    enum
+    {
+        CHUNK = 4096 /* words */
+    };
+    size_t left = MEMORY_MAX - addr;
+    const uint16_t *s = vm->memory + addr;
+    int done = 0;
+
+    while (!done && left > 0)
+    {
+        size_t n = left < CHUNK ? left : CHUNK;
+        char *dst = output_reserve(vm, packed ? 2 * CHUNK : CHUNK);
+        output_commit(vm, packed ? unpack_bytes(dst, s, n, &done) : narrow_words(dst, s, n, &done));
+        s += n;
+        left -= n;
+    }
+}
+
+/**
+ * The guest is about to wait for input, show it everything it printed so far
+ */
+LC3_INLINE void output_input_wait(struct lc3_vm *vm)
+{
+    if (vm->output_len > 0 && (vm->config.flush_policy & LC3_FLUSH_INPUT))
+    {
+        output_flush(vm);
+    }
+}
+
+int lc3_parse_flush_policy(const char *s, unsigned *policy)
+{
+    *policy = 0;
+    while (*s)
+    {
+        size_t n = strcspn(s, ",");
+        if (n == 7 && strncmp(s, "newline", n) == 0)
+        {
+            *policy |= LC3_FLUSH_NEWLINE;
+        }
+        else if (n == 5 && strncmp(s, "input", n) == 0)
+        {
+            *policy |= LC3_FLUSH_INPUT;
+        }
+        else if (n == 4 && strncmp(s, "time", n) == 0)
+        {
+            *policy |= LC3_FLUSH_TIME;
+        }
+        else if (n == 4 && strncmp(s, "halt", n) == 0)
+        {
+            /* always flushed */
+        }
+        else
+        {
+            return 0;
+        }
+        s += n;
+        if (*s == ',')
+        {
+            ++s;
+        }
+    }
+    return 1;
+}
+#pragma endregion
+
+#pragma region Snapshot
+/**
+ * Snapshots of the whole VM (`config.snapshot_path`, lc3_restore()).
+ *
+ * The snapshot is taken the first time the guest waits for input (TRAP_GETC, TRAP_IN, a KBSR read),
+ * which is where the initialization of an interactive program ends; the VM then simply carries on.
+ * Only what differs from the loaded images is stored: the registers, the device pages, and the RAM pages
+ * written since loading, as recorded in `page_dirty` by mem_write().
+ * The images themselves are referenced by path and checked against a hash of the memory they produce.
+ */
+#define SNAPSHOT_MAGIC 0x5333434Cu /* "LC3S" */
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t base_hash;    /* FNV-1a of `memory` right after the images were loaded */
+    uint16_t reg[R_COUNT]; /* R_PC is the instruction that waited for input, it runs again after a restore */
+    uint16_t cond_value;
+    uint16_t image_count; /* followed by the image paths: a uint16_t length and the bytes of each */
+    uint16_t page_count;  /* then by the pages: a uint16_t page number and PAGE_WORDS words each */
+    uint16_t psr;         /* region Interrupts, 0 in VMs without `config.interrupts` */
+    uint16_t saved_ssp;
+    uint16_t saved_usp;
+};
+
+/**
+ * Remember a loaded image, snapshots refer to it instead of storing its pages
+ */
+void snapshot_add_image(struct lc3_vm *vm, const char *path)
+{
+    char **images = realloc(vm->snapshot_images, (vm->snapshot_image_count + 1) * sizeof(char *));
+    char *copy = strdup(path);
+    if (!images || !copy)
+    {
+        abort(); // Out of memory
+    }
+    vm->snapshot_images = images;
+    vm->snapshot_images[vm->snapshot_image_count++] = copy;
+}
+
+/**
+ * All images are loaded: remember what memory looks like and start tracking stores
+ */
+void snapshot_begin(struct lc3_vm *vm)
+{
+    vm->snapshot_base_hash = fnv1a(vm->memory, sizeof(vm->memory));
+    vm->tracking = 1;
+    memset(vm->page_dirty, 0, sizeof(vm->page_dirty));
+    for (int page = 0; page < PAGE_COUNT; ++page)
+    {
+        if (!(vm->page_flags[page] & PAGE_DEVICE))
+        {
+            vm->page_flags[page] |= PAGE_CLEAN;
+        }
+    }
+}
+
+LC3_INLINE int snapshot_page_stored(struct lc3_vm *vm, int page)
+{
+    return (vm->page_dirty[page >> 3] >> (page & 7)) & 1 || (vm->page_flags[page] & PAGE_DEVICE);
+}
+
+/**
+ * Write the state of the VM, resuming at `pc`
+ */
+int snapshot_write(struct lc3_vm *vm, const char *path, uint16_t pc)
+{
+    FILE *file = fopen(path, "wb");
+    if (!file)
+    {
+        return 0;
+    }
+
+    struct snapshot_header h = {0};
+    h.magic = SNAPSHOT_MAGIC;
+    h.version = SNAPSHOT_VERSION;
+    h.base_hash = vm->snapshot_base_hash;
+    memcpy(h.reg, vm->reg, sizeof(h.reg));
+    h.reg[R_PC] = pc;
+    h.reg[R_COND] = cond_flags(vm->cond_value);
+    h.cond_value = vm->cond_value;
+    h.psr = vm->psr;
+    h.saved_ssp = vm->saved_ssp;
+    h.saved_usp = vm->saved_usp;
+    h.image_count = vm->snapshot_image_count;
+    for (int page = 0; page < PAGE_COUNT; ++page)
+    {
+        h.page_count += snapshot_page_stored(vm, page);
+    }
+
+    int ok = fwrite(&h, sizeof(h), 1, file) == 1;
+    for (uint16_t i = 0; ok && i < vm->snapshot_image_count; ++i)
+    {
+        uint16_t len = (uint16_t)strlen(vm->snapshot_images[i]);
+        ok = fwrite(&len, sizeof(len), 1, file) == 1 && fwrite(vm->snapshot_images[i], 1, len, file) == len;
+    }
+    for (uint16_t page = 0; ok && page < PAGE_COUNT; ++page)
+    {
+        if (snapshot_page_stored(vm, page))
+        {
+            ok = fwrite(&page, sizeof(page), 1, file) == 1 &&
+                 fwrite(vm->memory + (page << PAGE_SHIFT), sizeof(uint16_t), PAGE_WORDS, file) == PAGE_WORDS;
+        }
+    }
+    return fclose(file) == 0 && ok;
+}
+
+/**
+ * The guest is about to wait for input, take the snapshot if one was asked for
+ */
+void snapshot_take(struct lc3_vm *vm)
+{
+    vm->snapshot_taken = 1;
+#ifdef LC3_HAVE_JIT
+    if (vm->jit_native)
+    {
+        vm->snapshot_taken = 0; /* reg[] is stale while translated code runs, wait for the next request */
+        return;
+    }
+#endif
+    /* the instruction asking for input has already advanced the PC, it is repeated after a restore */
+    if (!snapshot_write(vm, vm->config.snapshot_path, vm->reg[R_PC] - 1))
+    {
+        fprintf(stderr, "failed to write snapshot: %s\n", vm->config.snapshot_path);
+    }
+}
+
+LC3_INLINE void snapshot_input_wait(struct lc3_vm *vm)
+{
+    if (vm->config.snapshot_path && !vm->snapshot_taken)
+    {
+        snapshot_take(vm);
+    }
+}
+
+/**
+ * Load the images of a snapshot and put the VM back into the saved state
+ */
+int snapshot_restore(struct lc3_vm *vm, const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return 0;
+    }
+
+    struct snapshot_header h;
+    int ok = fread(&h, sizeof(h), 1, file) == 1 && h.magic == SNAPSHOT_MAGIC && h.version == SNAPSHOT_VERSION;
+    for (uint16_t i = 0; ok && i < h.image_count; ++i)
+    {
+        uint16_t len;
+        char image[UINT16_MAX + 1];
+        ok = fread(&len, sizeof(len), 1, file) == 1 && fread(image, 1, len, file) == len;
+        if (ok)
+        {
+            image[len] = '\0';
+            ok = load_program(vm, image);
+            snapshot_add_image(vm, image);
+        }
+    }
+
+    /* the snapshot only holds the pages that differ from the images, they must not have changed */
+    if (ok)
+    {
+        snapshot_begin(vm);
+        ok = vm->snapshot_base_hash == h.base_hash;
+    }
+    for (uint16_t i = 0; ok && i < h.page_count; ++i)
+    {
+        uint16_t page;
+        ok = fread(&page, sizeof(page), 1, file) == 1 && page < PAGE_COUNT &&
+             fread(vm->memory + (page << PAGE_SHIFT), sizeof(uint16_t), PAGE_WORDS, file) == PAGE_WORDS;
+        if (ok && !(vm->page_flags[page] & PAGE_DEVICE))
+        {
+            mem_mark_dirty(vm, page); /* still differs from the images in the next snapshot */
+        }
+    }
+    fclose(file);
+
+    if (ok)
+    {
+        memcpy(vm->reg, h.reg, sizeof(h.reg));
+        vm->cond_value = h.cond_value;
+        vm->psr = h.psr;
+        vm->saved_ssp = h.saved_ssp;
+        vm->saved_usp = h.saved_usp;
+    }
+    return ok;
+}
+#pragma endregion
+
+#pragma region Input
+/**
+ * Keyboard input.
+ *
+ * Bytes from the host end up in a single-producer/single-consumer ring, so checking for a key
+ * (MR_KBSR) and reading it (MR_KBDR, TRAP_GETC, TRAP_IN) are plain memory operations for the VM.
+ * Who fills the ring depends on `config.kbd_poll`:
+ * - 0 (default): a reader thread blocks on stdin and pushes every byte as soon as it arrives.
+ * - N > 0: no thread, the host is polled with check_key() on every N-th KBSR read only.
+ * With `config.input` the VM reads that stream itself whenever the ring is empty, it never waits for the console.
+ * Headless VMs (config.headless, config.input or config.input_data) never look at the console at all:
+ * KBSR sees the next byte of their input at once, and without any input the keyboard is at its end.
+ * End of input is sticky: once it is reached, every read sees EOF (0xFFFF) like getchar() did.
+ *
+ * There is only one stdin, so the reader thread belongs to the process:
+ * it feeds the VM last passed to lc3_start_input(), `console_vm`, and drops bytes while there is none.
+ * A VM that asks for input before lc3_start_input() was called attaches itself.
+ */
+
+int input_push(struct lc3_vm *vm, uint16_t c)
+{
+    struct input_ring *ring = &vm->input_ring;
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) == INPUT_RING_SIZE)
+    {
+        return 0; /* full */
+    }
+    ring->data[head & (INPUT_RING_SIZE - 1)] = c;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return 1;
+}
+
+int input_pop(struct lc3_vm *vm, uint16_t *c)
+{
+    struct input_ring *ring = &vm->input_ring;
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&ring->head, memory_order_acquire))
+    {
+        return 0; /* empty */
+    }
+    *c = ring->data[tail & (INPUT_RING_SIZE - 1)];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return 1;
+}
+
+int input_empty(struct lc3_vm *vm)
+{
+    return atomic_load_explicit(&vm->input_ring.tail, memory_order_relaxed) == atomic_load_explicit(&vm->input_ring.head, memory_order_acquire);
+}
+
+#if defined(__APPLE__) || defined(__linux__)
+pthread_mutex_t console_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void console_acquire(void)
+{
+    pthread_mutex_lock(&console_lock);
+}
+
+void console_release(void)
+{
+    pthread_mutex_unlock(&console_lock);
+}
+
+void input_init(struct lc3_vm *vm)
+{
+    pthread_mutex_init(&vm->input_lock, NULL);
+    pthread_cond_init(&vm->input_arrived, NULL);
+}
+
+void input_fini(struct lc3_vm *vm)
+{
+    pthread_cond_destroy(&vm->input_arrived);
+    pthread_mutex_destroy(&vm->input_lock);
+}
+
+/** wake up a consumer blocked in input_wait() */
+void input_notify(struct lc3_vm *vm)
+{
+    pthread_mutex_lock(&vm->input_lock);
+    pthread_cond_signal(&vm->input_arrived);
+    pthread_mutex_unlock(&vm->input_lock);
+}
+
+/** block until the ring has a byte or input ended */
+void input_wait(struct lc3_vm *vm)
+{
+    pthread_mutex_lock(&vm->input_lock);
+    while (input_empty(vm) && !atomic_load(&vm->input_eof))
+    {
+        pthread_cond_wait(&vm->input_arrived, &vm->input_lock);
+    }
+    pthread_mutex_unlock(&vm->input_lock);
+}
+
+/** like input_wait(), but gives up after `ms` milliseconds */
+void input_wait_ms(struct lc3_vm *vm, unsigned ms)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+    deadline.tv_sec += ms / 1000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+
+    pthread_mutex_lock(&vm->input_lock);
+    int timed_out = 0;
+    while (input_empty(vm) && !atomic_load(&vm->input_eof) && !timed_out)
+    {
+        timed_out = pthread_cond_timedwait(&vm->input_arrived, &vm->input_lock, &deadline) != 0;
+    }
+    pthread_mutex_unlock(&vm->input_lock);
+}
+
+/** the ring is full, give the guest time to catch up */
+void input_backoff(void)
+{
+    usleep(1000);
+}
+#else
+SRWLOCK console_lock = SRWLOCK_INIT;
+
+void console_acquire(void)
+{
+    AcquireSRWLockExclusive(&console_lock);
+}
+
+void console_release(void)
+{
+    ReleaseSRWLockExclusive(&console_lock);
+}
+
+void input_init(struct lc3_vm *vm)
+{
+    InitializeCriticalSection(&vm->input_lock);
+    InitializeConditionVariable(&vm->input_arrived);
+}
+
+void input_fini(struct lc3_vm *vm)
+{
+    DeleteCriticalSection(&vm->input_lock);
+}
+
+void input_notify(struct lc3_vm *vm)
+{
+    EnterCriticalSection(&vm->input_lock);
+    WakeConditionVariable(&vm->input_arrived);
+    LeaveCriticalSection(&vm->input_lock);
+}
+
+void input_wait(struct lc3_vm *vm)
+{
+    EnterCriticalSection(&vm->input_lock);
+    while (input_empty(vm) && !atomic_load(&vm->input_eof))
+    {
+        SleepConditionVariableCS(&vm->input_arrived, &vm->input_lock, INFINITE);
+    }
+    LeaveCriticalSection(&vm->input_lock);
+}
+
+void input_wait_ms(struct lc3_vm *vm, unsigned ms)
+{
+    EnterCriticalSection(&vm->input_lock);
+    if (input_empty(vm) && !atomic_load(&vm->input_eof))
+    {
+        SleepConditionVariableCS(&vm->input_arrived, &vm->input_lock, ms);
+    }
+    LeaveCriticalSection(&vm->input_lock);
+}
+
+void input_backoff(void)
+{
+    Sleep(1);
+}
+#endif
+
+/* guarded by console_lock */
+struct lc3_vm *console_vm = NULL; /* fed by the reader thread */
+int console_reading = 0;          /* the reader thread has been started */
+int console_eof = 0;              /* stdin has ended, for VMs attached later */
+
+/**
+ * Hand one byte (or EOF) from stdin to the console VM, returns 0 while its ring is full
+ */
+int console_deliver(int c)
+{
+    console_acquire();
+    struct lc3_vm *vm = console_vm;
+    int done = 1;
+    if (c == EOF)
+    {
+        console_eof = 1;
+        if (vm)
+        {
+            atomic_store(&vm->input_eof, 1);
+        }
+    }
+    else if (vm)
+    {
+        done = input_push(vm, (uint16_t)c);
+    }
+    if (vm && done)
+    {
+        input_notify(vm);
+    }
+    console_release();
+    return done;
+}
+
+/**
+ * Body of the reader thread
+ */
+void input_reader(void)
+{
+    for (;;)
+    {
+        int c = getchar();
+        while (!console_deliver(c))
+        {
+            input_backoff();
+        }
+        if (c == EOF)
+        {
+            return;
+        }
+    }
+}
+
+#if defined(__APPLE__) || defined(__linux__)
+void *input_thread(void *arg)
+{
+    (void)arg;
+    input_reader();
+    return NULL;
+}
+
+int input_thread_start(void)
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, input_thread, NULL) != 0)
+    {
+        return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+#else
+DWORD WINAPI input_thread(LPVOID arg)
+{
+    (void)arg;
+    input_reader();
+    return 0;
+}
+
+int input_thread_start(void)
+{
+    HANDLE thread = CreateThread(NULL, 0, input_thread, NULL, 0, NULL);
+    if (!thread)
+    {
+        return 0;
+    }
+    CloseHandle(thread);
+    return 1;
+}
+#endif
+
+/** keyboard input comes straight from a stream or buffer, a recording, or from nowhere, never from the console */
+int input_headless(const struct lc3_vm *vm)
+{
+    return vm->config.headless || vm->config.input || vm->config.input_data || vm->replaying;
+}
+
+void lc3_start_input(struct lc3_vm *vm)
+{
+    vm->input_started = 1;
+    if (input_headless(vm) || vm->config.kbd_poll > 0)
+    {
+        return; /* polled from input_key_ready() */
+    }
+
+    console_acquire();
+    console_vm = vm;
+    if (console_eof)
+    {
+        atomic_store(&vm->input_eof, 1);
+    }
+    int start = !console_reading;
+    console_reading = 1;
+    if (start && !input_thread_start())
+    {
+        console_reading = 0;
+        console_vm = NULL;
+        vm->config.kbd_poll = 1; /* no thread, fall back to polling */
+    }
+    console_release();
+}
+
+/**
+ * The next byte (or EOF) of the host input without the reader thread:
+ * `config.input_data`, `config.input`, nothing when headless, else stdin. Only stdin can block.
+ */
+int input_host_byte(struct lc3_vm *vm)
+{
+    if (vm->config.input_data)
+    {
+        return vm->input_pos < vm->config.input_size ? ((const uint8_t *)vm->config.input_data)[vm->input_pos++] : EOF;
+    }
+    if (vm->config.input)
+    {
+        return fgetc(vm->config.input);
+    }
+    return vm->config.headless ? EOF : fgetc(stdin);
+}
+
+/**
+ * Move one byte (or EOF) from the host input into the ring, without the reader thread
+ */
+void input_read_host(struct lc3_vm *vm)
+{
+    int c = input_host_byte(vm);
+    if (c == EOF)
+    {
+        atomic_store(&vm->input_eof, 1);
+    }
+    else
+    {
+        input_push(vm, (uint16_t)c);
+    }
+}
+
+/**
+ * Is there a key (or EOF) to read? Throttled host poll in polling mode.
+ */
+int input_key_ready(struct lc3_vm *vm)
+{
+    output_input_wait(vm);
+    snapshot_input_wait(vm);
+    if (!vm->input_started)
+    {
+        lc3_start_input(vm);
+    }
+    if (input_empty(vm) && !atomic_load_explicit(&vm->input_eof, memory_order_relaxed))
+    {
+        if (input_headless(vm))
+        {
+            input_read_host(vm); /* the next byte of a stream or buffer is always ready */
+        }
+        else if (vm->config.kbd_poll > 0 && ++vm->input_polls >= vm->config.kbd_poll)
+        {
+            vm->input_polls = 0;
+            if (check_key())
+            {
+                input_read_host(vm);
+            }
+        }
+    }
+
+    return !input_empty(vm) || atomic_load_explicit(&vm->input_eof, memory_order_acquire);
+}
+
+/**
+ * Block on the host input until a key arrives or IDLE_TIMEOUT_MS have passed
+ */
+void input_sleep(struct lc3_vm *vm)
+{
+    uint64_t start = now_ns();
+    if (vm->config.kbd_poll > 0)
+    {
+        if (wait_key(IDLE_TIMEOUT_MS))
+        {
+            input_read_host(vm);
+        }
+    }
+    else
+    {
+        input_wait_ms(vm, IDLE_TIMEOUT_MS); /* woken by the reader thread */
+    }
+    metric_add(&vm->metrics->input_wait_ns, now_ns() - start);
+}
+
+/**
+ * Idle detection (config.idle_sleep), for every KBSR read that found no key.
+ * IDLE_SPINS such reads within IDLE_WINDOW_MS mean the guest does little but poll, e.g. `LDI R0, KBSR; BRzp`:
+ * instead of spinning, the host blocks on its input until a key arrives or IDLE_TIMEOUT_MS have passed.
+ * The guest sees the same as before, its polling loop just runs fewer times. Headless VMs never get here.
+ */
+void input_idle(struct lc3_vm *vm)
+{
+    if (!vm->config.idle_sleep || ++vm->idle_polls < IDLE_SPINS)
+    {
+        return;
+    }
+    vm->idle_polls = 0;
+
+    uint64_t now = now_ms();
+    if (now - vm->idle_since <= IDLE_WINDOW_MS)
+    {
+        input_sleep(vm);
+        now = now_ms();
+        if (input_empty(vm))
+        {
+            vm->idle_polls = IDLE_SPINS - IDLE_RESPINS; /* still idle, the next key resets the count */
+        }
+    }
+    vm->idle_since = now;
+}
+
+/**
+ * Take the next key, INPUT_EOF after the end of input. Blocks while nothing has arrived yet.
+ */
+uint16_t input_getc(struct lc3_vm *vm)
+{
+    uint16_t c;
+    output_input_wait(vm);
+    snapshot_input_wait(vm);
+    if (!vm->input_started)
+    {
+        lc3_start_input(vm);
+    }
+    if (input_pop(vm, &c))
+    {
+        return c;
+    }
+
+    if (input_headless(vm) || vm->config.kbd_poll > 0)
+    {
+        if (atomic_load(&vm->input_eof))
+        {
+            return INPUT_EOF;
+        }
+        uint64_t start = now_ns();
+        int host = input_host_byte(vm); /* nothing buffered, block on the host */
+        metric_add(&vm->metrics->input_wait_ns, now_ns() - start);
+        if (host == EOF)
+        {
+            atomic_store(&vm->input_eof, 1);
+            return INPUT_EOF;
+        }
+        return (uint16_t)host;
+    }
+
+    uint64_t start = now_ns();
+    input_wait(vm);
+    metric_add(&vm->metrics->input_wait_ns, now_ns() - start);
+    return input_pop(vm, &c) ? c : INPUT_EOF;
+}
+
+/**
+ * Record and replay (config.record, lc3_replay())
+ *
+ * What a guest does only depends on its input and on when it sees it. The clock is `input_reads`, the number
+ * of KBSR reads and input traps so far: the same program reading the same keys at the same reads runs the same
+ * instructions, on every engine, without the interpreter loops having to keep an exact instruction count.
+ * A recording is RECORD_MAGIC and pairs of LEB128 varints: the reads since the previous key, and the key
+ * (INPUT_EOF for the end of input, the last event). A replay answers every read from memory: no terminal, no system calls,
+ * and after the last event the keyboard is at its end.
+ */
+#define RECORD_MAGIC "LC3R\1" /* and the format version */
+#define RECORD_MAGIC_SIZE 5
+
+void record_varint(FILE *file, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        fputc((int)(v & 0x7F) | 0x80, file);
+        v >>= 7;
+    }
+    fputc((int)v, file);
+}
+
+void record_key(struct lc3_vm *vm, uint16_t c)
+{
+    if (vm->config.record && !vm->record_eof) /* the input stays at its end, and so does a replay */
+    {
+        vm->record_eof = c == INPUT_EOF;
+        record_varint(vm->config.record, vm->input_reads - vm->record_last);
+        record_varint(vm->config.record, c);
+        vm->record_last = vm->input_reads;
+    }
+}
+
+/** the next varint of the recording, 0 at its end */
+int replay_varint(struct lc3_vm *vm, uint64_t *v)
+{
+    *v = 0;
+    for (int shift = 0; vm->replay_pos < vm->replay_size && shift < 64; shift += 7)
+    {
+        uint8_t b = vm->replay_data[vm->replay_pos++];
+        *v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void replay_advance(struct lc3_vm *vm)
+{
+    uint64_t delta = 0, key = 0;
+    vm->replay_pending = replay_varint(vm, &delta) && replay_varint(vm, &key);
+    if (vm->replay_pending)
+    {
+        vm->replay_at += delta; /* a truncated event is no event, its partial fields are dropped */
+        vm->replay_key = (uint16_t)key;
+    }
+}
+
+int lc3_replay(struct lc3_vm *vm, FILE *file)
+{
+    char magic[RECORD_MAGIC_SIZE];
+    if (fread(magic, 1, RECORD_MAGIC_SIZE, file) != RECORD_MAGIC_SIZE || memcmp(magic, RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0)
+    {
+        return 0;
+    }
+    size_t cap = 4096;
+    uint8_t *data = malloc(cap);
+    size_t size = 0, read;
+    while (data && (read = fread(data + size, 1, cap - size, file)) > 0)
+    {
+        size += read;
+        if (size == cap)
+        {
+            uint8_t *grown = realloc(data, cap *= 2);
+            if (!grown)
+            {
+                free(data);
+            }
+            data = grown;
+        }
+    }
+    if (!data || ferror(file))
+    {
+        free(data);
+        return 0;
+    }
+    free(vm->replay_data);
+    vm->replay_data = data;
+    vm->replay_size = size;
+    vm->replay_pos = 0;
+    vm->replay_at = 0;
+    vm->replaying = 1;
+    replay_advance(vm);
+    return 1;
+}
+
+/**
+ * KBSR read of the guest: is a key visible, and which one
+ */
+int input_guest_poll(struct lc3_vm *vm, uint16_t *c)
+{
+    ++vm->input_reads;
+    if (vm->replaying)
+    {
+        if (!vm->replay_pending)
+        {
+            *c = INPUT_EOF;
+            return 1;
+        }
+        if (vm->replay_at != vm->input_reads)
+        {
+            return 0;
+        }
+        *c = vm->replay_key;
+        replay_advance(vm);
+        return 1;
+    }
+    if (!input_key_ready(vm))
+    {
+        return 0;
+    }
+    *c = input_getc(vm);
+    record_key(vm, *c);
+    return 1;
+}
+
+/**
+ * TRAP_GETC and TRAP_IN: the next key, waiting for it if need be
+ */
+uint16_t input_guest_getc(struct lc3_vm *vm)
+{
+    ++vm->input_reads;
+    if (vm->replaying)
+    {
+        uint16_t c = vm->replay_pending ? vm->replay_key : INPUT_EOF;
+        if (vm->replay_pending)
+        {
+            replay_advance(vm);
+        }
+        return c;
+    }
+    uint16_t c = input_getc(vm);
+    record_key(vm, c);
+    return c;
+}
+
+/**
+ * config.input_nowait: TRAP_GETC or TRAP_IN found no key. The engine stops as after TRAP_HALT, but with the trap
+ * not run and PC back on it, so the next lc3_run() tries again; lc3_run() returns LC3_INPUT.
+ */
+int input_block(struct lc3_vm *vm)
+{
+    if (!vm->config.input_nowait || input_headless(vm) || input_key_ready(vm))
+    {
+        return 0;
+    }
+    vm->reg[R_PC] -= 1;
+    vm->stop = LC3_INPUT;
+    vm->running = 0;
+    return 1;
+}
+#pragma endregion
+
+#pragma region Memory
+/**
+ * Device page 0xFE00 - 0xFFFF. Only the keyboard status register does anything on access,
+ * the other addresses behave like RAM.
+ */
+uint16_t io_read(struct lc3_vm *vm, uint16_t addr)
+{
+    if (addr == MR_KBSR)
+    {
+        uint16_t c;
+        uint16_t ie = vm->memory[MR_KBSR] & KBSR_IE;
+        if (vm->config.interrupts && (vm->memory[MR_KBSR] & KBSR_READY))
+        {
+            /* like the hardware, a key stays in KBDR until it is read */
+        }
+        else if (input_guest_poll(vm, &c))
+        {
+            vm->memory[MR_KBSR] = KBSR_READY | ie;
+            vm->memory[MR_KBDR] = c;
+            vm->idle_polls = 0;
+        }
+        else if (!vm->replaying)
+        {
+            vm->memory[MR_KBSR] = ie;
+            input_idle(vm);
+        }
+        else
+        {
+            vm->memory[MR_KBSR] = ie;
+        }
+    }
+    else if (addr == MR_KBDR && vm->config.interrupts)
+    {
+        vm->memory[MR_KBSR] &= ~KBSR_READY;
+    }
+    else if (addr == MR_PSR)
+    {
+        return vm->psr | get_cond(vm);
+    }
+    return vm->memory[addr];
+}
+
+void io_write(struct lc3_vm *vm, uint16_t addr, uint16_t val)
+{
+    if (addr == MR_KBSR)
+    {
+        val = (vm->memory[MR_KBSR] & KBSR_READY) | (val & KBSR_IE); /* only the enable bit is writable */
+    }
+    else if (addr == MR_PSR)
+    {
+        return;
+    }
+    vm->memory[addr] = val;
+}
+
+/**
+ * Route every access to `page` through a device
+ */
+void map_device(struct lc3_vm *vm, uint16_t page, device_read_fn read, device_write_fn write)
+{
+    vm->device_map[page] = (struct device){.read = read, .write = write};
+    vm->page_flags[page] |= PAGE_DEVICE;
+}
+
+/**
+ * Set up the device pages, before anything runs
+ */
+void init_memory(struct lc3_vm *vm)
+{
+    for (uint16_t page = MR_KBSR >> PAGE_SHIFT; page < PAGE_COUNT; ++page)
+    {
+        map_device(vm, page, io_read, io_write);
+    }
+}
+
+/**
+ * The rare part of mem_write(): the first store into a page, a store into a page with translated code or a watchpoint
+ */
+LC3_INLINE void mem_write_watched(struct lc3_vm *vm, uint16_t addr, uint8_t flags)
+{
+    if (flags & PAGE_CLEAN)
+    {
+        mem_mark_dirty(vm, addr >> PAGE_SHIFT);
+    }
+    if ((flags & PAGE_WATCH) && (vm->watch_kinds[addr] & LC3_WATCH_WRITE))
+    {
+        debug_watch_hit(vm, addr, LC3_WATCH_WRITE);
+    }
+#ifdef LC3_HAVE_JIT
+    if ((flags & PAGE_JIT) && (vm->jit_code_bits[addr >> 3] >> (addr & 7)) & 1)
+    {
+        jit_invalidate(vm, addr); /* the store hit translated code */
+    }
+#endif
+}
+
+LC3_INLINE void mem_write(struct lc3_vm *vm, uint16_t addr, uint16_t val)
+{
+    uint8_t flags = vm->page_flags[addr >> PAGE_SHIFT];
+    if (flags & PAGE_DEVICE)
+    {
+        vm->device_map[addr >> PAGE_SHIFT].write(vm, addr, val);
+        if ((flags & PAGE_WATCH) && (vm->watch_kinds[addr] & LC3_WATCH_WRITE))
+        {
+            debug_watch_hit(vm, addr, LC3_WATCH_WRITE);
+        }
+        return;
+    }
+
+    vm->memory[addr] = val;
+    /* the store may have hit code, also an instruction inside a superinstruction starting up to two words earlier */
+    vm->decoded[addr].handler = H_DECODE;
+    vm->decoded[(uint16_t)(addr - 1)].handler = H_DECODE;
+    vm->decoded[(uint16_t)(addr - 2)].handler = H_DECODE;
+    if (flags & (PAGE_CLEAN | PAGE_JIT | PAGE_WATCH))
+    {
+        mem_write_watched(vm, addr, flags);
+    }
+}
+
+/**
+ * The rare part of mem_read(): devices and watchpoints
+ */
+uint16_t mem_read_watched(struct lc3_vm *vm, uint16_t address, uint8_t flags)
+{
+    if ((flags & PAGE_WATCH) && (vm->watch_kinds[address] & LC3_WATCH_READ))
+    {
+        debug_watch_hit(vm, address, LC3_WATCH_READ);
+    }
+    if (flags & PAGE_DEVICE)
+    {
+        return vm->device_map[address >> PAGE_SHIFT].read(vm, address);
+    }
+    return vm->memory[address];
+}
+
+uint16_t mem_read(struct lc3_vm *vm, uint16_t address)
+{
+    uint8_t flags = vm->page_flags[address >> PAGE_SHIFT];
+    if (flags & (PAGE_DEVICE | PAGE_WATCH))
+    {
+        return mem_read_watched(vm, address, flags);
+    }
+    return vm->memory[address];
+}
+
+/**
+ * How an engine variant reaches memory (ENGINE_MEMORY in lc3_engines.inc). The mode is a constant wherever
+ * mem_load() and mem_store() are inlined, so each variant compiles to one of the two paths only.
+ * - MEM_PAGED: mem_read() and mem_write(), always right.
+ * - MEM_FLAT: while memory_flat() holds no page below the I/O page is special, so the address alone tells a device
+ *   access and the page flags are never loaded.
+ */
+enum
+{
+    MEM_PAGED,
+    MEM_FLAT,
+};
+
+LC3_INLINE uint16_t mem_load(struct lc3_vm *vm, uint16_t addr, int mode)
+{
+    if (mode == MEM_PAGED)
+    {
+        return mem_read(vm, addr);
+    }
+    return addr >= MR_KBSR ? io_read(vm, addr) : vm->memory[addr];
+}
+
+LC3_INLINE void mem_store(struct lc3_vm *vm, uint16_t addr, uint16_t val, int mode)
+{
+    if (mode == MEM_PAGED)
+    {
+        mem_write(vm, addr, val);
+        return;
+    }
+    if (addr >= MR_KBSR)
+    {
+        io_write(vm, addr, val);
+        return;
+    }
+    vm->memory[addr] = val;
+    vm->decoded[addr].handler = H_DECODE;
+    vm->decoded[(uint16_t)(addr - 1)].handler = H_DECODE;
+    vm->decoded[(uint16_t)(addr - 2)].handler = H_DECODE;
+}
+
+/**
+ * MEM_FLAT is right for the next run: the I/O pages are plain devices and no other page has a flag,
+ * i.e. no snapshot tracking, translated code or watchpoints. Only lc3_run() callers change that, never the guest.
+ */
+int memory_flat(const struct lc3_vm *vm)
+{
+    static const uint8_t io_flags[PAGE_COUNT - (MR_KBSR >> PAGE_SHIFT)] = {PAGE_DEVICE, PAGE_DEVICE};
+    _Static_assert(sizeof(io_flags) == 2, "the I/O region is the last two pages");
+    for (int page = 0; page < (MR_KBSR >> PAGE_SHIFT); ++page)
+    {
+        if (vm->page_flags[page])
+        {
+            return 0;
+        }
+    }
+    return memcmp(vm->page_flags + (MR_KBSR >> PAGE_SHIFT), io_flags, sizeof(io_flags)) == 0;
+}
+#pragma endregion
+
+/**
+ * Split the instruction stored at `addr` into a cache entry.
+ * PC-relative offsets are resolved against `addr + 1` (the incremented PC) right here,
+ * since an entry always belongs to one fixed address.
+ */
+void decode_instr(uint16_t addr, uint16_t instr, struct decoded_instr *d)
+{
+    uint16_t next_pc = addr + 1;
+
+    d->instr = instr;
+    d->r0 = (instr >> 9) & 0x7; /* bit 9..11 */
+    d->r1 = (instr >> 6) & 0x7; /* bit 6..8 */
+    d->r2 = instr & 0x7;        /* bit 0..2 */
+    d->imm = 0;
+
+    switch (instr >> 12 /* 4 most significant bits is opcode */)
+    {
+    case OP_BR:
+        d->handler = H_BR;
+        d->imm = next_pc + sign_extend(instr & 0x1FF, 9);
+        break;
+    case OP_ADD:
+    case OP_AND:
+    {
+        uint16_t imm_flag = (instr >> 5) & 0x1; /* bit 5, whether we are in immediate mode */
+        if ((instr >> 12) == OP_ADD)
+        {
+            d->handler = imm_flag ? H_ADDI : H_ADD;
+        }
+        else
+        {
+            d->handler = imm_flag ? H_ANDI : H_AND;
+        }
+        d->imm = sign_extend(instr & 0x1F, 5);
+        break;
+    }
+    case OP_NOT:
+        d->handler = H_NOT;
+        break;
+    case OP_LD:
+        d->handler = H_LD;
+        d->imm = next_pc + sign_extend(instr & 0x1FF, 9);
+        break;
+    case OP_LDI:
+        d->handler = H_LDI;
+        d->imm = next_pc + sign_extend(instr & 0x1FF, 9);
+        break;
+    case OP_LDR:
+        d->handler = H_LDR;
+        d->imm = sign_extend(instr & 0x3F, 6);
+        break;
+    case OP_LEA:
+        d->handler = H_LEA;
+        d->imm = next_pc + sign_extend(instr & 0x1FF, 9);
+        break;
+    case OP_ST:
+        d->handler = H_ST;
+        d->imm = next_pc + sign_extend(instr & 0x1FF, 9);
+        break;
+    case OP_STI:
+        d->handler = H_STI;
+        d->imm = next_pc + sign_extend(instr & 0x1FF, 9);
+        break;
+    case OP_STR:
+        d->handler = H_STR;
+        d->imm = sign_extend(instr & 0x3F, 6);
+        break;
+    case OP_JMP:
+        d->handler = H_JMP;
+        break;
+    case OP_JSR:
+        if ((instr >> 11) & 1 /* long flag, bit 11 */)
+        {
+            d->handler = H_JSR;
+            d->imm = next_pc + sign_extend(instr & 0x7FF, 11);
+        }
+        else
+        {
+            d->handler = H_JSRR;
+        }
+        break;
+    case OP_TRAP:
+        d->handler = H_TRAP;
+        d->imm = instr & 0xFF;
+        break;
+    case OP_RES: /* unused */
+    case OP_RTI: /* unused */
+    default:
+        d->handler = H_BAD;
+        break;
+    }
+}
+
+/** the handler of an entry's own instruction, also when the entry starts a superinstruction */
+uint8_t plain_handler(const struct decoded_instr *d)
+{
+    switch (d->handler)
+    {
+    case H_LOAD_CONST:
+        return H_ANDI;
+    case H_ADDI_BR:
+        return H_ADDI;
+    case H_LDR_ADDI_STR:
+        return H_LDR;
+    case H_NEG:
+        return H_NOT;
+    case H_JSR_NATIVE:
+        return H_JSR;
+    default:
+        return d->handler;
+    }
+}
+
+/**
+ * Peephole pass over the decoded cache (config.fuse).
+ * If the instruction at `pc` starts one of the H_LOAD_CONST..H_NEG sequences and the others are decoded as well,
+ * its entry becomes a superinstruction that runs the whole sequence with one dispatch. It reads the operands of the
+ * other instructions from their own entries, which stay as they are, so a jump into the middle still runs them one by one.
+ * mem_write() drops the entries of the two words before every store as well: a superinstruction is gone
+ * as soon as one of its instructions changes.
+ */
+void fuse(struct lc3_vm *vm, uint16_t pc)
+{
+    struct decoded_instr *d = &vm->decoded[pc];
+    struct decoded_instr *d1 = &vm->decoded[(uint16_t)(pc + 1)];
+    struct decoded_instr *d2 = &vm->decoded[(uint16_t)(pc + 2)];
+    if (d->handler == H_DECODE || d1->handler == H_DECODE || pc == MEMORY_MAX - 1)
+    {
+        return; /* device pages are never decoded into the cache, so nothing fuses with them */
+    }
+
+    uint8_t first = plain_handler(d), next = plain_handler(d1);
+    uint8_t handler = H_DECODE;
+    if (first == H_ANDI && d->imm == 0 && next == H_ADDI && d1->r0 == d->r0 && d1->r1 == d->r0)
+    {
+        handler = H_LOAD_CONST;
+    }
+    else if (first == H_ADDI && next == H_BR)
+    {
+        handler = H_ADDI_BR;
+    }
+    else if (first == H_NOT && next == H_ADDI && d1->imm == 1 && d1->r0 == d->r0 && d1->r1 == d->r0)
+    {
+        handler = H_NEG;
+    }
+    else if (first == H_LDR && next == H_ADDI && d1->r1 == d->r0 && d->r0 != d->r1 && d1->r0 != d->r1 &&
+             pc < MEMORY_MAX - 2 && plain_handler(d2) == H_STR && d2->r0 == d1->r0 && d2->r1 == d->r1 && d2->imm == d->imm)
+    {
+        /* neither the load nor the add changes the base, so both memory accesses use the same address */
+        handler = H_LDR_ADDI_STR;
+    }
+
+    if (handler != H_DECODE && handler != d->handler)
+    {
+        d->handler = handler;
+        ++vm->fused_formed[handler - FUSED_FIRST];
+    }
+}
+
+/**
+ * Fill the cache entry of `pc` on its first fetch.
+ * Device pages are never cached because their content changes behind the VM's back,
+ * such addresses are fetched through their device and decoded into a scratch entry every time.
+ * Fetches from any other page read `memory` directly.
+ */
+struct decoded_instr *fetch_decode(struct lc3_vm *vm, uint16_t pc)
+{
+    if (vm->page_flags[pc >> PAGE_SHIFT] & PAGE_DEVICE)
+    {
+        decode_instr(pc, mem_read(vm, pc), &vm->uncached);
+        return &vm->uncached;
+    }
+
+    decode_instr(pc, vm->memory[pc], &vm->decoded[pc]);
+    if (vm->debug_points)
+    {
+        if ((vm->break_bits[pc >> 3] >> (pc & 7)) & 1)
+        {
+            vm->decoded[pc].handler = H_BREAK; /* the rest of the entry is the instruction, see debug_break() */
+        }
+        return &vm->decoded[pc];
+    }
+    if (vm->profile || vm->trace)
+    {
+        return &vm->decoded[pc]; /* profiles and traces see instructions one by one */
+    }
+    struct decoded_instr *d = &vm->decoded[pc];
+    int routine;
+    if (vm->config.native_routines && d->handler == H_JSR && (routine = routine_find(vm, d->imm)) >= 0)
+    {
+        d->handler = H_JSR_NATIVE;
+        d->r2 = (uint8_t)routine;
+        ++vm->routine_sites[routine];
+    }
+    if (vm->config.fuse)
+    {
+        /* the new entry may start a sequence, or complete one that starts up to two words earlier */
+        fuse(vm, pc - 2);
+        fuse(vm, pc - 1);
+        fuse(vm, pc);
+    }
+    return d;
+}
+
+#pragma region Instruction semantics
+/**
+ * The behavior of every handler, shared by all execution engines.
+ * An engine only decides how it gets from one instruction to the next, and with `mem` how memory is reached
+ * (MEM_PAGED or MEM_FLAT, see mem_load()).
+ */
+
+LC3_INLINE void exec_add(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    vm->reg[d->r0] = vm->reg[d->r1] + vm->reg[d->r2];
+    update_flags(vm, d->r0);
+}
+
+LC3_INLINE void exec_addi(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    vm->reg[d->r0] = vm->reg[d->r1] + d->imm;
+    update_flags(vm, d->r0);
+}
+
+LC3_INLINE void exec_and(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    vm->reg[d->r0] = vm->reg[d->r1] & vm->reg[d->r2];
+    update_flags(vm, d->r0);
+}
+
+LC3_INLINE void exec_andi(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    vm->reg[d->r0] = vm->reg[d->r1] & d->imm;
+    update_flags(vm, d->r0);
+}
+
+LC3_INLINE void exec_not(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    vm->reg[d->r0] = ~vm->reg[d->r1];
+    update_flags(vm, d->r0);
+}
+
+LC3_INLINE void exec_br(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    /* r0 holds the condition flag, bit [9:11] (bit 9 is p, bit 10 is z, bit 11 is n) */
+    if (d->r0 & cond_flags(vm->cond_value))
+    {
+        vm->reg[R_PC] = d->imm;
+    }
+}
+
+LC3_INLINE void exec_jmp(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    /**
+     * RET is a special case of JMP. RET happens whenever R1 is 7
+     */
+    vm->reg[R_PC] = vm->reg[d->r1];
+}
+
+LC3_INLINE void exec_jsr(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    vm->reg[R_R7] = vm->reg[R_PC];
+    vm->reg[R_PC] = d->imm;
+}
+
+LC3_INLINE void exec_jsrr(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    vm->reg[R_R7] = vm->reg[R_PC];
+    vm->reg[R_PC] = vm->reg[d->r1];
+}
+
+LC3_INLINE void exec_ld(struct lc3_vm *vm, const struct decoded_instr *d, int mem)
+{
+    vm->reg[d->r0] = mem_load(vm, d->imm, mem);
+    update_flags(vm, d->r0);
+}
+
+LC3_INLINE void exec_ldi(struct lc3_vm *vm, const struct decoded_instr *d, int mem)
+{
+    /**
+     * Load value from a location of memory into a register.
+     * An address is computed by sign-extending bits [8:0] to 16 bits and adding this value to the incremented PC.
+     * The resulting sum is an address to a location in memory, and that address contains, yet another value which is the address of the value to load.
+     * Also, the condition codes are set based on whether the value loaded is negative, zero, or positive.
+     */
+    vm->reg[d->r0] = mem_load(vm, mem_load(vm, d->imm, mem), mem);
+    update_flags(vm, d->r0);
+}
+
+LC3_INLINE void exec_ldr(struct lc3_vm *vm, const struct decoded_instr *d, int mem)
+{
+    vm->reg[d->r0] = mem_load(vm, vm->reg[d->r1] + d->imm, mem);
+    update_flags(vm, d->r0);
+}
+
+LC3_INLINE void exec_lea(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    vm->reg[d->r0] = d->imm;
+    update_flags(vm, d->r0);
+}
+
+LC3_INLINE void exec_st(struct lc3_vm *vm, const struct decoded_instr *d, int mem)
+{
+    mem_store(vm, d->imm, vm->reg[d->r0], mem);
+}
+
+LC3_INLINE void exec_sti(struct lc3_vm *vm, const struct decoded_instr *d, int mem)
+{
+    mem_store(vm, mem_load(vm, d->imm, mem), vm->reg[d->r0], mem);
+}
+
+LC3_INLINE void exec_str(struct lc3_vm *vm, const struct decoded_instr *d, int mem)
+{
+    mem_store(vm, vm->reg[d->r1] + d->imm, vm->reg[d->r0], mem);
+}
+
+/**
+ * Superinstructions, see fuse(). `d` is the entry of the first instruction, `d + 1` and `d + 2` those of the others.
+ * The effect is exactly that of the sequence: PC, registers and flags end up as after its last instruction,
+ * and every memory access happens with PC where the original instruction would have it.
+ * Engines run only the first instruction (plain_handler()) when the step budget ends inside the sequence.
+ */
+LC3_INLINE void exec_load_const(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    ++vm->fused_runs[H_LOAD_CONST - FUSED_FIRST];
+    vm->reg[R_PC] += 1;
+    vm->reg[d->r0] = d[1].imm;
+    update_flags(vm, d->r0);
+}
+
+LC3_INLINE void exec_addi_br(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    ++vm->fused_runs[H_ADDI_BR - FUSED_FIRST];
+    exec_addi(vm, d);
+    vm->reg[R_PC] += 1;
+    exec_br(vm, d + 1);
+}
+
+LC3_INLINE void exec_ldr_addi_str(struct lc3_vm *vm, const struct decoded_instr *d, int mem)
+{
+    ++vm->fused_runs[H_LDR_ADDI_STR - FUSED_FIRST];
+    uint16_t addr = vm->reg[d->r1] + d->imm;
+    vm->reg[d->r0] = mem_load(vm, addr, mem);
+    vm->reg[R_PC] += 2;
+    vm->reg[d[1].r0] = vm->reg[d->r0] + d[1].imm;
+    update_flags(vm, d[1].r0);
+    mem_store(vm, addr, vm->reg[d[1].r0], mem);
+}
+
+LC3_INLINE void exec_neg(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    ++vm->fused_runs[H_NEG - FUSED_FIRST];
+    vm->reg[R_PC] += 1;
+    vm->reg[d->r0] = -vm->reg[d->r1];
+    update_flags(vm, d->r0);
+}
+
+#pragma endregion
+
+#pragma region Native routines
+/**
+ * LC-3 has no multiply or divide instruction, so programs carry subroutines for them, and these loops easily
+ * dominate a profile. Well-known ones are recognised by their code (config.native_routines): when fetch_decode()
+ * fills the entry of a JSR, routine_find() hashes the first ROUTINE_KEY_LEN words at its target, compares the hash
+ * with those of the table below and the whole code on a hit. A match turns the entry into H_JSR_NATIVE.
+ * Their branches are PC-relative, so they are found wherever an image puts them.
+ *
+ * The native versions have exactly the effect of the guest code: registers, condition codes, the registers it
+ * saves below R6 (stored in the order the guest stores them) and the instructions it takes, which come out of the
+ * step budget. They decline arguments the guest loops would only handle by 16-bit wraparound, and calls that
+ * would not fit into the budget; the guest code runs then, as it does when the code was changed since the JSR was
+ * decoded (stores drop the entries they hit, not those of the JSRs calling them) or the stack is not plain RAM.
+ */
+#define ROUTINE_KEY_LEN 8 /* all routines are longer */
+
+struct native_routine
+{
+    const char *name;
+    const uint16_t *code;
+    uint16_t len;
+    uint16_t saved; /* words stored below R6 */
+    /* the effect of a call given R7 and PC are already set by its JSR; the instructions it took,
+       0 without any effect if the guest code has to run */
+    uint32_t (*run)(struct lc3_vm *vm, uint64_t steps);
+};
+
+/**
+ * 2048's division, R1 = R0 / R1 and R0 = R0 % R1 by repeated subtraction. Saves R1-R3, restores R2 and R3.
+ * Taken for R0 >= 0 and R1 > 0: negative numbers wrap around in its loop and a zero divisor halts the machine.
+ */
+static const uint16_t routine_div_code[] = {
+    0x73BF, 0x75BE, 0x77BD, 0x1DBD, 0x947F, 0x14A1, 0x040C, 0x5260, 0x1261, 0x1002,
+    0x03FD, 0x0403, 0x6582, 0x127F, 0x1002, 0x6780, 0x6581, 0x1DA3, 0xC1C0, 0xF025,
+};
+
+uint32_t routine_div(struct lc3_vm *vm, uint64_t steps)
+{
+    int16_t n = (int16_t)vm->reg[R_R0], d = (int16_t)vm->reg[R_R1];
+    if (n < 0 || d <= 0)
+    {
+        return 0;
+    }
+    /* the loop subtracts until the rest is <= 0, a negative one is given back once, also for 0 / d */
+    uint32_t loops = n == 0 ? 1 : ((uint32_t)n + d - 1) / d;
+    uint32_t taken = 13 + 3 * loops + (n % d != 0 || n == 0 ? 3 : 0);
+    if (taken > steps)
+    {
+        return 0;
+    }
+
+    uint16_t sp = vm->reg[R_R6];
+    mem_write(vm, sp - 1, vm->reg[R_R1]);
+    mem_write(vm, sp - 2, vm->reg[R_R2]);
+    mem_write(vm, sp - 3, vm->reg[R_R3]);
+    vm->reg[R_R0] = n % d;
+    vm->reg[R_R1] = n / d;
+    update_flags(vm, R_R6); /* its last ALU instruction puts the stack pointer back */
+    return taken;
+}
+
+/**
+ * 2048's multiplication, R0 = R0 * R1 by shift and add over bits 0-14 of R0. Saves and restores R1-R4.
+ * A zero operand returns R0 = 0 early.
+ */
+static const uint16_t routine_mul_code[] = {
+    0x1020, 0x0416, 0x1260, 0x0414, 0x73BF, 0x75BE, 0x77BD, 0x79BC, 0x1DBC, 0x54A0, 0x16A1, 0x5803, 0x0C01,
+    0x1481, 0x1241, 0x16C3, 0x03FA, 0x10A0, 0x6980, 0x6781, 0x6582, 0x6383, 0x1DA4, 0xC1C0, 0x5020, 0xC1C0,
+};
+
+uint32_t routine_mul(struct lc3_vm *vm, uint64_t steps)
+{
+    uint16_t a = vm->reg[R_R0], b = vm->reg[R_R1];
+    uint32_t taken = a == 0 ? 4 : b == 0 ? 6 : 93;
+    if (a != 0 && b != 0)
+    {
+        for (uint16_t bits = a & 0x7FFF; bits; bits &= bits - 1)
+        {
+            ++taken; /* the add of a set bit */
+        }
+    }
+    if (taken > steps)
+    {
+        return 0;
+    }
+
+    if (a == 0 || b == 0)
+    {
+        vm->reg[R_R0] = 0;
+        update_flags(vm, R_R0);
+        return taken;
+    }
+    uint16_t sp = vm->reg[R_R6];
+    mem_write(vm, sp - 1, vm->reg[R_R1]);
+    mem_write(vm, sp - 2, vm->reg[R_R2]);
+    mem_write(vm, sp - 3, vm->reg[R_R3]);
+    mem_write(vm, sp - 4, vm->reg[R_R4]);
+    vm->reg[R_R0] = (uint16_t)((uint32_t)(a & 0x7FFF) * b);
+    update_flags(vm, R_R6);
+    return taken;
+}
+
+/**
+ * Rogue's modulo, R0 = R0 % R1 by repeated subtraction; R1 ends up negated. Saves and restores R2-R5 and R7.
+ * Taken for R0 >= 0 and R1 >= 0, a zero divisor leaves R0 as it is.
+ */
+static const uint16_t routine_mod_code[] = {
+    0x75BF, 0x77BE, 0x79BD, 0x7BBC, 0x7FBB, 0x1DBB, 0x927F, 0x1261, 0x0405, 0x1401, 0x0803,
+    0x1001, 0x1401, 0x07FD, 0x6F80, 0x6B81, 0x6982, 0x6783, 0x6584, 0x1DA5, 0xC1C0,
+};
+
+uint32_t routine_mod(struct lc3_vm *vm, uint64_t steps)
+{
+    int16_t n = (int16_t)vm->reg[R_R0], d = (int16_t)vm->reg[R_R1];
+    if (n < 0 || d < 0)
+    {
+        return 0;
+    }
+    uint32_t taken = d == 0 ? 16 : 18 + 3 * (uint32_t)(n / d);
+    if (taken > steps)
+    {
+        return 0;
+    }
+
+    uint16_t sp = vm->reg[R_R6];
+    mem_write(vm, sp - 1, vm->reg[R_R2]);
+    mem_write(vm, sp - 2, vm->reg[R_R3]);
+    mem_write(vm, sp - 3, vm->reg[R_R4]);
+    mem_write(vm, sp - 4, vm->reg[R_R5]);
+    mem_write(vm, sp - 5, vm->reg[R_R7]);
+    vm->reg[R_R0] = d == 0 ? n : n % d;
+    vm->reg[R_R1] = -d;
+    update_flags(vm, R_R6);
+    return taken;
+}
+
+#define ROUTINE(name, fn, saved) {name, routine_##fn##_code, sizeof(routine_##fn##_code) / 2, saved, routine_##fn}
+static const struct native_routine native_routines[ROUTINE_COUNT] = {
+    [ROUTINE_DIV] = ROUTINE("DIV", div, 3),
+    [ROUTINE_MUL] = ROUTINE("MUL", mul, 4),
+    [ROUTINE_MOD] = ROUTINE("MOD", mod, 5),
+};
+#undef ROUTINE
+
+LC3_INLINE uint64_t routine_key(const uint16_t *code)
+{
+    return fnv1a(code, 2 * ROUTINE_KEY_LEN);
+}
+
+/** for routine_find(), in host byte order like `memory` */
+void routine_init(struct lc3_vm *vm)
+{
+    for (int i = 0; i < ROUTINE_COUNT; ++i)
+    {
+        vm->routine_keys[i] = routine_key(native_routines[i].code);
+    }
+}
+
+/** `len` words from `addr` are plain RAM */
+LC3_INLINE int routine_ram(const struct lc3_vm *vm, uint16_t addr, uint16_t len)
+{
+    return addr + len <= MEMORY_MAX && !(vm->page_flags[addr >> PAGE_SHIFT] & PAGE_DEVICE) &&
+           !(vm->page_flags[(addr + len - 1) >> PAGE_SHIFT] & PAGE_DEVICE);
+}
+
+/**
+ * The ROUTINE_* whose code is at `addr`, -1 if none is
+ */
+int routine_find(const struct lc3_vm *vm, uint16_t addr)
+{
+    if (!routine_ram(vm, addr, ROUTINE_KEY_LEN))
+    {
+        return -1;
+    }
+    uint64_t key = routine_key(vm->memory + addr);
+    for (int i = 0; i < ROUTINE_COUNT; ++i)
+    {
+        const struct native_routine *r = &native_routines[i];
+        if (key == vm->routine_keys[i] && routine_ram(vm, addr, r->len) &&
+            memcmp(vm->memory + addr, r->code, 2 * (size_t)r->len) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/**
+ * H_JSR_NATIVE with `steps` left after the JSR: the JSR, and the subroutine up to its RET if it can run natively.
+ * Returns the instructions of the subroutine that ran that way.
+ */
+LC3_INLINE uint32_t exec_jsr_native(struct lc3_vm *vm, const struct decoded_instr *d, uint64_t steps)
+{
+    exec_jsr(vm, d);
+    const struct native_routine *r = &native_routines[d->r2];
+    uint16_t sp = vm->reg[R_R6];
+    if (memcmp(vm->memory + d->imm, r->code, 2 * (size_t)r->len) != 0 || sp < r->saved ||
+        !routine_ram(vm, sp - r->saved, r->saved) || (sp > d->imm && sp - r->saved < d->imm + r->len))
+    {
+        return 0; /* the code changed, or the saved registers would land on a device or on the code */
+    }
+    uint32_t taken = r->run(vm, steps);
+    if (taken)
+    {
+        vm->reg[R_PC] = vm->reg[R_R7]; /* RET */
+        ++vm->routine_runs[d->r2];
+    }
+    return taken;
+}
+#pragma endregion
+
+#pragma region Interrupts
+/**
+ * The privilege and interrupt model of the LC-3 (config.interrupts).
+ *
+ * PSR bit 15 is the mode (1: user), bits 10-8 the priority, bits 2-0 the condition codes. Interrupts and exceptions
+ * push PSR and PC on the supervisor stack (R6, swapped with `saved_ssp` when coming from user mode), enter supervisor
+ * mode and continue at the vector in the table at IVT_BASE; RTI pops both again. Supported:
+ * - the keyboard interrupt, vector x80 at priority 4, while KBSR_IE is set and a key is in KBDR
+ * - privilege violations (RTI in user mode), vector x00, and illegal opcodes (OP_RES), vector x01
+ * An exception without a handler in the table, and any OP_RES or RTI without the model, is a fault: the guest
+ * stops for good and lc3_run() returns LC3_FAULT with lc3_get_fault() saying why.
+ *
+ * Interrupts are taken between the slices of lc3_run(), every INTERRUPT_SLICE instructions, so the engines
+ * run as fast as without the model. A guest with nothing to do until the next key spins on `BR #-1`: there the VM
+ * sleeps on the host input instead (config.input_nowait: returns LC3_INPUT). TRAPs run in the VM as always.
+ */
+#define IVT_BASE 0x0100
+#define INTERRUPT_SLICE (1u << 14)
+#define PSR_USER (1 << 15)
+#define PSR_PRIORITY (7 << 8)
+
+enum
+{
+    INT_PRIVILEGE = 0x00,
+    INT_ILLEGAL = 0x01,
+    INT_KEYBOARD = 0x80,
+};
+
+/** push PSR and PC and continue at the vector, in supervisor mode at `priority` */
+void interrupt_enter(struct lc3_vm *vm, uint8_t vector, uint16_t priority)
+{
+    uint16_t psr = vm->psr | get_cond(vm);
+    if (vm->psr & PSR_USER)
+    {
+        vm->saved_usp = vm->reg[R_R6];
+        vm->reg[R_R6] = vm->saved_ssp;
+    }
+    vm->reg[R_R6] -= 2;
+    mem_write(vm, vm->reg[R_R6] + 1, psr);
+    mem_write(vm, vm->reg[R_R6], vm->reg[R_PC]);
+    vm->psr = (uint16_t)(priority << 8);
+    vm->reg[R_PC] = mem_read(vm, IVT_BASE + vector);
+}
+
+void exec_rti(struct lc3_vm *vm)
+{
+    uint16_t sp = vm->reg[R_R6];
+    vm->reg[R_PC] = mem_read(vm, sp);
+    uint16_t psr = mem_read(vm, sp + 1);
+    vm->reg[R_R6] = sp + 2;
+    vm->psr = psr & (PSR_USER | PSR_PRIORITY);
+    set_cond(vm, psr & 7);
+    if (psr & PSR_USER)
+    {
+        vm->saved_ssp = vm->reg[R_R6];
+        vm->reg[R_R6] = vm->saved_usp;
+    }
+}
+
+/** the guest is dead, PC stays on the instruction */
+void fault(struct lc3_vm *vm, int code)
+{
+    output_flush(vm); /* keep what the guest printed before it crashed */
+    vm->reg[R_PC] -= 1;
+    trace_dump(vm); /* and how it got there */
+    vm->fault.code = code;
+    vm->fault.pc = vm->reg[R_PC];
+    vm->fault.instr = vm->memory[vm->reg[R_PC]];
+    vm->fault.psr = vm->psr | get_cond(vm);
+    memcpy(vm->fault.reg, vm->reg, sizeof(vm->fault.reg));
+    vm->stop = LC3_FAULT;
+    vm->running = 0;
+}
+
+/**
+ * OP_RES and OP_RTI, returns 0 if the guest faulted
+ */
+int exec_bad(struct lc3_vm *vm)
+{
+    uint16_t instr = vm->memory[(uint16_t)(vm->reg[R_PC] - 1)];
+    int rti = (instr >> 12) == OP_RTI;
+    if (!vm->config.interrupts)
+    {
+        fault(vm, LC3_FAULT_ILLEGAL_OPCODE);
+        return 0;
+    }
+    if (rti && !(vm->psr & PSR_USER))
+    {
+        exec_rti(vm);
+        return 1;
+    }
+    uint8_t vector = rti ? INT_PRIVILEGE : INT_ILLEGAL;
+    if (!vm->memory[IVT_BASE + vector])
+    {
+        fault(vm, rti ? LC3_FAULT_PRIVILEGE : LC3_FAULT_ILLEGAL_OPCODE);
+        return 0;
+    }
+    interrupt_enter(vm, vector, (vm->psr & PSR_PRIORITY) >> 8);
+    return 1;
+}
+
+/**
+ * Between two slices of lc3_run(): take the keyboard interrupt if it is due.
+ * Returns LC3_INPUT if the guest waits for it with config.input_nowait, else LC3_YIELD.
+ */
+int interrupt_poll(struct lc3_vm *vm)
+{
+    uint16_t kbsr = vm->memory[MR_KBSR];
+    if (!(kbsr & KBSR_IE) || (vm->psr & PSR_PRIORITY) >= (4 << 8))
+    {
+        return LC3_YIELD;
+    }
+    if (!(kbsr & KBSR_READY))
+    {
+        uint16_t c;
+        if (!input_guest_poll(vm, &c))
+        {
+            if (vm->memory[vm->reg[R_PC]] != 0x0FFF /* BRnzp #-1 */ || vm->replaying)
+            {
+                return LC3_YIELD;
+            }
+            if (vm->config.input_nowait)
+            {
+                return LC3_INPUT;
+            }
+            input_sleep(vm); /* nothing else will happen before the key */
+            if (!input_guest_poll(vm, &c))
+            {
+                return LC3_YIELD;
+            }
+        }
+        vm->memory[MR_KBSR] = KBSR_READY | KBSR_IE;
+        vm->memory[MR_KBDR] = c;
+    }
+    interrupt_enter(vm, INT_KEYBOARD, 4);
+    return LC3_YIELD;
+}
+#pragma endregion
+
+#pragma region Traps
+/**
+ * Trap handlers, by vector. TRAP sets R7 and calls the handler of its vector, which returns non-zero to halt the guest.
+ * The defaults are the six traps of the LC-3 and, with config.host_calls, the host calls: routines LC-3 libraries
+ * spend thousands of instructions on, as one instruction each. Embedders add their own with lc3_set_trap().
+ * A vector without a handler goes through the guest's trap vector table at x0000 with config.interrupts,
+ * like on the real machine, and is a fault otherwise.
+ */
+int trap_getc(struct lc3_vm *vm, uint8_t vector, void *user)
+{
+    (void)vector, (void)user;
+    if (input_block(vm))
+    {
+        return 0;
+    }
+    /* read a single ASCII char */
+    vm->reg[R_R0] = input_guest_getc(vm);
+    update_flags(vm, R_R0);
+    return 0;
+}
+
+int trap_out(struct lc3_vm *vm, uint8_t vector, void *user)
+{
+    (void)vector, (void)user;
+    output_putc(vm, (char)vm->reg[R_R0]);
+    return 0;
+}
+
+int trap_puts(struct lc3_vm *vm, uint8_t vector, void *user)
+{
+    (void)vector, (void)user;
+    /* one char per word */
+    output_string(vm, vm->reg[R_R0], 0);
+    return 0;
+}
+
+int trap_in(struct lc3_vm *vm, uint8_t vector, void *user)
+{
+    (void)vector, (void)user;
+    if (input_block(vm))
+    {
+        return 0;
+    }
+    /* Prompt for input character */
+    output_write(vm, "Enter a character: ", 19);
+    char c = (char)input_guest_getc(vm);
+    output_putc(vm, c);
+    vm->reg[R_R0] = (uint16_t)c;
+    update_flags(vm, R_R0);
+    return 0;
+}
+
+int trap_putsp(struct lc3_vm *vm, uint8_t vector, void *user)
+{
+    (void)vector, (void)user;
+    /**
+     * one char per byte (two bytes per word)
+     * here we need to swap back to
+     * big endian format
+     */
+    output_string(vm, vm->reg[R_R0], 1);
+    return 0;
+}
+
+int trap_halt(struct lc3_vm *vm, uint8_t vector, void *user)
+{
+    (void)vector, (void)user;
+    output_write(vm, "HALT\n", 5);
+    return 1;
+}
+
+/* host calls: memory goes through mem_read() and mem_write(), so devices, watchpoints and translated code see every word */
+int trap_memcpy(struct lc3_vm *vm, uint8_t vector, void *user)
+{
+    (void)vector, (void)user;
+    uint16_t dst = vm->reg[R_R0], src = vm->reg[R_R1], n = vm->reg[R_R2];
+    if ((uint16_t)(dst - src) >= n)
+    {
+        for (uint16_t i = 0; i < n; ++i)
+        {
+            mem_write(vm, dst + i, mem_read(vm, src + i));
+        }
+    }
+    else
+    {
+        for (uint16_t i = n; i-- > 0;)
+        {
+            mem_write(vm, dst + i, mem_read(vm, src + i)); /* dst is inside the source, copy from the end */
+        }
+    }
+    return 0;
+}
+
+int trap_memset(struct lc3_vm *vm, uint8_t vector, void *user)
+{
+    (void)vector, (void)user;
+    for (uint16_t i = 0; i < vm->reg[R_R2]; ++i)
+    {
+        mem_write(vm, vm->reg[R_R0] + i, vm->reg[R_R1]);
+    }
+    return 0;
+}
+
+int trap_mul(struct lc3_vm *vm, uint8_t vector, void *user)
+{
+    (void)vector, (void)user;
+    vm->reg[R_R0] = (uint16_t)((uint32_t)vm->reg[R_R0] * vm->reg[R_R1]);
+    update_flags(vm, R_R0);
+    return 0;
+}
+
+int trap_div(struct lc3_vm *vm, uint8_t vector, void *user)
+{
+    (void)vector, (void)user;
+    int32_t a = (int16_t)vm->reg[R_R0], b = (int16_t)vm->reg[R_R1];
+    if (b == 0)
+    {
+        fault(vm, LC3_FAULT_DIVIDE_BY_ZERO); /* PC back on the trap */
+        return 0;
+    }
+    vm->reg[R_R0] = (uint16_t)(a / b); /* x8000 / -1 wraps to x8000 */
+    vm->reg[R_R1] = (uint16_t)(a % b);
+    update_flags(vm, R_R0);
+    return 0;
+}
+
+int trap_putd(struct lc3_vm *vm, uint8_t vector, void *user)
+{
+    (void)vector, (void)user;
+    char text[8];
+    int n = snprintf(text, sizeof(text), "%d", (int16_t)vm->reg[R_R0]);
+    output_write(vm, text, (size_t)n);
+    return 0;
+}
+
+/** the handler lc3_create() puts at `vector`, NULL if none */
+lc3_trap_fn trap_default(const struct lc3_vm *vm, uint8_t vector)
+{
+    static const lc3_trap_fn traps[] = {trap_getc, trap_out, trap_puts, trap_in, trap_putsp, trap_halt};
+    static const lc3_trap_fn host_calls[] = {trap_memcpy, trap_memset, trap_mul, trap_div, trap_putd};
+    if (vector >= TRAP_GETC && vector <= TRAP_HALT)
+    {
+        return traps[vector - TRAP_GETC];
+    }
+    if (vm->config.host_calls && vector >= TRAP_MEMCPY && vector <= TRAP_PUTD)
+    {
+        return host_calls[vector - TRAP_MEMCPY];
+    }
+    return NULL;
+}
+
+void exec_trap(struct lc3_vm *vm, uint16_t trapvect)
+{
+    get_cond(vm); /* traps are rare, keep R_COND exact for whoever looks at the VM while it is stopped */
+    const struct trap_handler *h = &vm->traps[trapvect];
+    if (h->fn)
+    {
+        vm->reg[R_R7] = vm->reg[R_PC];
+        if (h->fn(vm, (uint8_t)trapvect, h->user))
+        {
+            output_flush(vm);
+            vm->running = 0;
+        }
+        if (vm->stop != LC3_INPUT && vm->stop != LC3_FAULT)
+        {
+            metric_add(&vm->metrics->traps[trapvect], 1); /* it ran, it did not wait for a key or fault */
+        }
+    }
+    else if (vm->config.interrupts && vm->memory[trapvect])
+    {
+        metric_add(&vm->metrics->traps[trapvect], 1);
+        vm->reg[R_R7] = vm->reg[R_PC];
+        vm->reg[R_PC] = mem_read(vm, trapvect); /* the guest's own service routine */
+    }
+    else
+    {
+        fault(vm, LC3_FAULT_UNKNOWN_TRAP);
+    }
+}
+#pragma endregion
+
+#pragma region Profile
+/**
+ * Profiling (config.profile).
+ *
+ * The `_profiled` variants of the interpreter loops count every instruction by address, opcode and trap vector.
+ * The JIT engine cannot count translated code per instruction, so a profiled VM interprets with the threaded
+ * (or switch) loop instead. VMs without a profile run the plain loops, which contain no profiling code at all.
+ */
+struct lc3_profile
+{
+    uint64_t op[16];          /* by opcode, OP_* */
+    uint64_t trap[256];       /* by trap vector */
+    uint64_t pc[MEMORY_MAX];  /* by address */
+};
+
+const char *const op_names[16] = {"BR", "ADD", "LD", "ST", "JSR", "AND", "LDR", "STR",
+                                  "RTI", "NOT", "LDI", "STI", "JMP", "RES", "LEA", "TRAP"};
+
+const char *trap_name(int vect)
+{
+    static const char *const names[] = {"GETC", "OUT", "PUTS", "IN", "PUTSP", "HALT"};
+    static const char *const host_calls[] = {"MEMCPY", "MEMSET", "MUL", "DIV", "PUTD"};
+    return vect >= TRAP_GETC && vect <= TRAP_HALT     ? names[vect - TRAP_GETC]
+           : vect >= TRAP_MEMCPY && vect <= TRAP_PUTD ? host_calls[vect - TRAP_MEMCPY]
+                                                      : "-";
+}
+
+LC3_INLINE void profile_count(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    if (d->handler == H_DECODE || d->handler == H_BREAK)
+    {
+        return; /* counted once it is decoded, or once the instruction under the breakpoint runs */
+    }
+    struct lc3_profile *p = vm->profile;
+    uint16_t op = d->instr >> 12;
+    ++p->pc[(uint16_t)(vm->reg[R_PC] - 1)];
+    ++p->op[op];
+    if (op == OP_TRAP)
+    {
+        ++p->trap[d->instr & 0xFF];
+    }
+}
+
+/** instructions counted so far; unlike `retired` also up to date in the middle of lc3_run(), e.g. on SIGINT */
+uint64_t profile_total(const struct lc3_vm *vm)
+{
+    uint64_t total = 0;
+    for (int op = 0; op < 16; ++op)
+    {
+        total += vm->profile->op[op];
+    }
+    return total;
+}
+
+struct profile_spot
+{
+    uint16_t pc;
+    uint64_t count;
+};
+
+int profile_spot_compare(const void *a, const void *b)
+{
+    const struct profile_spot *x = a, *y = b;
+    if (x->count != y->count)
+    {
+        return x->count < y->count ? 1 : -1;
+    }
+    return x->pc - y->pc;
+}
+
+/**
+ * The executed addresses, most frequent first; NULL if out of memory
+ */
+struct profile_spot *profile_spots(const struct lc3_vm *vm, size_t *count)
+{
+    struct profile_spot *spots = malloc(MEMORY_MAX * sizeof(struct profile_spot));
+    *count = 0;
+    for (uint32_t pc = 0; spots && pc < MEMORY_MAX; ++pc)
+    {
+        if (vm->profile->pc[pc])
+        {
+            spots[(*count)++] = (struct profile_spot){.pc = (uint16_t)pc, .count = vm->profile->pc[pc]};
+        }
+    }
+    if (spots)
+    {
+        qsort(spots, *count, sizeof(struct profile_spot), profile_spot_compare);
+    }
+    return spots;
+}
+
+int lc3_write_profile(const struct lc3_vm *vm, FILE *file)
+{
+    if (!vm->profile)
+    {
+        return 0;
+    }
+    size_t count;
+    struct profile_spot *spots = profile_spots(vm, &count);
+    if (!spots)
+    {
+        return 0;
+    }
+
+    /* one record per line, tab separated: retired <n> / op <name> <n> / trap <vector> <name> <n> / pc <address> <n> */
+    fprintf(file, "retired\t%llu\n", (unsigned long long)profile_total(vm));
+    for (int op = 0; op < 16; ++op)
+    {
+        fprintf(file, "op\t%s\t%llu\n", op_names[op], (unsigned long long)vm->profile->op[op]);
+    }
+    for (int vect = 0; vect < 256; ++vect)
+    {
+        if (vm->profile->trap[vect])
+        {
+            fprintf(file, "trap\tx%02X\t%s\t%llu\n", vect, trap_name(vect), (unsigned long long)vm->profile->trap[vect]);
+        }
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        fprintf(file, "pc\tx%04X\t%llu\n", spots[i].pc, (unsigned long long)spots[i].count);
+    }
+    free(spots);
+    return !ferror(file);
+}
+
+void lc3_print_hot_spots(const struct lc3_vm *vm, FILE *file, int top)
+{
+    if (!vm->profile)
+    {
+        return;
+    }
+    size_t count;
+    struct profile_spot *spots = profile_spots(vm, &count);
+    if (!spots)
+    {
+        return;
+    }
+
+    uint64_t total = profile_total(vm);
+    fprintf(file, "%llu instructions, hot spots:\n", (unsigned long long)total);
+    for (size_t i = 0; i < count && i < (size_t)top; ++i)
+    {
+        /* the instruction at the address now, self-modifying code may have run others there */
+        fprintf(file, "  x%04X %6.2f%% %12llu  %s\n", spots[i].pc, 100.0 * spots[i].count / (double)total,
+                (unsigned long long)spots[i].count, op_names[vm->memory[spots[i].pc] >> 12]);
+    }
+    free(spots);
+}
+/**
+ * Superinstruction statistics, see fuse()
+ */
+int lc3_write_fusions(const struct lc3_vm *vm, FILE *file)
+{
+    static const char *const names[FUSED_COUNT] = {"AND+ADD", "ADD+BR", "LDR+ADD+STR", "NOT+ADD"};
+    for (int i = 0; i < FUSED_COUNT; ++i)
+    {
+        fprintf(file, "fused\t%s\t%u\t%llu\n", names[i], vm->fused_formed[i], (unsigned long long)vm->fused_runs[i]);
+    }
+    return !ferror(file);
+}
+
+/**
+ * Native subroutine statistics, see region Native routines
+ */
+int lc3_write_routines(const struct lc3_vm *vm, FILE *file)
+{
+    for (int i = 0; i < ROUTINE_COUNT; ++i)
+    {
+        fprintf(file, "routine\t%s\t%u\t%llu\n", native_routines[i].name, vm->routine_sites[i],
+                (unsigned long long)vm->routine_runs[i]);
+    }
+    return !ferror(file);
+}
+#pragma endregion
+
+#pragma region Trace
+/**
+ * Execution trace (config.trace_size).
+ *
+ * The `_traced` variants of the interpreter loops write one struct lc3_trace_record per instruction into a ring of
+ * `trace_size` records, aligned to cache lines so that no record straddles two of them. What an instruction accesses
+ * is worked out from its decoded entry before it runs, without touching devices; the new value of the register it
+ * writes is only known afterwards and is filled in when the next instruction is fetched, or when the trace is written.
+ * Like profiles, traces need the interpreter: a traced VM does not fuse and runs the threaded loop for LC3_ENGINE_JIT.
+ * VMs without a trace run the plain loops, which contain no tracing code at all.
+ */
+#define TRACE_ALIGN 64
+
+LC3_INLINE void trace_step(struct lc3_vm *vm, const struct decoded_instr *d)
+{
+    if (d->handler == H_DECODE || d->handler == H_BREAK)
+    {
+        return; /* recorded once it is decoded, or once the instruction under the breakpoint runs */
+    }
+    if (vm->profile)
+    {
+        profile_count(vm, d);
+    }
+
+    uint64_t n = vm->trace_count++;
+    uint32_t mask = vm->config.trace_size - 1;
+    struct lc3_trace_record *prev = &vm->trace[(n - 1) & mask];
+    prev->reg_value = vm->reg[prev->reg]; /* the previous instruction has run now; only used with LC3_TRACE_REG */
+
+    struct lc3_trace_record *r = &vm->trace[n & mask];
+    r->pc = vm->reg[R_PC] - 1;
+    r->instr = d->instr;
+    r->reg = d->r0;
+    r->flags = 0;
+    r->seq = (uint32_t)n;
+    switch (d->handler)
+    {
+    case H_ADD:
+    case H_ADDI:
+    case H_AND:
+    case H_ANDI:
+    case H_NOT:
+    case H_LEA:
+        r->flags = LC3_TRACE_REG;
+        break;
+    case H_LD:
+        r->flags = LC3_TRACE_REG | LC3_TRACE_LOAD;
+        r->addr = d->imm;
+        break;
+    case H_LDI:
+        /* the pointer as it is in memory, reading a device here would consume its data */
+        r->flags = LC3_TRACE_REG | LC3_TRACE_LOAD;
+        r->addr = vm->memory[d->imm];
+        break;
+    case H_LDR:
+        r->flags = LC3_TRACE_REG | LC3_TRACE_LOAD;
+        r->addr = vm->reg[d->r1] + d->imm;
+        break;
+    case H_ST:
+        r->flags = LC3_TRACE_STORE;
+        r->addr = d->imm;
+        r->value = vm->reg[d->r0];
+        break;
+    case H_STI:
+        r->flags = LC3_TRACE_STORE;
+        r->addr = vm->memory[d->imm];
+        r->value = vm->reg[d->r0];
+        break;
+    case H_STR:
+        r->flags = LC3_TRACE_STORE;
+        r->addr = vm->reg[d->r1] + d->imm;
+        r->value = vm->reg[d->r0];
+        break;
+    case H_JSR:
+    case H_JSRR:
+        r->flags = LC3_TRACE_REG;
+        r->reg = R_R7;
+        break;
+    case H_TRAP:
+        /* all traps write R7; the input traps also R0, the character read, and MUL and DIV the result.
+           R7 is always the address after the trap, so LC3_TRACE_LINK records it without a field of its own */
+        if (d->imm == TRAP_GETC || d->imm == TRAP_IN || d->imm == TRAP_MUL || d->imm == TRAP_DIV)
+        {
+            r->flags = LC3_TRACE_REG | LC3_TRACE_LINK;
+            r->reg = R_R0;
+        }
+        else
+        {
+            r->flags = LC3_TRACE_REG;
+            r->reg = R_R7;
+        }
+        break;
+    default: /* BR, JMP, bad opcodes */
+        break;
+    }
+}
+
+int lc3_write_trace(const struct lc3_vm *vm, FILE *file)
+{
+    if (!vm->trace)
+    {
+        return 0;
+    }
+    uint64_t n = vm->trace_count;
+    uint32_t size = vm->config.trace_size;
+    uint64_t count = n < size ? n : size;
+    struct lc3_trace_header header = {
+        .magic = LC3_TRACE_MAGIC, .version = LC3_TRACE_VERSION, .count = count, .first = n - count};
+    if (count > 0)
+    {
+        /* the last instruction has run, unless we are in the middle of it (a signal while it waits for input) */
+        struct lc3_trace_record *last = &vm->trace[(n - 1) & (size - 1)];
+        if (last->flags & LC3_TRACE_REG)
+        {
+            last->reg_value = vm->reg[last->reg];
+        }
+    }
+
+    uint32_t start = (uint32_t)((n - count) & (size - 1));
+    uint32_t tail = count < size - start ? (uint32_t)count : size - start; /* records up to the end of the ring */
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(vm->trace + start, sizeof(struct lc3_trace_record), tail, file);
+    fwrite(vm->trace, sizeof(struct lc3_trace_record), count - tail, file);
+    return !ferror(file);
+}
+
+/**
+ * Write the trace to config.trace_path, when the guest stops by itself
+ */
+void trace_dump(struct lc3_vm *vm)
+{
+    if (!vm->trace || !vm->config.trace_path)
+    {
+        return;
+    }
+    FILE *file = fopen(vm->config.trace_path, "wb");
+    if (file)
+    {
+        lc3_write_trace(vm, file);
+        fclose(file);
+    }
+}
+#pragma endregion
+
+#pragma region Debugger
+/**
+ * Breakpoints and watchpoints, see lc3_set_breakpoint().
+ *
+ * Nothing in the interpreter loops checks for them. A breakpoint turns the cache entry of its address into
+ * H_BREAK when fetch_decode() fills it (the rest of the entry stays the instruction), and H_BREAK asks
+ * debug_break() what to do. Watchpoints mark their pages PAGE_WATCH, which sends accesses there down the slow
+ * paths of mem_read() and mem_write(), like device pages: a hit turns the entry of the next instruction into
+ * H_BREAK until the engine fetches it and stops. Superinstructions would hide instruction boundaries and
+ * translated code has no entries, so while any point is set nothing is fused and the JIT engine interprets.
+ */
+
+/**
+ * Adding the first point drops all superinstructions in the cache
+ */
+void debug_points_add(struct lc3_vm *vm, int delta)
+{
+    if (vm->debug_points == 0 && delta > 0)
+    {
+        for (uint32_t addr = 0; addr < MEMORY_MAX; ++addr)
+        {
+            vm->decoded[addr].handler = H_DECODE;
+        }
+    }
+    vm->debug_points += delta;
+}
+
+void debug_watch_hit(struct lc3_vm *vm, uint16_t addr, unsigned kind)
+{
+    if (vm->watch_pending)
+    {
+        return; /* the first access of the instruction is reported */
+    }
+    /* the access happens while the instruction runs, PC already points at the next one */
+    vm->watch_pending = 1;
+    vm->watch_addr = addr;
+    vm->watch_kind = kind;
+    vm->watch_stop_pc = vm->reg[R_PC];
+    vm->decoded[vm->watch_stop_pc].handler = H_BREAK;
+}
+
+/**
+ * Stop for a watchpoint hit, PC is at the instruction after the one that hit it
+ */
+void debug_watch_stop(struct lc3_vm *vm)
+{
+    vm->watch_pending = 0;
+    vm->decoded[vm->watch_stop_pc].handler = H_DECODE; /* decoded again, with its own breakpoint if it has one */
+    vm->stop = LC3_WATCHPOINT;
+}
+
+/**
+ * H_BREAK was fetched: the entry to run instead, or NULL if the engine has to stop with PC at the instruction
+ */
+struct decoded_instr *debug_break(struct lc3_vm *vm)
+{
+    uint16_t pc = vm->reg[R_PC] - 1;
+    if (vm->watch_pending)
+    {
+        vm->reg[R_PC] = pc;
+        debug_watch_stop(vm);
+        return NULL;
+    }
+    if (vm->break_resume)
+    {
+        vm->break_resume = 0;
+        decode_instr(pc, vm->memory[pc], &vm->uncached);
+        return &vm->uncached;
+    }
+    vm->reg[R_PC] = pc;
+    vm->stop = LC3_BREAKPOINT;
+    return NULL;
+}
+
+int lc3_set_breakpoint(struct lc3_vm *vm, uint16_t addr, int on)
+{
+    if (vm->page_flags[addr >> PAGE_SHIFT] & PAGE_DEVICE)
+    {
+        return 0; /* instructions there are never cached */
+    }
+    int set = (vm->break_bits[addr >> 3] >> (addr & 7)) & 1;
+    if (set != !!on)
+    {
+        debug_points_add(vm, on ? 1 : -1);
+        vm->break_bits[addr >> 3] ^= (uint8_t)(1 << (addr & 7));
+        vm->decoded[addr].handler = H_DECODE;
+    }
+    return 1;
+}
+
+void lc3_set_watchpoint(struct lc3_vm *vm, uint16_t addr, unsigned kinds)
+{
+    kinds &= LC3_WATCH_READ | LC3_WATCH_WRITE;
+    int was = vm->watch_kinds[addr] != 0;
+    vm->watch_kinds[addr] = (uint8_t)kinds;
+    if (was == (kinds != 0))
+    {
+        return;
+    }
+    uint16_t page = addr >> PAGE_SHIFT;
+    debug_points_add(vm, kinds ? 1 : -1);
+    if (kinds && vm->page_watches[page]++ == 0)
+    {
+        vm->page_flags[page] |= PAGE_WATCH;
+    }
+    else if (!kinds && --vm->page_watches[page] == 0)
+    {
+        vm->page_flags[page] &= ~PAGE_WATCH;
+    }
+}
+
+unsigned lc3_watch_hit(const struct lc3_vm *vm, uint16_t *addr)
+{
+    *addr = vm->watch_addr;
+    return vm->watch_kind;
+}
+
+uint16_t lc3_get_reg(struct lc3_vm *vm, int reg)
+{
+    if (reg == R_COND)
+    {
+        return get_cond(vm);
+    }
+    if (reg == LC3_REG_PSR)
+    {
+        return vm->psr | get_cond(vm);
+    }
+    return reg >= 0 && reg < R_COUNT ? vm->reg[reg] : 0;
+}
+
+void lc3_set_reg(struct lc3_vm *vm, int reg, uint16_t value)
+{
+    if (reg == R_COND)
+    {
+        set_cond(vm, value);
+    }
+    else if (reg == LC3_REG_PSR)
+    {
+        vm->psr = value & (PSR_USER | PSR_PRIORITY); /* R6 stays, it is the stack of whatever mode this is */
+        set_cond(vm, value & 7);
+    }
+    else if (reg >= 0 && reg < R_COUNT)
+    {
+        vm->reg[reg] = value;
+    }
+}
+
+uint16_t lc3_peek(const struct lc3_vm *vm, uint16_t addr)
+{
+    return vm->memory[addr];
+}
+
+void lc3_poke(struct lc3_vm *vm, uint16_t addr, uint16_t value)
+{
+    uint8_t kinds = vm->watch_kinds[addr]; /* the debugger's own stores are not hits */
+    vm->watch_kinds[addr] = 0;
+    mem_write(vm, addr, value);
+    vm->watch_kinds[addr] = kinds;
+}
+
+void lc3_disassemble(uint16_t addr, uint16_t instr, char *buf, size_t size)
+{
+    static const char *const names[] = {"ADD", "AND"};
+    unsigned r0 = (instr >> 9) & 0x7, r1 = (instr >> 6) & 0x7, r2 = instr & 0x7;
+    uint16_t pc9 = addr + 1 + sign_extend(instr & 0x1FF, 9);
+
+    switch (instr >> 12)
+    {
+    case OP_BR:
+        if (r0 == 0)
+        {
+            snprintf(buf, size, "NOP");
+        }
+        else
+        {
+            snprintf(buf, size, "BR%s%s%s x%04X", r0 & 4 ? "n" : "", r0 & 2 ? "z" : "", r0 & 1 ? "p" : "", pc9);
+        }
+        break;
+    case OP_ADD:
+    case OP_AND:
+    {
+        const char *name = names[(instr >> 12) == OP_AND];
+        if (instr & 0x20)
+        {
+            snprintf(buf, size, "%s R%u, R%u, #%d", name, r0, r1, (int16_t)sign_extend(instr & 0x1F, 5));
+        }
+        else
+        {
+            snprintf(buf, size, "%s R%u, R%u, R%u", name, r0, r1, r2);
+        }
+        break;
+    }
+    case OP_LD:
+        snprintf(buf, size, "LD R%u, x%04X", r0, pc9);
+        break;
+    case OP_ST:
+        snprintf(buf, size, "ST R%u, x%04X", r0, pc9);
+        break;
+    case OP_JSR:
+        if (instr & 0x800)
+        {
+            snprintf(buf, size, "JSR x%04X", (uint16_t)(addr + 1 + sign_extend(instr & 0x7FF, 11)));
+        }
+        else
+        {
+            snprintf(buf, size, "JSRR R%u", r1);
+        }
+        break;
+    case OP_LDR:
+        snprintf(buf, size, "LDR R%u, R%u, #%d", r0, r1, (int16_t)sign_extend(instr & 0x3F, 6));
+        break;
+    case OP_STR:
+        snprintf(buf, size, "STR R%u, R%u, #%d", r0, r1, (int16_t)sign_extend(instr & 0x3F, 6));
+        break;
+    case OP_RTI:
+        snprintf(buf, size, "RTI");
+        break;
+    case OP_NOT:
+        snprintf(buf, size, "NOT R%u, R%u", r0, r1);
+        break;
+    case OP_LDI:
+        snprintf(buf, size, "LDI R%u, x%04X", r0, pc9);
+        break;
+    case OP_STI:
+        snprintf(buf, size, "STI R%u, x%04X", r0, pc9);
+        break;
+    case OP_JMP:
+        if (r1 == R_R7)
+        {
+            snprintf(buf, size, "RET");
+        }
+        else
+        {
+            snprintf(buf, size, "JMP R%u", r1);
+        }
+        break;
+    case OP_RES:
+        snprintf(buf, size, ".FILL x%04X ; reserved opcode", instr);
+        break;
+    case OP_LEA:
+        snprintf(buf, size, "LEA R%u, x%04X", r0, pc9);
+        break;
+    case OP_TRAP:
+        if (strcmp(trap_name(instr & 0xFF), "-") != 0)
+        {
+            snprintf(buf, size, "%s", trap_name(instr & 0xFF));
+        }
+        else
+        {
+            snprintf(buf, size, "TRAP x%02X", instr & 0xFF);
+        }
+        break;
+    }
+}
+#pragma endregion
+
+#pragma region Execution engines
+/**
+ * Execution engines (lc3_engine), all of them run until TRAP_HALT or until `steps_left` reaches 0.
+ */
+
+#define ENGINE(name) name
+#define ENGINE_HOOK(vm, d)
+#define ENGINE_MEMORY MEM_PAGED
+#include "lc3_engines.inc"
+#undef ENGINE
+#undef ENGINE_HOOK
+#undef ENGINE_MEMORY
+
+/* the same loops without page checks on loads and stores, while memory_flat() */
+#define ENGINE(name) name##_flat
+#define ENGINE_HOOK(vm, d)
+#define ENGINE_MEMORY MEM_FLAT
+#include "lc3_engines.inc"
+#undef ENGINE
+#undef ENGINE_HOOK
+#undef ENGINE_MEMORY
+
+/* counting every instruction, see region Profile */
+#define ENGINE(name) name##_profiled
+#define ENGINE_HOOK(vm, d) profile_count(vm, d)
+#define ENGINE_MEMORY MEM_PAGED
+#include "lc3_engines.inc"
+#undef ENGINE
+#undef ENGINE_HOOK
+#undef ENGINE_MEMORY
+
+/* and recording every instruction, see region Trace */
+#define ENGINE(name) name##_traced
+#define ENGINE_HOOK(vm, d) trace_step(vm, d)
+#define ENGINE_MEMORY MEM_PAGED
+#include "lc3_engines.inc"
+#undef ENGINE
+#undef ENGINE_HOOK
+#undef ENGINE_MEMORY
+
+void run_traced(struct lc3_vm *vm)
+{
+#ifdef LC3_HAVE_THREADED
+    if (vm->config.engine != LC3_ENGINE_SWITCH)
+    {
+        run_threaded_traced(vm); /* also for LC3_ENGINE_JIT */
+        return;
+    }
+#endif
+    run_switch_traced(vm);
+}
+
+void run_profiled(struct lc3_vm *vm)
+{
+#ifdef LC3_HAVE_THREADED
+    if (vm->config.engine != LC3_ENGINE_SWITCH)
+    {
+        run_threaded_profiled(vm); /* also for LC3_ENGINE_JIT */
+        return;
+    }
+#endif
+    run_switch_profiled(vm);
+}
+
+/**
+ * Interpret one basic block: run instructions up to and including the next BR, JMP, JSR, JSRR or TRAP,
+ * or until `steps_left` runs out. Used by engines that need to look at every block entry.
+ */
+void run_block(struct lc3_vm *vm)
+{
+    while (vm->steps_left > 0)
+    {
+        --vm->steps_left;
+
+        /* FETCH */
+        struct decoded_instr *d = &vm->decoded[vm->reg[R_PC]++];
+
+    dispatch:
+        switch (d->handler)
+        {
+        case H_DECODE:
+            d = fetch_decode(vm, vm->reg[R_PC] - 1);
+            goto dispatch;
+        case H_ADD:
+            exec_add(vm, d);
+            break;
+        case H_ADDI:
+            exec_addi(vm, d);
+            break;
+        case H_AND:
+            exec_and(vm, d);
+            break;
+        case H_ANDI:
+            exec_andi(vm, d);
+            break;
+        case H_NOT:
+            exec_not(vm, d);
+            break;
+        case H_LD:
+            exec_ld(vm, d, MEM_PAGED);
+            break;
+        case H_LDI:
+            exec_ldi(vm, d, MEM_PAGED);
+            break;
+        case H_LDR:
+            exec_ldr(vm, d, MEM_PAGED);
+            break;
+        case H_LEA:
+            exec_lea(vm, d);
+            break;
+        case H_ST:
+            exec_st(vm, d, MEM_PAGED);
+            break;
+        case H_STI:
+            exec_sti(vm, d, MEM_PAGED);
+            break;
+        case H_STR:
+            exec_str(vm, d, MEM_PAGED);
+            break;
+        case H_BR:
+            exec_br(vm, d);
+            return;
+        case H_JMP:
+            exec_jmp(vm, d);
+            return;
+        case H_JSR:
+            exec_jsr(vm, d);
+            return;
+        case H_JSRR:
+            exec_jsrr(vm, d);
+            return;
+        case H_JSR_NATIVE:
+            vm->steps_left -= exec_jsr_native(vm, d, vm->steps_left);
+            return;
+        case H_TRAP:
+            exec_trap(vm, d->imm /* trapvect8 */);
+            return;
+        /* superinstructions run one instruction after the other here, their followers have valid entries */
+        case H_LOAD_CONST:
+            exec_andi(vm, d);
+            break;
+        case H_ADDI_BR:
+            exec_addi(vm, d);
+            break;
+        case H_LDR_ADDI_STR:
+            exec_ldr(vm, d, MEM_PAGED);
+            break;
+        case H_NEG:
+            exec_not(vm, d);
+            break;
+        case H_BAD: /* OP_RES, OP_RTI */
+        default:
+            exec_bad(vm);
+            return;
+        }
+    }
+}
+#pragma endregion
+
+#pragma region JIT
+#ifdef LC3_HAVE_JIT
+/**
+ * Basic-block JIT for x86-64.
+ *
+ * The JIT engine interprets until a block entry (a PC reached by a branch, jump, call or trap)
+ * has been seen JIT_THRESHOLD times, then translates the block starting there into native code.
+ * A block ends after the first BR, JMP, JSR or JSRR, and before TRAP or a bad opcode,
+ * which are always left to the interpreter.
+ *
+ * Inside a block the guest registers R0..R7 live in the host registers r8..r15,
+ * rbx points to `memory` and rbp to `reg`. They are only written back to `reg` on exit.
+ * Condition flags are not computed per instruction either: a BR derives N/Z/P from the register
+ * that the last flag-setting instruction wrote, and block exits leave that register in cond_value.
+ *
+ * Every VM translates into its own buffer, so the code can refer to the VM's tables by absolute address.
+ * A block takes its length from `steps_left` when it is entered and bails out to the interpreter
+ * before running an instruction lc3_run() did not allow.
+ */
+
+/**
+ * x86-64 register numbers
+ */
+enum
+{
+    X_RAX = 0,
+    X_RCX,
+    X_RDX,
+    X_RBX,
+    X_RSP,
+    X_RBP,
+    X_RSI,
+    X_RDI,
+    X_R8,
+};
+
+#define JIT_GUEST(r) (X_R8 + (r)) /* host register holding guest register r */
+
+/** steps_left relative to rbp */
+#define JIT_STEPS_DISP ((int32_t)(offsetof(struct lc3_vm, steps_left) - offsetof(struct lc3_vm, reg)))
+
+/**
+ * Code emitter
+ */
+struct jit_asm
+{
+    uint8_t *p;
+    uint8_t *exits[JIT_MAX_BLOCK_LEN * 4]; /* rel32 fields jumping to the epilogue */
+    int exit_count;
+    struct lc3_vm *vm;
+    struct jit_block *block; /* block being translated */
+    int len;                 /* instructions in the block */
+    uint8_t written;         /* guest registers written by the block */
+};
+
+void jit_emit8(struct jit_asm *a, uint8_t b)
+{
+    *a->p++ = b;
+}
+
+void jit_emit32(struct jit_asm *a, uint32_t v)
+{
+    memcpy(a->p, &v, 4);
+    a->p += 4;
+}
+
+void jit_emit64(struct jit_asm *a, uint64_t v)
+{
+    memcpy(a->p, &v, 8);
+    a->p += 8;
+}
+
+/** REX prefix, only emitted when one of its bits is needed */
+void jit_rex(struct jit_asm *a, int w, int reg, int index, int base)
+{
+    uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) | ((index >> 3) << 1) | (base >> 3);
+    if (rex != 0x40)
+    {
+        jit_emit8(a, rex);
+    }
+}
+
+/** ModRM of a register-register operation */
+void jit_modrm_rr(struct jit_asm *a, int reg, int rm)
+{
+    jit_emit8(a, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/**
+ * ModRM (+ SIB + displacement) of a memory operand [base + index * scale + disp].
+ * `index` < 0 means no index, `scale` is 1, 2, 4 or 8.
+ */
+void jit_modrm_mem(struct jit_asm *a, int reg, int base, int index, int scale, int32_t disp)
+{
+    int mod = disp == 0 && (base & 7) != X_RBP ? 0 : (disp >= -128 && disp <= 127 ? 1 : 2);
+
+    if (index < 0 && (base & 7) != X_RSP)
+    {
+        jit_emit8(a, (mod << 6) | ((reg & 7) << 3) | (base & 7));
+    }
+    else
+    {
+        int ss = scale == 8 ? 3 : scale == 4 ? 2 : scale == 2 ? 1 : 0;
+        jit_emit8(a, (mod << 6) | ((reg & 7) << 3) | X_RSP /* SIB follows */);
+        jit_emit8(a, (ss << 6) | (((index < 0 ? X_RSP : index) & 7) << 3) | (base & 7));
+    }
+
+    if (mod == 1)
+    {
+        jit_emit8(a, (uint8_t)disp);
+    }
+    else if (mod == 2)
+    {
+        jit_emit32(a, (uint32_t)disp);
+    }
+}
+
+/** op r/m32, r32 (mov 0x89, add 0x01, and 0x21, test 0x85) */
+void jit_alu_rr(struct jit_asm *a, uint8_t op, int dst, int src)
+{
+    jit_rex(a, 0, src, 0, dst);
+    jit_emit8(a, op);
+    jit_modrm_rr(a, src, dst);
+}
+
+/** op r/m32, imm32 with /ext (add 0, and 4, cmp 7) */
+void jit_alu_ri(struct jit_asm *a, int ext, int dst, uint32_t imm)
+{
+    jit_rex(a, 0, 0, 0, dst);
+    jit_emit8(a, 0x81);
+    jit_modrm_rr(a, ext, dst);
+    jit_emit32(a, imm);
+}
+
+/** mov r32, imm32 */
+void jit_mov_ri(struct jit_asm *a, int dst, uint32_t imm)
+{
+    jit_rex(a, 0, 0, 0, dst);
+    jit_emit8(a, 0xB8 + (dst & 7));
+    jit_emit32(a, imm);
+}
+
+/** mov r64, imm64 */
+void jit_mov_ri64(struct jit_asm *a, int dst, const void *imm)
+{
+    jit_rex(a, 1, 0, 0, dst);
+    jit_emit8(a, 0xB8 + (dst & 7));
+    jit_emit64(a, (uint64_t)(uintptr_t)imm);
+}
+
+/** movzx r32, r16 */
+void jit_movzx_rr(struct jit_asm *a, int dst, int src)
+{
+    jit_rex(a, 0, dst, 0, src);
+    jit_emit8(a, 0x0F);
+    jit_emit8(a, 0xB7);
+    jit_modrm_rr(a, dst, src);
+}
+
+/** movzx r32, word [base + index * scale + disp] */
+void jit_load16(struct jit_asm *a, int dst, int base, int index, int scale, int32_t disp)
+{
+    jit_rex(a, 0, dst, index < 0 ? 0 : index, base);
+    jit_emit8(a, 0x0F);
+    jit_emit8(a, 0xB7);
+    jit_modrm_mem(a, dst, base, index, scale, disp);
+}
+
+/** mov word [base + index * scale + disp], r16 */
+void jit_store16(struct jit_asm *a, int src, int base, int index, int scale, int32_t disp)
+{
+    jit_emit8(a, 0x66);
+    jit_rex(a, 0, src, index < 0 ? 0 : index, base);
+    jit_emit8(a, 0x89);
+    jit_modrm_mem(a, src, base, index, scale, disp);
+}
+
+/** mov word [rbp + disp8], imm16 */
+void jit_store16_imm(struct jit_asm *a, int32_t disp, uint16_t imm)
+{
+    jit_emit8(a, 0x66);
+    jit_emit8(a, 0xC7);
+    jit_modrm_mem(a, 0, X_RBP, -1, 1, disp);
+    jit_emit8(a, imm & 0xFF);
+    jit_emit8(a, imm >> 8);
+}
+
+void jit_push(struct jit_asm *a, int r)
+{
+    jit_rex(a, 0, 0, 0, r);
+    jit_emit8(a, 0x50 + (r & 7));
+}
+
+void jit_pop(struct jit_asm *a, int r)
+{
+    jit_rex(a, 0, 0, 0, r);
+    jit_emit8(a, 0x58 + (r & 7));
+}
+
+/** jcc rel32 (cc 0x4 e/z, 0x5 ne/nz, 0x3 ae) to a label that is patched later, returns the rel32 field */
+uint8_t *jit_jcc(struct jit_asm *a, uint8_t cc)
+{
+    jit_emit8(a, 0x0F);
+    jit_emit8(a, 0x80 | cc);
+    uint8_t *rel = a->p;
+    jit_emit32(a, 0);
+    return rel;
+}
+
+/** jmp rel32 to a label that is patched later, returns the rel32 field */
+uint8_t *jit_jmp(struct jit_asm *a)
+{
+    jit_emit8(a, 0xE9);
+    uint8_t *rel = a->p;
+    jit_emit32(a, 0);
+    return rel;
+}
+
+/** point a rel32 field at the current position */
+void jit_patch(struct jit_asm *a, uint8_t *rel)
+{
+    uint32_t v = (uint32_t)(a->p - (rel + 4));
+    memcpy(rel, &v, 4);
+}
+
+/** op qword [rbp + disp], imm8 with /ext (add 0, sub 5) */
+void jit_alu64_mem_imm8(struct jit_asm *a, int ext, int32_t disp, int8_t imm)
+{
+    jit_rex(a, 1, 0, 0, X_RBP);
+    jit_emit8(a, 0x83);
+    jit_modrm_mem(a, ext, X_RBP, -1, 1, disp);
+    jit_emit8(a, (uint8_t)imm);
+}
+
+/**
+ * Call a C helper taking the VM and the arguments already in esi/edx.
+ * r8..r11 are caller-saved, so the guest registers living there are kept on the stack.
+ * Four pushes keep the stack 16-byte aligned.
+ */
+void jit_call(struct jit_asm *a, const void *fn)
+{
+    for (int r = X_R8; r <= X_R8 + 3; ++r)
+    {
+        jit_push(a, r);
+    }
+    jit_mov_ri64(a, X_RDI, a->vm);
+    jit_mov_ri64(a, X_RAX, fn);
+    jit_emit8(a, 0xFF); /* call rax */
+    jit_emit8(a, 0xD0);
+    for (int r = X_R8 + 3; r >= X_R8; --r)
+    {
+        jit_pop(a, r);
+    }
+}
+
+uint16_t jit_mem_read(struct lc3_vm *vm, uint16_t addr)
+{
+    return mem_read(vm, addr);
+}
+
+/** returns non-zero if the store invalidated translated code, possibly the running block */
+int jit_mem_write(struct lc3_vm *vm, uint16_t addr, uint16_t val)
+{
+    unsigned generation = vm->jit_generation;
+    mem_write(vm, addr, val);
+    return generation != vm->jit_generation;
+}
+
+/**
+ * Compute N/Z/P into ecx from guest register `last`,
+ * or from cond_value without a flag-setting instruction in the block (`last` < 0).
+ */
+void jit_flags(struct jit_asm *a, int last)
+{
+    if (last < 0)
+    {
+        jit_mov_ri64(a, X_RSI, &a->vm->cond_value);
+        jit_load16(a, X_RAX, X_RSI, -1, 1, 0);
+    }
+    else
+    {
+        jit_alu_rr(a, 0x89, X_RAX, JIT_GUEST(last)); /* mov eax, guest */
+    }
+    jit_mov_ri(a, X_RCX, FL_ZRO);
+    jit_emit8(a, 0x66); /* test ax, ax */
+    jit_emit8(a, 0x85);
+    jit_emit8(a, 0xC0);
+    jit_emit8(a, 0x74); /* je +12 */
+    jit_emit8(a, 12);
+    jit_mov_ri(a, X_RCX, FL_POS);
+    jit_emit8(a, 0x79); /* jns +5 */
+    jit_emit8(a, 5);
+    jit_mov_ri(a, X_RCX, FL_NEG);
+}
+
+/**
+ * cond_value = guest register `last`, the lazy flags of the interpreter.
+ * Has to come before anything else writes `last`: the JSR/JSRR linkage writes R7 without setting the flags.
+ */
+void jit_store_cond(struct jit_asm *a, int last)
+{
+    if (last >= 0)
+    {
+        jit_mov_ri64(a, X_RSI, &a->vm->cond_value);
+        jit_store16(a, JIT_GUEST(last), X_RSI, -1, 1, 0);
+    }
+}
+
+/** store the guest registers written by the block back to `reg` */
+void jit_write_back(struct jit_asm *a)
+{
+    for (int r = 0; r < 8; ++r)
+    {
+        if (a->written & (1 << r))
+        {
+            jit_store16(a, JIT_GUEST(r), X_RBP, -1, 1, r * 2);
+        }
+    }
+}
+
+/**
+ * Leave the block, continuing at `pc`.
+ * If `pc` is already translated (or is this very block), jump straight into it instead of
+ * returning to run_jit(). The stack frame is shared, so the target's epilogue returns for both.
+ */
+void jit_exit(struct jit_asm *a, uint16_t pc, int last, int chain)
+{
+    jit_store_cond(a, last);
+
+    struct jit_block *b = a->block;
+    uint8_t *target = NULL;
+    if (chain && pc == b->start)
+    {
+        target = b->body;
+    }
+    else if (chain && a->vm->jit_entry[pc])
+    {
+        for (int i = 0; i < a->vm->jit_block_count; ++i)
+        {
+            if (a->vm->jit_blocks[i].code == a->vm->jit_entry[pc])
+            {
+                target = a->vm->jit_blocks[i].body;
+                break;
+            }
+        }
+    }
+
+    if (target && b->chain_count < 2)
+    {
+        b->chain[b->chain_count++] = pc;
+        jit_write_back(a);
+        jit_emit8(a, 0xE9); /* jmp target */
+        jit_emit32(a, (uint32_t)(target - (a->p + 4)));
+        return;
+    }
+
+    jit_store16_imm(a, R_PC * 2, pc);
+    a->exits[a->exit_count++] = jit_jmp(a);
+}
+
+/** ZF = page of eax has none of `flags` (clobbers edx, rsi) */
+void jit_test_page(struct jit_asm *a, uint8_t flags)
+{
+    jit_alu_rr(a, 0x89, X_RDX, X_RAX); /* mov edx, eax */
+    jit_emit8(a, 0xC1);                /* shr edx, PAGE_SHIFT */
+    jit_emit8(a, 0xEA);
+    jit_emit8(a, PAGE_SHIFT);
+    jit_mov_ri64(a, X_RSI, a->vm->page_flags);
+    jit_emit8(a, 0xF6); /* test byte [rsi + rdx], flags */
+    jit_modrm_mem(a, 0, X_RSI, X_RDX, 1, 0);
+    jit_emit8(a, flags);
+}
+
+/**
+ * guest register `dst` (or eax with dst < 0) = memory[eax], through mem_read() for device pages.
+ * The lazy flags of `last` are stored first on that path, the PSR register reads them.
+ */
+void jit_load_dynamic(struct jit_asm *a, int dst, int last)
+{
+    int host = dst < 0 ? X_RAX : JIT_GUEST(dst);
+
+    jit_test_page(a, PAGE_DEVICE);
+    uint8_t *slow = jit_jcc(a, 0x5 /* ne */);
+    jit_load16(a, host, X_RBX, X_RAX, 2, 0);
+    uint8_t *done = jit_jmp(a);
+
+    jit_patch(a, slow);
+    jit_store_cond(a, last);
+    jit_alu_rr(a, 0x89, X_RSI, X_RAX);
+    jit_call(a, (const void *)jit_mem_read);
+    jit_movzx_rr(a, host, X_RAX);
+    jit_patch(a, done);
+}
+
+/** host register = memory[addr] with a constant address, like jit_load_dynamic() */
+void jit_load_const(struct jit_asm *a, int host, uint16_t addr, int last)
+{
+    if (a->vm->page_flags[addr >> PAGE_SHIFT] & PAGE_DEVICE)
+    {
+        jit_store_cond(a, last);
+        jit_mov_ri(a, X_RSI, addr);
+        jit_call(a, (const void *)jit_mem_read);
+        jit_movzx_rr(a, host, X_RAX);
+    }
+    else
+    {
+        jit_load16(a, host, X_RBX, -1, 1, addr * 2);
+    }
+}
+
+/**
+ * memory[eax] = ecx with the semantics of mem_write().
+ * Stores to already written RAM pages without translated code are done inline, everything else goes through mem_write()
+ * and leaves the block at `next_pc` if translated code was invalidated,
+ * giving the instructions it skips back to `steps_left`.
+ */
+void jit_store_dynamic(struct jit_asm *a, uint16_t next_pc, int last)
+{
+    jit_test_page(a, PAGE_DEVICE | PAGE_JIT | PAGE_CLEAN);
+    uint8_t *slow = jit_jcc(a, 0x5 /* ne */);
+
+    jit_store16(a, X_RCX, X_RBX, X_RAX, 2, 0);
+    jit_mov_ri64(a, X_RSI, a->vm->decoded);
+    _Static_assert(sizeof(struct decoded_instr) == 8, "decoded entries are indexed with scale 8");
+    for (int back = 0; back <= 2; ++back)
+    {
+        /* mov byte [rsi + rax * 8 - back * 8], H_DECODE: like mem_write(), decoded_guard catches addresses below 0 */
+        jit_emit8(a, 0xC6);
+        jit_modrm_mem(a, 0, X_RSI, X_RAX, 8, -back * (int32_t)sizeof(struct decoded_instr));
+        jit_emit8(a, H_DECODE);
+    }
+    uint8_t *done = jit_jmp(a);
+
+    jit_patch(a, slow);
+    jit_alu_rr(a, 0x89, X_RSI, X_RAX);
+    jit_alu_rr(a, 0x89, X_RDX, X_RCX);
+    jit_call(a, (const void *)jit_mem_write);
+    jit_alu_rr(a, 0x85, X_RAX, X_RAX); /* test eax, eax */
+    uint8_t *valid = jit_jcc(a, 0x4 /* e */);
+    int skipped = (uint16_t)(a->block->start + a->len - next_pc);
+    if (skipped > 0)
+    {
+        jit_alu64_mem_imm8(a, 0, JIT_STEPS_DISP, (int8_t)skipped);
+    }
+    jit_exit(a, next_pc, last, 0 /* the target may just have been invalidated */);
+    jit_patch(a, valid);
+    jit_patch(a, done);
+}
+
+/** guest registers read or written by an instruction */
+uint8_t jit_regs_used(const struct decoded_instr *d)
+{
+    switch (d->handler)
+    {
+    case H_ADD:
+    case H_AND:
+        return (1 << d->r0) | (1 << d->r1) | (1 << d->r2);
+    case H_ADDI:
+    case H_ANDI:
+    case H_NOT:
+    case H_LDR:
+    case H_STR:
+        return (1 << d->r0) | (1 << d->r1);
+    case H_LD:
+    case H_LDI:
+    case H_LEA:
+    case H_ST:
+    case H_STI:
+        return 1 << d->r0;
+    case H_JMP:
+        return 1 << d->r1;
+    case H_JSR:
+        return 1 << R_R7;
+    case H_JSRR:
+        return (1 << R_R7) | (1 << d->r1);
+    default:
+        return 0;
+    }
+}
+
+/** guest registers written by an instruction */
+uint8_t jit_regs_written(const struct decoded_instr *d)
+{
+    switch (d->handler)
+    {
+    case H_ADD:
+    case H_AND:
+    case H_ADDI:
+    case H_ANDI:
+    case H_NOT:
+    case H_LDR:
+    case H_LD:
+    case H_LDI:
+    case H_LEA:
+        return 1 << d->r0;
+    case H_JSR:
+    case H_JSRR:
+        return 1 << R_R7;
+    default:
+        return 0;
+    }
+}
+
+void jit_clear_pages(struct lc3_vm *vm)
+{
+    for (int page = 0; page < PAGE_COUNT; ++page)
+    {
+        vm->page_flags[page] &= ~PAGE_JIT;
+    }
+}
+
+/** drop every translated block, e.g. when the code buffer is full */
+void jit_flush(struct lc3_vm *vm)
+{
+    memset(vm->jit_entry, 0, sizeof(vm->jit_entry));
+    jit_clear_pages(vm);
+    memset(vm->jit_code_bits, 0, sizeof(vm->jit_code_bits));
+    vm->jit_block_count = 0;
+    vm->jit_code_used = 0;
+    ++vm->jit_generation;
+    metric_add(&vm->metrics->jit_flushes, 1);
+}
+
+/** mark the addresses of a live block in the page and bit maps */
+void jit_mark(struct lc3_vm *vm, const struct jit_block *b)
+{
+    for (uint32_t addr = b->start; addr <= b->end; ++addr)
+    {
+        vm->jit_code_bits[addr >> 3] |= 1 << (addr & 7);
+        vm->page_flags[addr >> PAGE_SHIFT] |= PAGE_JIT;
+    }
+}
+
+/**
+ * Drop every block containing `addr`.
+ * Blocks may overlap, so the maps are rebuilt from the blocks that survive.
+ * The native code itself stays in the buffer until the next flush,
+ * which makes it safe to return through a block that has just invalidated itself.
+ */
+void jit_invalidate(struct lc3_vm *vm, uint16_t addr)
+{
+    metric_add(&vm->metrics->jit_invalidations, 1);
+    for (int i = 0; i < vm->jit_block_count; ++i)
+    {
+        struct jit_block *b = &vm->jit_blocks[i];
+        if (b->code && b->start <= addr && addr <= b->end)
+        {
+            vm->jit_entry[b->start] = NULL;
+            vm->jit_counter[b->start] = 0;
+            b->code = NULL;
+        }
+    }
+
+    /* blocks chained to a dropped block would jump into stale code */
+    int dropped;
+    do
+    {
+        dropped = 0;
+        for (int i = 0; i < vm->jit_block_count; ++i)
+        {
+            struct jit_block *b = &vm->jit_blocks[i];
+            for (int c = 0; b->code && c < b->chain_count; ++c)
+            {
+                if (!vm->jit_entry[b->chain[c]])
+                {
+                    vm->jit_entry[b->start] = NULL;
+                    vm->jit_counter[b->start] = 0;
+                    b->code = NULL;
+                    dropped = 1;
+                }
+            }
+        }
+    } while (dropped);
+
+    jit_clear_pages(vm);
+    memset(vm->jit_code_bits, 0, sizeof(vm->jit_code_bits));
+    for (int i = 0; i < vm->jit_block_count; ++i)
+    {
+        if (vm->jit_blocks[i].code)
+        {
+            jit_mark(vm, &vm->jit_blocks[i]);
+        }
+    }
+    ++vm->jit_generation;
+}
+
+/**
+ * Translate the block starting at `start`.
+ * Returns 0 if there is nothing to translate (the block starts with a TRAP, a bad opcode or a device register),
+ * the interpreter runs those.
+ */
+int jit_compile(struct lc3_vm *vm, uint16_t start)
+{
+    struct decoded_instr block[JIT_MAX_BLOCK_LEN];
+    int len = 0;
+    uint8_t used = 0;
+    uint8_t written = 0;
+
+    /* collect the block */
+    for (uint16_t pc = start; len < JIT_MAX_BLOCK_LEN && !(vm->page_flags[pc >> PAGE_SHIFT] & PAGE_DEVICE); ++pc)
+    {
+        struct decoded_instr *d = &block[len];
+        decode_instr(pc, vm->memory[pc], d);
+        if (d->handler == H_TRAP || d->handler == H_BAD ||
+            (d->handler == H_JSR && vm->config.native_routines && routine_find(vm, d->imm) >= 0))
+        {
+            break; /* the interpreter runs these, calls of native routines from their H_JSR_NATIVE entries */
+        }
+
+        used |= jit_regs_used(d);
+        written |= jit_regs_written(d);
+        ++len;
+        if (d->handler == H_BR || d->handler == H_JMP || d->handler == H_JSR || d->handler == H_JSRR)
+        {
+            break;
+        }
+    }
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    if (!vm->jit_code)
+    {
+        vm->jit_code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if (vm->jit_code == MAP_FAILED)
+    {
+        return 0; /* no executable memory, keep interpreting */
+    }
+    if (vm->jit_block_count == JIT_MAX_BLOCKS || JIT_CODE_SIZE - vm->jit_code_used < (size_t)(len + 3) * JIT_MAX_CODE_PER_INSTR)
+    {
+        jit_flush(vm);
+    }
+
+    struct jit_block *b = &vm->jit_blocks[vm->jit_block_count];
+    struct jit_asm a = {.p = vm->jit_code + vm->jit_code_used, .exit_count = 0, .vm = vm, .block = b, .len = len, .written = written};
+    uint8_t *entry = a.p;
+    b->start = start;
+    b->end = start + len - 1;
+    b->chain_count = 0;
+
+    /* prologue: save callee-saved registers and load the guest registers used by the block */
+    jit_push(&a, X_RBX);
+    jit_push(&a, X_RBP);
+    for (int r = X_R8 + 4; r <= X_R8 + 7; ++r)
+    {
+        jit_push(&a, r);
+    }
+    jit_emit8(&a, 0x48); /* sub rsp, 8 (keeps calls 16-byte aligned) */
+    jit_emit8(&a, 0x83);
+    jit_emit8(&a, 0xEC);
+    jit_emit8(&a, 8);
+    jit_rex(&a, 1, X_RDI, 0, X_RBP); /* mov rbp, rdi (reg) */
+    jit_emit8(&a, 0x89);
+    jit_modrm_rr(&a, X_RDI, X_RBP);
+    jit_rex(&a, 1, X_RSI, 0, X_RBX); /* mov rbx, rsi (memory) */
+    jit_emit8(&a, 0x89);
+    jit_modrm_rr(&a, X_RSI, X_RBX);
+    b->body = a.p;
+    jit_alu64_mem_imm8(&a, 5, JIT_STEPS_DISP, (int8_t)len); /* sub steps_left, len */
+    uint8_t *bail = jit_jcc(&a, 0x2 /* b, steps_left was smaller than len */);
+    for (int r = 0; r < 8; ++r)
+    {
+        if (used & (1 << r))
+        {
+            jit_load16(&a, JIT_GUEST(r), X_RBP, -1, 1, r * 2);
+        }
+    }
+
+    /* body */
+    int last = -1; /* guest register written by the last flag-setting instruction */
+    int terminated = 0;
+    for (int i = 0; i < len; ++i)
+    {
+        const struct decoded_instr *d = &block[i];
+        uint16_t next_pc = start + i + 1;
+
+        switch (d->handler)
+        {
+        case H_ADD:
+            jit_alu_rr(&a, 0x89, X_RAX, JIT_GUEST(d->r1));
+            jit_alu_rr(&a, 0x01, X_RAX, JIT_GUEST(d->r2));
+            jit_movzx_rr(&a, JIT_GUEST(d->r0), X_RAX);
+            last = d->r0;
+            break;
+        case H_ADDI:
+            jit_alu_rr(&a, 0x89, X_RAX, JIT_GUEST(d->r1));
+            jit_alu_ri(&a, 0, X_RAX, d->imm);
+            jit_movzx_rr(&a, JIT_GUEST(d->r0), X_RAX);
+            last = d->r0;
+            break;
+        case H_AND:
+            jit_alu_rr(&a, 0x89, X_RAX, JIT_GUEST(d->r1));
+            jit_alu_rr(&a, 0x21, X_RAX, JIT_GUEST(d->r2));
+            jit_alu_rr(&a, 0x89, JIT_GUEST(d->r0), X_RAX);
+            last = d->r0;
+            break;
+        case H_ANDI:
+            jit_alu_rr(&a, 0x89, X_RAX, JIT_GUEST(d->r1));
+            jit_alu_ri(&a, 4, X_RAX, d->imm);
+            jit_alu_rr(&a, 0x89, JIT_GUEST(d->r0), X_RAX);
+            last = d->r0;
+            break;
+        case H_NOT:
+            jit_alu_rr(&a, 0x89, X_RAX, JIT_GUEST(d->r1));
+            jit_emit8(&a, 0xF7); /* not eax */
+            jit_emit8(&a, 0xD0);
+            jit_movzx_rr(&a, JIT_GUEST(d->r0), X_RAX);
+            last = d->r0;
+            break;
+        case H_LEA:
+            jit_mov_ri(&a, JIT_GUEST(d->r0), d->imm);
+            last = d->r0;
+            break;
+        case H_LD:
+            jit_load_const(&a, JIT_GUEST(d->r0), d->imm, last);
+            last = d->r0;
+            break;
+        case H_LDI:
+            jit_load_const(&a, X_RAX, d->imm, last);
+            jit_load_dynamic(&a, d->r0, last);
+            last = d->r0;
+            break;
+        case H_LDR:
+            jit_alu_rr(&a, 0x89, X_RAX, JIT_GUEST(d->r1));
+            jit_alu_ri(&a, 0, X_RAX, d->imm);
+            jit_movzx_rr(&a, X_RAX, X_RAX);
+            jit_load_dynamic(&a, d->r0, last);
+            last = d->r0;
+            break;
+        case H_ST:
+            jit_mov_ri(&a, X_RAX, d->imm);
+            jit_alu_rr(&a, 0x89, X_RCX, JIT_GUEST(d->r0));
+            jit_store_dynamic(&a, next_pc, last);
+            break;
+        case H_STI:
+            jit_load_const(&a, X_RAX, d->imm, last);
+            jit_alu_rr(&a, 0x89, X_RCX, JIT_GUEST(d->r0));
+            jit_store_dynamic(&a, next_pc, last);
+            break;
+        case H_STR:
+            jit_alu_rr(&a, 0x89, X_RAX, JIT_GUEST(d->r1));
+            jit_alu_ri(&a, 0, X_RAX, d->imm);
+            jit_movzx_rr(&a, X_RAX, X_RAX);
+            jit_alu_rr(&a, 0x89, X_RCX, JIT_GUEST(d->r0));
+            jit_store_dynamic(&a, next_pc, last);
+            break;
+        case H_BR:
+            if (d->r0 == (FL_NEG | FL_ZRO | FL_POS))
+            {
+                jit_exit(&a, d->imm, last, 1);
+            }
+            else if (d->r0 == 0)
+            {
+                jit_exit(&a, next_pc, last, 1);
+            }
+            else
+            {
+                jit_flags(&a, last);
+                jit_store_cond(&a, last);
+                jit_emit8(&a, 0xF7); /* test ecx, nzp */
+                jit_modrm_rr(&a, 0, X_RCX);
+                jit_emit32(&a, d->r0);
+                uint8_t *taken = jit_jcc(&a, 0x5 /* ne */);
+                jit_exit(&a, next_pc, -1, 1);
+                jit_patch(&a, taken);
+                jit_exit(&a, d->imm, -1, 1);
+            }
+            terminated = 1;
+            break;
+        case H_JMP:
+            jit_store_cond(&a, last);
+            jit_store16(&a, JIT_GUEST(d->r1), X_RBP, -1, 1, R_PC * 2);
+            a.exits[a.exit_count++] = jit_jmp(&a);
+            terminated = 1;
+            break;
+        case H_JSR:
+            /* the flags first: `last` may be R7, which the linkage overwrites */
+            jit_store_cond(&a, last);
+            jit_mov_ri(&a, JIT_GUEST(R_R7), next_pc);
+            jit_exit(&a, d->imm, -1, 1);
+            terminated = 1;
+            break;
+        case H_JSRR:
+            /* R7 is written before BaseR is read, JSRR R7 continues right after itself like in the interpreter */
+            jit_store_cond(&a, last);
+            jit_mov_ri(&a, JIT_GUEST(R_R7), next_pc);
+            jit_store16(&a, JIT_GUEST(d->r1), X_RBP, -1, 1, R_PC * 2);
+            a.exits[a.exit_count++] = jit_jmp(&a);
+            terminated = 1;
+            break;
+        }
+    }
+    if (!terminated)
+    {
+        /* the block was cut before a TRAP, a bad opcode, a native routine call, a device register or at JIT_MAX_BLOCK_LEN */
+        jit_exit(&a, start + len, last, 1);
+    }
+
+    /* epilogue: write back the guest registers, restore the callee-saved ones */
+    for (int i = 0; i < a.exit_count; ++i)
+    {
+        jit_patch(&a, a.exits[i]);
+    }
+    jit_write_back(&a);
+    jit_emit8(&a, 0x48); /* add rsp, 8 */
+    jit_emit8(&a, 0x83);
+    jit_emit8(&a, 0xC4);
+    jit_emit8(&a, 8);
+    for (int r = X_R8 + 7; r >= X_R8 + 4; --r)
+    {
+        jit_pop(&a, r);
+    }
+    jit_pop(&a, X_RBP);
+    jit_pop(&a, X_RBX);
+    jit_emit8(&a, 0xC3); /* ret */
+
+    /* bail out before the body: nothing to write back, the interpreter continues at `start` */
+    jit_patch(&a, bail);
+    jit_alu64_mem_imm8(&a, 0, JIT_STEPS_DISP, (int8_t)len);
+    jit_store16_imm(&a, R_PC * 2, start);
+    jit_emit8(&a, 0x48); /* add rsp, 8 */
+    jit_emit8(&a, 0x83);
+    jit_emit8(&a, 0xC4);
+    jit_emit8(&a, 8);
+    for (int r = X_R8 + 7; r >= X_R8 + 4; --r)
+    {
+        jit_pop(&a, r);
+    }
+    jit_pop(&a, X_RBP);
+    jit_pop(&a, X_RBX);
+    jit_emit8(&a, 0xC3); /* ret */
+
+    vm->jit_code_used = a.p - vm->jit_code;
+    metric_add(&vm->metrics->jit_compiles, 1);
+
+    ++vm->jit_block_count;
+    b->code = (jit_fn)(void *)entry;
+    jit_mark(vm, b);
+    vm->jit_entry[start] = b->code;
+    return 1;
+}
+
+/**
+ * Tiered engine: interpret block by block, run translated blocks natively once they got hot.
+ */
+void run_jit(struct lc3_vm *vm)
+{
+    uint64_t hits = 0, misses = 0;
+    while (vm->running && vm->steps_left > 0)
+    {
+        uint16_t pc = vm->reg[R_PC];
+        jit_fn code = vm->jit_entry[pc];
+        if (code)
+        {
+            /* close to the end of the budget the interpreter counts out the last instructions */
+            if (vm->steps_left >= JIT_MAX_BLOCK_LEN)
+            {
+                vm->jit_native = 1;
+                code(vm->reg, vm->memory);
+                vm->jit_native = 0;
+                ++hits;
+                continue;
+            }
+        }
+        else if (++vm->jit_counter[pc] >= JIT_THRESHOLD)
+        {
+            vm->jit_counter[pc] = 0;
+            if (jit_compile(vm, pc))
+            {
+                continue;
+            }
+        }
+        run_block(vm);
+        ++misses;
+    }
+    metric_add(&vm->metrics->jit_hits, hits);
+    metric_add(&vm->metrics->jit_misses, misses);
+}
+#endif
+#pragma endregion
+
+#pragma region Analysis
+/**
+ * Static analysis of a freshly loaded image (config.analyze).
+ *
+ * From the entry point, PC if it lies in the image and its origin otherwise, the pass follows the control flow like
+ * a disassembler: the fall-through, both ways of a BR, JSR targets and the return after them. JMP, RET, HALT and bad
+ * opcodes end a path, the targets of JMP and JSRR are unknown. Addresses LD, LDI, ST, STI and LEA refer to are data,
+ * and so is the string of a `LEA R0` right in front of PUTS or PUTSP. The result is one ANALYSIS_* byte per word.
+ *
+ * It is put to use right away instead of being discovered at run time: every code word is decoded into the cache,
+ * with superinstructions and native routines, and with LC3_ENGINE_JIT the loop headers (targets of backward branches)
+ * are translated. Code only reached through JMP or JSRR is still decoded on its first fetch.
+ * With config.image_cache the result is kept in `<image>.lc3g`, keyed by the FNV-1a of the image's words.
+ */
+enum
+{
+    ANALYSIS_CODE = 1 << 0,  /* an instruction on some path */
+    ANALYSIS_BLOCK = 1 << 1, /* starts a basic block: the entry, a branch target or the word after a branch */
+    ANALYSIS_CALL = 1 << 2,  /* a JSR target */
+    ANALYSIS_LOOP = 1 << 3,  /* the target of a backward branch */
+    ANALYSIS_DATA = 1 << 4,  /* an operand of a load, store or LEA, a printed string */
+    ANALYSIS_ENTRY = 1 << 5,
+};
+
+/** `addr` is in the image and in RAM */
+LC3_INLINE int analysis_in(const struct lc3_vm *vm, uint32_t addr)
+{
+    return addr >= vm->image_first && addr < (uint32_t)vm->image_first + vm->image_count &&
+           !(vm->page_flags[addr >> PAGE_SHIFT] & PAGE_DEVICE);
+}
+
+/** the string printed by PUTS (`packed` 0) or PUTSP from `addr`, up to its terminator */
+void analysis_string(struct lc3_vm *vm, uint16_t addr, int packed)
+{
+    for (uint32_t a = addr; analysis_in(vm, a); ++a)
+    {
+        vm->analysis[a] |= ANALYSIS_DATA;
+        uint16_t w = vm->memory[a];
+        if (packed ? (w & 0xFF) == 0 || (w >> 8) == 0 : w == 0)
+        {
+            break;
+        }
+    }
+}
+
+/**
+ * Walk the image from `entry`, returns 0 if out of memory
+ */
+int analysis_walk(struct lc3_vm *vm, uint16_t entry)
+{
+    uint16_t *todo = malloc(((size_t)vm->image_count + 1) * sizeof(uint16_t)); /* every code word pushes one at most */
+    if (!todo)
+    {
+        return 0;
+    }
+    size_t n = 0;
+    todo[n++] = entry;
+    vm->analysis[entry] |= ANALYSIS_ENTRY | ANALYSIS_BLOCK;
+    while (n > 0)
+    {
+        uint32_t pc = todo[--n];
+        for (int path = 1; path && analysis_in(vm, pc) && !(vm->analysis[pc] & ANALYSIS_CODE); ++pc)
+        {
+            struct decoded_instr d;
+            decode_instr((uint16_t)pc, vm->memory[pc], &d);
+            vm->analysis[pc] |= ANALYSIS_CODE;
+            uint8_t next = 0; /* flags of the word after it */
+            switch (d.handler)
+            {
+            case H_BR:
+                if (d.r0 == 0)
+                {
+                    break; /* never taken, a NOP */
+                }
+                if (analysis_in(vm, d.imm))
+                {
+                    vm->analysis[d.imm] |= ANALYSIS_BLOCK | (d.imm <= pc ? ANALYSIS_LOOP : 0);
+                    todo[n++] = d.imm;
+                }
+                path = d.r0 != 0x7; /* BRnzp */
+                next = ANALYSIS_BLOCK;
+                break;
+            case H_JSR:
+                if (analysis_in(vm, d.imm))
+                {
+                    vm->analysis[d.imm] |= ANALYSIS_BLOCK | ANALYSIS_CALL;
+                    todo[n++] = d.imm;
+                }
+                next = ANALYSIS_BLOCK;
+                break;
+            case H_JSRR:
+                next = ANALYSIS_BLOCK;
+                break;
+            case H_JMP:
+            case H_BAD:
+                path = 0;
+                next = ANALYSIS_BLOCK;
+                break;
+            case H_TRAP:
+                if (d.imm == TRAP_HALT)
+                {
+                    path = 0;
+                    next = ANALYSIS_BLOCK;
+                }
+                else if ((d.imm == TRAP_PUTS || d.imm == TRAP_PUTSP) && analysis_in(vm, pc - 1) &&
+                         (vm->analysis[pc - 1] & ANALYSIS_CODE))
+                {
+                    struct decoded_instr lea;
+                    decode_instr((uint16_t)(pc - 1), vm->memory[pc - 1], &lea);
+                    if (lea.handler == H_LEA && lea.r0 == R_R0)
+                    {
+                        analysis_string(vm, lea.imm, d.imm == TRAP_PUTSP);
+                    }
+                }
+                break;
+            case H_LD:
+            case H_LDI:
+            case H_ST:
+            case H_STI:
+            case H_LEA:
+                if (analysis_in(vm, d.imm))
+                {
+                    vm->analysis[d.imm] |= ANALYSIS_DATA;
+                }
+                break;
+            }
+            if (next && analysis_in(vm, pc + 1))
+            {
+                vm->analysis[pc + 1] |= next;
+            }
+        }
+    }
+    free(todo);
+    return 1;
+}
+
+#if defined(__APPLE__) || defined(__linux__)
+#define ANALYSIS_CACHE_MAGIC 0x4733434Cu /* "LC3G" */
+#define ANALYSIS_CACHE_VERSION 1
+
+struct analysis_cache_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint16_t origin;          /* the image */
+    uint16_t entry;
+    uint32_t words;
+    uint64_t image_hash;      /* FNV-1a of its words in host order */
+    uint64_t checksum;        /* FNV-1a of the `words` ANALYSIS_* bytes that follow */
+    uint64_t header_checksum; /* FNV-1a of all fields above */
+};
+
+void analysis_cache_path(char *buf, size_t size, const char *image_path)
+{
+    snprintf(buf, size, "%s.lc3g", image_path);
+}
+
+/**
+ * Take the result from the sidecar of `image_path` if it was made for exactly this image, returns 0 otherwise
+ */
+int read_analysis_cache(struct lc3_vm *vm, const char *image_path, uint16_t entry, uint64_t image_hash)
+{
+    char path[4096];
+    analysis_cache_path(path, sizeof(path), image_path);
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        return 0;
+    }
+    struct analysis_cache_header h;
+    uint8_t *bytes = vm->analysis + vm->image_first;
+    int ok = fread(&h, sizeof(h), 1, file) == 1 && h.magic == ANALYSIS_CACHE_MAGIC &&
+             h.version == ANALYSIS_CACHE_VERSION &&
+             h.header_checksum == fnv1a(&h, offsetof(struct analysis_cache_header, header_checksum)) &&
+             h.origin == vm->image_first && h.words == vm->image_count && h.entry == entry && h.image_hash == image_hash &&
+             fread(bytes, 1, h.words, file) == h.words && fnv1a(bytes, h.words) == h.checksum;
+    fclose(file);
+    if (!ok)
+    {
+        memset(bytes, 0, vm->image_count);
+    }
+    return ok;
+}
+
+/**
+ * Keep the result of analysis_walk() next to the image; failing to do so is not an error
+ */
+void write_analysis_cache(const struct lc3_vm *vm, const char *image_path, uint16_t entry, uint64_t image_hash)
+{
+    struct analysis_cache_header h = {0};
+    h.magic = ANALYSIS_CACHE_MAGIC;
+    h.version = ANALYSIS_CACHE_VERSION;
+    h.origin = vm->image_first;
+    h.entry = entry;
+    h.words = vm->image_count;
+    h.image_hash = image_hash;
+    h.checksum = fnv1a(vm->analysis + vm->image_first, vm->image_count);
+    h.header_checksum = fnv1a(&h, offsetof(struct analysis_cache_header, header_checksum));
+
+    /* like write_image_cache(): a temporary file renamed into place */
+    char path[4096], tmp[4096 + 48];
+    analysis_cache_path(path, sizeof(path), image_path);
+    snprintf(tmp, sizeof(tmp), "%s.%ld.%u.tmp", path, (long)getpid(), atomic_fetch_add(&image_cache_serial, 1));
+    FILE *file = fopen(tmp, "wb");
+    if (file)
+    {
+        int ok = fwrite(&h, sizeof(h), 1, file) == 1 &&
+                 fwrite(vm->analysis + vm->image_first, 1, vm->image_count, file) == vm->image_count;
+        ok = fclose(file) == 0 && ok;
+        if (!ok || rename(tmp, path) != 0)
+        {
+            unlink(tmp);
+        }
+    }
+}
+#endif
+
+/**
+ * A new image replaced memory: what an earlier analysis decoded or translated there is stale
+ */
+void analysis_drop(struct lc3_vm *vm)
+{
+    if (!vm->analyzed)
+    {
+        return; /* nothing ran yet and nothing was decoded ahead of time, the cache is still empty */
+    }
+    for (uint32_t addr = vm->image_first; addr < (uint32_t)vm->image_first + vm->image_count; ++addr)
+    {
+        vm->decoded[addr].handler = H_DECODE;
+        vm->analysis[addr] = 0;
+    }
+#ifdef LC3_HAVE_JIT
+    if (vm->jit_code)
+    {
+        jit_flush(vm);
+    }
+#endif
+}
+
+/**
+ * Analyze the image that `path` just loaded and decode (and translate) its code ahead of time
+ */
+void analyze_image(struct lc3_vm *vm, const char *path)
+{
+    uint16_t entry = analysis_in(vm, vm->reg[R_PC]) ? vm->reg[R_PC] : vm->image_first;
+    if (!analysis_in(vm, entry))
+    {
+        return;
+    }
+#if defined(__APPLE__) || defined(__linux__)
+    uint64_t image_hash = fnv1a(vm->memory + vm->image_first, 2 * (size_t)vm->image_count);
+    if (!(vm->config.image_cache && read_analysis_cache(vm, path, entry, image_hash)))
+    {
+        if (!analysis_walk(vm, entry))
+        {
+            return;
+        }
+        if (vm->config.image_cache)
+        {
+            write_analysis_cache(vm, path, entry, image_hash);
+        }
+    }
+#else
+    (void)path;
+    if (!analysis_walk(vm, entry))
+    {
+        return;
+    }
+#endif
+    vm->analyzed = 1;
+
+    /* ascending, so fuse() finds the followers of each entry decoded */
+    for (uint32_t addr = vm->image_first; addr < (uint32_t)vm->image_first + vm->image_count; ++addr)
+    {
+        if ((vm->analysis[addr] & ANALYSIS_CODE) && vm->decoded[addr].handler == H_DECODE)
+        {
+            fetch_decode(vm, (uint16_t)addr);
+        }
+    }
+#ifdef LC3_HAVE_JIT
+    if (vm->config.engine == LC3_ENGINE_JIT && !vm->profile && !vm->trace && !vm->debug_points)
+    {
+        for (uint32_t addr = vm->image_first; addr < (uint32_t)vm->image_first + vm->image_count; ++addr)
+        {
+            if ((vm->analysis[addr] & ANALYSIS_LOOP) && !vm->jit_entry[addr])
+            {
+                jit_compile(vm, (uint16_t)addr);
+            }
+        }
+    }
+#endif
+}
+
+int lc3_write_analysis(const struct lc3_vm *vm, FILE *file)
+{
+    for (uint32_t addr = 0; addr < MEMORY_MAX;)
+    {
+        uint8_t f = vm->analysis[addr];
+        uint32_t end = addr + 1;
+        if (f & ANALYSIS_CODE)
+        {
+            /* up to a control transfer, the end of the code or the next block */
+            for (uint16_t op = vm->memory[addr] >> 12;
+                 op != OP_BR && op != OP_JMP && op != OP_JSR && op != OP_RTI && op != OP_RES && end < MEMORY_MAX &&
+                 (vm->analysis[end] & (ANALYSIS_CODE | ANALYSIS_BLOCK)) == ANALYSIS_CODE;
+                 op = vm->memory[end++] >> 12)
+            {
+            }
+            char kinds[32] = "";
+            static const char *const names[] = {"entry", "call", "loop"};
+            const uint8_t bits[] = {ANALYSIS_ENTRY, ANALYSIS_CALL, ANALYSIS_LOOP};
+            for (int i = 0; i < 3; ++i)
+            {
+                if (f & bits[i])
+                {
+                    strcat(strcat(kinds, kinds[0] ? "," : ""), names[i]);
+                }
+            }
+            fprintf(file, "block\tx%04X\tx%04X\t%s\n", addr, end - 1, kinds[0] ? kinds : "-");
+            uint16_t last = vm->memory[end - 1];
+            if ((last >> 12) == OP_JSR && (last & 0x800))
+            {
+                fprintf(file, "call\tx%04X\tx%04X\n", end - 1, (uint16_t)(end + sign_extend(last & 0x7FF, 11)));
+            }
+        }
+        else if (f & ANALYSIS_DATA)
+        {
+            while (end < MEMORY_MAX && (vm->analysis[end] & (ANALYSIS_CODE | ANALYSIS_DATA)) == ANALYSIS_DATA)
+            {
+                ++end;
+            }
+            fprintf(file, "data\tx%04X\tx%04X\n", addr, end - 1);
+        }
+        addr = end;
+    }
+    return !ferror(file);
+}
+#pragma endregion
+
+#pragma region API
+/**
+ * The trace ring of lc3_create(), `trace_size` rounded up to a power of two; 0 if out of memory
+ */
+int trace_alloc(struct lc3_vm *vm)
+{
+    uint32_t size = 1;
+    while (size < vm->config.trace_size && size < (1u << 31))
+    {
+        size <<= 1;
+    }
+    vm->config.trace_size = size;
+    size_t bytes = (size_t)size * sizeof(struct lc3_trace_record); /* a multiple of TRACE_ALIGN from 4 records on */
+    bytes = (bytes + TRACE_ALIGN - 1) & ~(size_t)(TRACE_ALIGN - 1);
+#if defined(__APPLE__) || defined(__linux__)
+    vm->trace = aligned_alloc(TRACE_ALIGN, bytes);
+#else
+    vm->trace = _aligned_malloc(bytes, TRACE_ALIGN);
+#endif
+    if (!vm->trace)
+    {
+        return 0;
+    }
+    memset(vm->trace, 0, bytes);
+    return 1;
+}
+
+void lc3_default_config(struct lc3_config *config)
+{
+    memset(config, 0, sizeof(*config));
+#ifdef LC3_HAVE_THREADED
+    config->engine = LC3_ENGINE_THREADED;
+#else
+    config->engine = LC3_ENGINE_SWITCH;
+#endif
+    config->flush_policy = LC3_FLUSH_INPUT | LC3_FLUSH_TIME;
+    config->flush_ms = 50;
+    config->fuse = 1;
+    config->native_routines = 1;
+    config->idle_sleep = 1;
+}
+
+struct lc3_vm *lc3_create(const struct lc3_config *config)
+{
+    /* a couple of MiB, mostly tables that are only touched page by page: lazily zeroed pages from the OS */
+#if defined(__APPLE__) || defined(__linux__)
+    struct lc3_vm *vm = mmap(NULL, sizeof(struct lc3_vm), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (vm == MAP_FAILED)
+    {
+        return NULL;
+    }
+#else
+    struct lc3_vm *vm = calloc(1, sizeof(struct lc3_vm));
+    if (!vm)
+    {
+        return NULL;
+    }
+#endif
+
+    if (config)
+    {
+        vm->config = *config;
+    }
+    else
+    {
+        lc3_default_config(&vm->config);
+    }
+    vm->metrics = vm->config.metrics ? vm->config.metrics : &vm->own_metrics;
+    init_memory(vm);
+    input_init(vm);
+    routine_init(vm);
+    if (vm->config.profile && !(vm->profile = calloc(1, sizeof(struct lc3_profile))))
+    {
+        lc3_destroy(vm);
+        return NULL;
+    }
+    if (vm->config.trace_size && !trace_alloc(vm))
+    {
+        lc3_destroy(vm);
+        return NULL;
+    }
+    if (vm->config.record)
+    {
+        fwrite(RECORD_MAGIC, 1, RECORD_MAGIC_SIZE, vm->config.record);
+    }
+
+    for (int vector = 0; vector < 256; ++vector)
+    {
+        lc3_set_trap(vm, (uint8_t)vector, NULL, NULL);
+    }
+
+    /** since exactly one condition flag should be set at any given time, set the Z flag  */
+    set_cond(vm, FL_ZRO);
+
+    enum
+    {
+        PC_START = 0x3000
+    };
+    /** set the PC to starting position, 0x3000 is the default */
+    vm->reg[R_PC] = PC_START;
+    vm->saved_ssp = PC_START; /* the supervisor stack grows down from the program, region Interrupts; PSR: supervisor mode */
+    vm->running = 1;
+    return vm;
+}
+
+void lc3_destroy(struct lc3_vm *vm)
+{
+    if (!vm)
+    {
+        return;
+    }
+
+    console_acquire();
+    if (console_vm == vm)
+    {
+        console_vm = NULL;
+    }
+    console_release();
+    input_fini(vm);
+
+    for (uint16_t i = 0; i < vm->snapshot_image_count; ++i)
+    {
+        free(vm->snapshot_images[i]);
+    }
+    free(vm->snapshot_images);
+    free(vm->profile);
+    free(vm->replay_data);
+#if defined(__APPLE__) || defined(__linux__)
+    free(vm->trace);
+#else
+    _aligned_free(vm->trace);
+#endif
+    free(vm->captured);
+#ifdef LC3_HAVE_JIT
+    if (vm->jit_code && vm->jit_code != MAP_FAILED)
+    {
+        munmap(vm->jit_code, JIT_CODE_SIZE);
+    }
+#endif
+
+#if defined(__APPLE__) || defined(__linux__)
+    munmap(vm, sizeof(struct lc3_vm)); /* also drops images mapped over `memory` */
+#else
+    free(vm);
+#endif
+}
+
+int lc3_load_image(struct lc3_vm *vm, const char *path)
+{
+    vm->image_count = 0;
+    if (!load_program(vm, path))
+    {
+        return 0;
+    }
+    analysis_drop(vm);
+    if (vm->config.analyze && vm->image_count > 0)
+    {
+        analyze_image(vm, path);
+    }
+    snapshot_add_image(vm, path);
+    return 1;
+}
+
+int lc3_load_words(struct lc3_vm *vm, uint16_t origin, const uint16_t *words, size_t count)
+{
+    if (count > (size_t)(MEMORY_MAX - origin))
+    {
+        return 0;
+    }
+    memcpy(vm->memory + origin, words, count * sizeof(uint16_t));
+#if defined(__APPLE__) || defined(__linux__)
+    if (count > 0)
+    {
+        image_mark_pages(vm, origin, count);
+    }
+#else
+    vm->image_first = origin;
+    vm->image_count = (uint32_t)count;
+#endif
+    analysis_drop(vm);
+    return 1;
+}
+
+int lc3_restore(struct lc3_vm *vm, const char *path)
+{
+    return snapshot_restore(vm, path);
+}
+
+#define DEADLINE_SLICE (1u << 20) /* instructions between two looks at the clock, about a millisecond */
+
+/**
+ * One run of the engine of the VM, `steps_left` instructions at the most
+ */
+void run_engine(struct lc3_vm *vm)
+{
+    if (vm->trace)
+    {
+        run_traced(vm); /* also profiles */
+    }
+    else if (vm->profile)
+    {
+        run_profiled(vm);
+    }
+    else
+    {
+        int flat = memory_flat(vm); /* the variant is picked per run, the page flags only change between runs */
+        switch (vm->config.engine)
+        {
+#ifdef LC3_HAVE_THREADED
+        case LC3_ENGINE_THREADED:
+            if (flat)
+            {
+                run_threaded_flat(vm);
+                break;
+            }
+            run_threaded(vm);
+            break;
+#endif
+#ifdef LC3_HAVE_JIT
+        case LC3_ENGINE_JIT:
+            if (vm->debug_points)
+            {
+                run_threaded(vm); /* translated code cannot stop, see region Debugger */
+                break;
+            }
+            run_jit(vm);
+            break;
+#endif
+        case LC3_ENGINE_SWITCH:
+        default:
+            if (flat)
+            {
+                run_switch_flat(vm);
+                break;
+            }
+            run_switch(vm);
+            break;
+        }
+    }
+}
+
+/**
+ * lc3_run() without the metrics of its own
+ */
+int run_steps(struct lc3_vm *vm, uint64_t max_steps)
+{
+    if (vm->config.snapshot_path && !vm->tracking)
+    {
+        snapshot_begin(vm); /* from here on stores are tracked in page_dirty */
+    }
+    if (!vm->running)
+    {
+        return vm->fault.code ? LC3_FAULT : LC3_HALTED;
+    }
+
+    if (vm->deadline && now_ms() >= vm->deadline)
+    {
+        return LC3_DEADLINE;
+    }
+
+    uint64_t budget = max_steps ? max_steps : UINT64_MAX;
+    uint16_t pc = vm->reg[R_PC];
+    vm->break_resume = vm->debug_points && ((vm->break_bits[pc >> 3] >> (pc & 7)) & 1);
+    int status = LC3_YIELD;
+    if (!vm->deadline && !vm->config.interrupts && !vm->config.metrics && !output_timed(vm))
+    {
+        vm->steps_left = budget;
+        run_engine(vm);
+    }
+    else
+    {
+        /* the clock is read, interrupts are taken, metrics published and aged output flushed between slices only,
+           the engines run exactly as without them */
+        uint64_t max_slice = vm->config.interrupts ? INTERRUPT_SLICE : DEADLINE_SLICE;
+        uint64_t left = budget;
+        for (;;)
+        {
+            uint64_t slice = left < max_slice ? left : max_slice;
+            vm->steps_left = slice;
+            run_engine(vm);
+            left -= slice - vm->steps_left;
+            atomic_store_explicit(&vm->metrics->retired, vm->retired + budget - left, memory_order_relaxed);
+            if (!vm->running || vm->stop || vm->steps_left > 0)
+            {
+                break;
+            }
+            if (vm->config.interrupts && (status = interrupt_poll(vm)) != LC3_YIELD)
+            {
+                break;
+            }
+            if (left == 0)
+            {
+                break;
+            }
+            output_flush_aged(vm);
+            if (vm->deadline && now_ms() >= vm->deadline)
+            {
+                status = LC3_DEADLINE;
+                break;
+            }
+        }
+        vm->steps_left = left;
+    }
+    if (vm->stop == LC3_INPUT || vm->stop == LC3_FAULT)
+    {
+        vm->steps_left += 1; /* the engine counted the instruction, it did not run */
+    }
+    vm->retired += budget - vm->steps_left;
+    if (vm->watch_pending)
+    {
+        debug_watch_stop(vm); /* the budget ended right after the hit */
+    }
+    if (vm->stop)
+    {
+        status = vm->stop;
+        vm->stop = 0;
+        vm->running = status != LC3_FAULT; /* input_block() only paused it */
+        return status;
+    }
+    if (!vm->running)
+    {
+        trace_dump(vm);
+        return LC3_HALTED;
+    }
+    return status;
+}
+
+int lc3_run(struct lc3_vm *vm, uint64_t max_steps)
+{
+    uint64_t start = now_ns();
+    int status = run_steps(vm, max_steps);
+    metric_add(&vm->metrics->run_ns, now_ns() - start);
+    atomic_store_explicit(&vm->metrics->retired, vm->retired, memory_order_relaxed);
+    return status;
+}
+
+void lc3_set_deadline(struct lc3_vm *vm, uint64_t ms)
+{
+    vm->deadline = ms ? now_ms() + ms : 0;
+}
+
+int lc3_get_fault(const struct lc3_vm *vm, struct lc3_fault *fault)
+{
+    *fault = vm->fault;
+    return vm->fault.code;
+}
+
+const char *lc3_fault_name(int code)
+{
+    switch (code)
+    {
+    case LC3_FAULT_NONE:
+        return "none";
+    case LC3_FAULT_ILLEGAL_OPCODE:
+        return "illegal opcode";
+    case LC3_FAULT_PRIVILEGE:
+        return "privilege violation";
+    case LC3_FAULT_UNKNOWN_TRAP:
+        return "unknown trap";
+    case LC3_FAULT_DIVIDE_BY_ZERO:
+        return "division by zero";
+    default:
+        return "unknown fault";
+    }
+}
+
+void lc3_set_trap(struct lc3_vm *vm, uint8_t vector, lc3_trap_fn fn, void *user)
+{
+    vm->traps[vector] = (struct trap_handler){.fn = fn ? fn : trap_default(vm, vector), .user = fn ? user : NULL};
+}
+
+uint64_t lc3_retired(const struct lc3_vm *vm)
+{
+    return vm->retired;
+}
+
+const struct lc3_metrics *lc3_get_metrics(const struct lc3_vm *vm)
+{
+    return vm->metrics;
+}
+
+void lc3_flush(struct lc3_vm *vm)
+{
+    output_flush(vm);
+    if (vm->config.record)
+    {
+        fflush(vm->config.record);
+    }
+}
+
+void lc3_set_output(struct lc3_vm *vm, FILE *file)
+{
+    output_flush(vm);
+    vm->config.output = file;
+}
+
+const char *lc3_output(struct lc3_vm *vm, size_t *size)
+{
+    output_flush(vm);
+    *size = vm->captured_len;
+    return vm->captured;
+}
+
+int lc3_parse_engine(const char *name, int *engine)
+{
+    if (strcmp(name, "switch") == 0)
+    {
+        *engine = LC3_ENGINE_SWITCH;
+        return 1;
+    }
+#ifdef LC3_HAVE_THREADED
+    if (strcmp(name, "threaded") == 0)
+    {
+        *engine = LC3_ENGINE_THREADED;
+        return 1;
+    }
+#endif
+#ifdef LC3_HAVE_JIT
+    if (strcmp(name, "jit") == 0)
+    {
+        *engine = LC3_ENGINE_JIT;
+        return 1;
+    }
+#endif
+    return 0;
+}
+#pragma endregion
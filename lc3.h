@@ -0,0 +1,343 @@
+#ifndef LC3_H
+#define LC3_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * LC-3 virtual machine library.
+ *
+ * Every VM lives in its own `struct lc3_vm`, so one process can run as many of them as it likes.
+ * A VM is not thread-safe by itself, but different VMs can run on different threads.
+ *
+ *     struct lc3_vm *vm = lc3_create(NULL);
+ *     lc3_load_image(vm, "2048.obj");
+ *     while (lc3_run(vm, 1000000) == LC3_YIELD)
+ *         ;
+ *     lc3_destroy(vm);
+ */
+
+struct lc3_vm;
+struct lc3_metrics;
+
+/**
+ * Execution engines, see lc3_parse_engine()
+ */
+enum lc3_engine
+{
+    LC3_ENGINE_SWITCH = 0, /* one shared `switch`, portable */
+    LC3_ENGINE_THREADED,   /* computed goto, every handler has its own dispatch branch */
+    LC3_ENGINE_JIT,        /* interpreter + native code for hot blocks */
+};
+
+/**
+ * Points at which buffered guest output is written, see lc3_parse_flush_policy()
+ */
+enum lc3_flush
+{
+    LC3_FLUSH_NEWLINE = 1 << 0, /* after every '\n' */
+    LC3_FLUSH_INPUT = 1 << 1,   /* before the guest waits for input: TRAP_GETC, TRAP_IN, KBSR reads */
+    LC3_FLUSH_TIME = 1 << 2,    /* when the oldest buffered byte is `flush_ms` old */
+};
+
+/**
+ * Result of lc3_run()
+ */
+enum lc3_status
+{
+    LC3_HALTED = 0, /* the guest executed TRAP_HALT */
+    LC3_YIELD,      /* `max_steps` instructions ran, call lc3_run() again to continue */
+    LC3_BREAKPOINT, /* PC is at a breakpoint, its instruction has not run yet */
+    LC3_WATCHPOINT, /* an instruction accessed a watched address, PC is at the next one; see lc3_watch_hit() */
+    LC3_DEADLINE,   /* the time of lc3_set_deadline() is up, lc3_run() can continue once there is a new one */
+    LC3_FAULT,      /* the guest died, PC is at the instruction and lc3_get_fault() says why; lc3_run() returns it again */
+    LC3_INPUT,      /* `input_nowait`: PC is at a GETC or IN and there is no key yet, lc3_run() tries again */
+};
+
+/**
+ * Watchpoint kinds, see lc3_set_watchpoint()
+ */
+enum lc3_watch
+{
+    LC3_WATCH_READ = 1 << 0,
+    LC3_WATCH_WRITE = 1 << 1,
+};
+
+/**
+ * Registers for lc3_get_reg() and lc3_set_reg(): R0-R7 are 0-7
+ */
+enum lc3_reg
+{
+    LC3_REG_PC = 8,
+    LC3_REG_COND = 9, /* FL_POS 1, FL_ZRO 2, FL_NEG 4 */
+    LC3_REG_PSR = 10, /* bit 15 user mode, bits 10-8 priority, bits 2-0 COND; see `config.interrupts` */
+};
+
+/**
+ * Faults, see lc3_get_fault()
+ */
+enum lc3_fault_code
+{
+    LC3_FAULT_NONE = 0,
+    LC3_FAULT_ILLEGAL_OPCODE, /* the reserved opcode 1101 without a handler at x0101; or RTI without `config.interrupts` */
+    LC3_FAULT_PRIVILEGE,      /* RTI in user mode without a handler at x0100 */
+    LC3_FAULT_UNKNOWN_TRAP,   /* a TRAP without a handler, see lc3_set_trap() */
+    LC3_FAULT_DIVIDE_BY_ZERO, /* the DIV host call */
+};
+
+struct lc3_fault
+{
+    int code;         /* lc3_fault_code */
+    uint16_t pc;      /* address of the instruction */
+    uint16_t instr;
+    uint16_t reg[8];  /* R0-R7 */
+    uint16_t psr;     /* LC3_REG_PSR */
+};
+
+struct lc3_config
+{
+    int engine;                /* lc3_engine */
+    unsigned kbd_poll;         /* 0: stdin is read by a thread, N: the host is polled on every N-th KBSR read */
+    unsigned flush_policy;     /* lc3_flush bits */
+    unsigned flush_ms;         /* age of buffered output for LC3_FLUSH_TIME */
+    int unbuffered;            /* flush after every output trap */
+    int image_cache;           /* keep native-endian `<image>.lc3c` files next to the images (Linux/macOS) */
+    int share_images;          /* VMs of this process loading the same image share its pages copy-on-write (Linux/macOS) */
+    int profile;               /* count instructions by address, opcode and trap, see lc3_write_profile(); interprets */
+    int fuse;                  /* run common instruction sequences as superinstructions, see lc3_write_fusions() */
+    int native_routines;       /* run known multiply, divide and modulo subroutines natively, see lc3_write_routines() */
+    int analyze;               /* find the code of every image when it is loaded, see lc3_write_analysis() */
+    struct lc3_metrics *metrics; /* keep these counters up to date instead of the VM's own, zeroed by the caller;
+                                    also makes lc3_run() publish retired instructions about every million of them */
+    int idle_sleep;            /* block on the host input while the guest busy-waits on KBSR instead of spinning */
+    const char *snapshot_path; /* save the VM there the first time the guest waits for input */
+    int headless;              /* never touch the console: keyboard from `input_data` or `input` only, none: end of input */
+    FILE *input;               /* keyboard input from this stream instead of the console; read directly, it never blocks */
+    const void *input_data;    /* keyboard input from memory, `input_size` bytes; takes precedence over `input` */
+    size_t input_size;
+    FILE *output;              /* guest output, NULL: stdout */
+    int capture_output;        /* keep guest output in memory instead of writing it to `output`, see lc3_output() */
+    unsigned trace_size;       /* records in the trace ring, a power of two; 0: no trace, see lc3_write_trace() */
+    const char *trace_path;    /* write the trace there when the guest halts or hits a bad opcode */
+    FILE *record;              /* log every key the guest reads there, see lc3_replay() */
+    int input_nowait;          /* GETC and IN without a key make lc3_run() return LC3_INPUT instead of waiting */
+    int host_calls;            /* TRAP x30-x34 (MEMCPY, MEMSET, MUL, DIV, PUTD) run natively, see lc3_set_trap() */
+    int interrupts;            /* the LC-3 privilege and interrupt model: supervisor stack, RTI, the vector table at
+                                  x0100 and the keyboard interrupt (KBSR bit 14); without it RTI is a fault */
+};
+
+/**
+ * Trace files (config.trace_size): a struct lc3_trace_header and `count` records, oldest first, in host byte order.
+ * Every record is one executed instruction. `flags` say which of the other fields mean something.
+ */
+#define LC3_TRACE_MAGIC 0x5443334C /* "L3CT" in a little-endian file */
+#define LC3_TRACE_VERSION 1
+
+enum lc3_trace_flags
+{
+    LC3_TRACE_REG = 1 << 0,   /* the instruction wrote register `reg`, its new value is `reg_value` */
+    LC3_TRACE_LOAD = 1 << 1,  /* it read memory at `addr` */
+    LC3_TRACE_STORE = 1 << 2, /* it wrote `value` to memory at `addr` */
+    LC3_TRACE_LINK = 1 << 3,  /* besides `reg` it wrote R7, the return address `pc + 1` (GETC, IN, MUL, DIV) */
+};
+
+struct lc3_trace_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count; /* records that follow */
+    uint64_t first; /* number of the first one among all instructions traced, counting from 0 */
+};
+
+struct lc3_trace_record
+{
+    uint16_t pc;    /* address of the instruction */
+    uint16_t instr;
+    uint16_t reg_value;
+    uint16_t addr;
+    uint16_t value;
+    uint8_t reg;
+    uint8_t flags;  /* lc3_trace_flags */
+    uint32_t seq;   /* low bits of the instruction number */
+};
+
+/** the configuration lc3_create(NULL) uses */
+void lc3_default_config(struct lc3_config *config);
+
+/** a VM with empty memory, PC at 0x3000; NULL if out of memory */
+struct lc3_vm *lc3_create(const struct lc3_config *config);
+void lc3_destroy(struct lc3_vm *vm);
+
+/**
+ * Load an .obj image, or assemble an .asm source (errors go to stderr as `file:line: message`); returns 0 on failure.
+ * With `config.image_cache` the assembled words are kept in `<source>.lc3a` for as long as the source stays the same.
+ */
+int lc3_load_image(struct lc3_vm *vm, const char *path);
+
+/**
+ * The control flow graph `config.analyze` found in the images loaded so far, one tab separated record per line:
+ * `block <first> <last> <kinds>` for every basic block, kinds `entry`, `call` (a JSR target), `loop` (a backward
+ * branch target), comma separated, or `-`; `call <site> <target>` after a block ending in a JSR; `data <first> <last>`
+ * for words only used as data. Addresses are `x3000`. Returns 0 on write errors.
+ */
+int lc3_write_analysis(const struct lc3_vm *vm, FILE *file);
+
+/** copy `count` words in host order to `origin`, like an image that is not in a file; not part of snapshots, returns 0 if they do not fit */
+int lc3_load_words(struct lc3_vm *vm, uint16_t origin, const uint16_t *words, size_t count);
+
+/** load the images of a snapshot and continue where it was taken, returns 0 on failure */
+int lc3_restore(struct lc3_vm *vm, const char *path);
+
+/**
+ * Feed the keyboard from a recording made with `config.record` instead of any input, returns 0 if `file` is not one.
+ * Every key reaches the guest at the same KBSR read, GETC or IN as when it was recorded, so the run is the same,
+ * without a terminal and without waiting; after the last key the keyboard is at its end.
+ */
+int lc3_replay(struct lc3_vm *vm, FILE *file);
+
+/** start reading stdin into the keyboard of the VM, after the terminal has been set up; nothing to do with `config.input` */
+void lc3_start_input(struct lc3_vm *vm);
+
+/**
+ * Run until the guest halts, `max_steps` instructions have executed (0: no limit) or another lc3_status happens.
+ * Returns that lc3_status.
+ */
+int lc3_run(struct lc3_vm *vm, uint64_t max_steps);
+
+/**
+ * lc3_run() returns LC3_DEADLINE once `ms` milliseconds from now have passed (0: no deadline, the default).
+ * The clock is read about every million instructions, not in the engines; a guest waiting for a key in GETC or IN
+ * only notices it with `config.input_nowait`.
+ */
+void lc3_set_deadline(struct lc3_vm *vm, uint64_t ms);
+
+/**
+ * Native trap handlers. TRAP `vector` sets R7 and calls `fn` instead of running guest code; the handler uses the
+ * VM through lc3_get_reg(), lc3_set_reg(), lc3_peek() and lc3_poke() and returns non-zero to halt the guest.
+ * Installed by default: GETC, OUT, PUTS, IN, PUTSP and HALT (x20-x25), with `config.host_calls` also
+ *   x30 MEMCPY  copy R2 words from R1 to R0 (the areas may overlap)
+ *   x31 MEMSET  store R1 into R2 words from R0
+ *   x32 MUL     R0 = R0 * R1
+ *   x33 DIV     R0 = R0 / R1 and R1 = R0 % R1, signed; a fault if R1 is 0
+ *   x34 PUTD    output R0 as a signed decimal
+ * Any other TRAP is a fault, or with `config.interrupts` jumps through the trap vector table at x0000 of the guest.
+ */
+typedef int (*lc3_trap_fn)(struct lc3_vm *vm, uint8_t vector, void *user);
+
+/** handle TRAP `vector` with `fn` from now on, passing it `user`; NULL puts the default back */
+void lc3_set_trap(struct lc3_vm *vm, uint8_t vector, lc3_trap_fn fn, void *user);
+
+/** the fault that made lc3_run() return LC3_FAULT, with the registers at that point; returns its lc3_fault_code */
+int lc3_get_fault(const struct lc3_vm *vm, struct lc3_fault *fault);
+
+/** "illegal opcode", "privilege violation" */
+const char *lc3_fault_name(int code);
+
+/** instructions executed so far */
+uint64_t lc3_retired(const struct lc3_vm *vm);
+
+/**
+ * Live counters of a VM, see `config.metrics`. Only the thread running the VM writes them, with relaxed atomic
+ * stores and no locks, so any thread may read them at any time; they are published at block granularity
+ * (retired instructions per slice of lc3_run(), JIT block entries per run), never per instruction.
+ */
+struct lc3_metrics
+{
+    _Atomic uint64_t retired;           /* instructions executed */
+    _Atomic uint64_t run_ns;            /* time spent in lc3_run() */
+    _Atomic uint64_t input_wait_ns;     /* of that, time the guest waited for keys: GETC, IN and idle KBSR polling */
+    _Atomic uint64_t output_bytes;      /* guest output */
+    _Atomic uint64_t traps[256];        /* TRAP instructions run, by vector */
+    _Atomic uint64_t jit_hits;          /* block entries that ran translated code */
+    _Atomic uint64_t jit_misses;        /* block entries the interpreter took, code not (yet) translated or the budget almost gone */
+    _Atomic uint64_t jit_compiles;      /* blocks translated */
+    _Atomic uint64_t jit_invalidations; /* stores into translated code */
+    _Atomic uint64_t jit_flushes;       /* the code buffer ran full and was emptied */
+};
+
+/** the counters the VM keeps up to date: `config.metrics` or its own */
+const struct lc3_metrics *lc3_get_metrics(const struct lc3_vm *vm);
+
+/**
+ * `count` counter blocks in the Prometheus text format, one sample per block of every metric: `lc3_retired_instructions_total`,
+ * `lc3_run_seconds_total`, `lc3_input_wait_seconds_total`, `lc3_output_bytes_total`, `lc3_mips`, `lc3_traps_total{vector="x21"}`,
+ * `lc3_jit_block_entries_total{result="hit"|"miss"}`, `lc3_jit_compiles_total`, `lc3_jit_invalidations_total` and
+ * `lc3_jit_flushes_total`. `labels[i]` (may be NULL) goes into the braces of the samples of block i, e.g. `job="3"`.
+ * Safe while the VMs run on other threads. Returns 0 on write errors.
+ */
+int lc3_write_metrics(FILE *file, const struct lc3_metrics *const *metrics, const char *const *labels, size_t count);
+
+/** write buffered guest output */
+void lc3_flush(struct lc3_vm *vm);
+
+/** guest output goes to `file` from now on (NULL: stdout), output buffered so far is written to the old one first */
+void lc3_set_output(struct lc3_vm *vm, FILE *file);
+
+/** all guest output so far of a VM with `config.capture_output`, `*size` bytes owned by the VM (NULL if there is none) */
+const char *lc3_output(struct lc3_vm *vm, size_t *size);
+
+/**
+ * Debugging, between lc3_run() calls. Breakpoints and watchpoints make lc3_run() stop early, see lc3_status.
+ * A VM without any runs exactly as fast as before; a VM with some does not fuse and does not translate code.
+ * lc3_run() never stops at the breakpoint it starts on, so calling it again continues, and lc3_run(vm, 1) steps.
+ */
+
+/** set (`on`) or clear a breakpoint before the instruction at `addr`; returns 0 for device addresses (xFE00 and up) */
+int lc3_set_breakpoint(struct lc3_vm *vm, uint16_t addr, int on);
+
+/** watch guest accesses to `addr`, lc3_watch bits; 0 removes the watchpoint */
+void lc3_set_watchpoint(struct lc3_vm *vm, uint16_t addr, unsigned kinds);
+
+/** the lc3_watch kind of the access that made lc3_run() return LC3_WATCHPOINT, its address in `*addr` */
+unsigned lc3_watch_hit(const struct lc3_vm *vm, uint16_t *addr);
+
+/** a register, lc3_reg */
+uint16_t lc3_get_reg(struct lc3_vm *vm, int reg);
+void lc3_set_reg(struct lc3_vm *vm, int reg, uint16_t value);
+
+/** memory as the guest last left it, without device side effects */
+uint16_t lc3_peek(const struct lc3_vm *vm, uint16_t addr);
+
+/** store like the guest would, devices included */
+void lc3_poke(struct lc3_vm *vm, uint16_t addr, uint16_t value);
+
+/** `instr` at `addr` in assembler syntax, PC-relative operands as addresses, e.g. `LDR R1, R6, #-1` or `BRz x3008` */
+void lc3_disassemble(uint16_t addr, uint16_t instr, char *buf, size_t size);
+
+/**
+ * The counts of a VM created with `config.profile`, one tab separated record per line:
+ * `retired <n>`, `op <name> <n>` for every opcode, `trap <vector> <name> <n>` and `pc <address> <n>`
+ * for everything executed, most frequent address first. Returns 0 without a profile or on write errors.
+ */
+int lc3_write_profile(const struct lc3_vm *vm, FILE *file);
+
+/** the `top` most executed addresses, for people */
+void lc3_print_hot_spots(const struct lc3_vm *vm, FILE *file, int top);
+
+/**
+ * Superinstructions of a VM with `config.fuse`, one tab separated record per line for every kind:
+ * `fused <sequence> <formed> <runs>`, e.g. `fused AND+ADD 3 120000`. Returns 0 on write errors.
+ * Profiled VMs and translated code do not use them.
+ */
+int lc3_write_fusions(const struct lc3_vm *vm, FILE *file);
+
+/**
+ * Subroutines of a VM with `config.native_routines`, one tab separated record per line for every known one:
+ * `routine <name> <sites> <runs>`, e.g. `routine DIV 4 1800`: the JSRs found calling it and the calls that ran natively.
+ * Profiled and traced VMs run every subroutine instruction by instruction.
+ */
+int lc3_write_routines(const struct lc3_vm *vm, FILE *file);
+
+/**
+ * The trace of a VM created with `config.trace_size`: the last `trace_size` instructions, see struct lc3_trace_header.
+ * Also right in the middle of lc3_run(), e.g. from a signal handler. Returns 0 without a trace or on write errors.
+ */
+int lc3_write_trace(const struct lc3_vm *vm, FILE *file);
+
+/** "switch", "threaded" or "jit"; returns 0 for unknown names and engines missing from this build */
+int lc3_parse_engine(const char *name, int *engine);
+
+/** a flush policy such as "newline,input,time"; returns 0 on unknown names */
+int lc3_parse_flush_policy(const char *s, unsigned *policy);
+
+#endif
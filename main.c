@@ -1,263 +1,389 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 #if defined(__APPLE__) || defined(__linux__)
-#include <stdlib.h>
 #include <unistd.h>
-#include <fcntl.h>
-#include <sys/time.h>
-#include <sys/types.h>
 #include <sys/termios.h>
-#include <sys/mman.h>
 #else
 #include <Windows.h>
-#include <conio.h> // _kbhit
 #endif
 
-// LC-3 has 65536 memory locations,
-// each of which stores a 16-bit value.
-
-#define MEMORY_MAX (1 << 16 /* 65_536 */)
-uint16_t memory[MEMORY_MAX]; // 65_536 memory locations
+#include "lc3.h"
 
 /**
- * LC-3 has 10 total register, each of which is 16 bits.
- * Most of them are general purpose, but a few have designated roles:
- * - 8 general purpose registers (R0-R7) can be used to perform any program calculations.
- * - 1 program counter (PC) register.
- * - 1 condition flags (COND) register tells us information about the previous calculation.
+ * Command line front end: one VM on the terminal. The VM itself lives in lc3.c.
  */
-enum
-{
-#pragma region General purpose registers
-    R_R0 = 0,
-    R_R1,
-    R_R2,
-    R_R3,
-    R_R4,
-    R_R5,
-    R_R6,
-    R_R7,
-#pragma endregion
-    R_PC,   /* Program counter */
-    R_COND, /* Condition flags. The R_COND register stores condition flags which provide information about the most recently executed calculation. This allows programs to check logical conditions such as if (x > 0) { ... }. */
 
-    R_COUNT /* Just contain total number of registers */
-};
-uint16_t reg[R_COUNT];
+#if defined(__APPLE__) || defined(__linux__)
+struct termios original_tio;
 
-/**
- * There are just 16 opcodes in LC-3.
- * Each instruction is 16 bits long, with the left 4 bits storing the opcode.
- * The rest of the bits are used to store the parameters.
- */
-enum
+void disable_input_buffering()
 {
-    OP_BR = 0, /* branch */
-    OP_ADD,    /* add  */
-    OP_LD,     /* load */
-    OP_ST,     /* store */
-    OP_JSR,    /* jump register */
-    OP_AND,    /* bitwise and */
-    OP_LDR,    /* load register */
-    OP_STR,    /* store register */
-    OP_RTI,    /* unused */
-    OP_NOT,    /* bitwise not */
-    OP_LDI,    /* load indirect */
-    OP_STI,    /* store indirect */
-    OP_JMP,    /* jump */
-    OP_RES,    /* reserved (unused) */
-    OP_LEA,    /* load effective address */
-    OP_TRAP    /* execute trap */
-};
+    tcgetattr(STDIN_FILENO, &original_tio);
+    struct termios new_tio = original_tio;
+    new_tio.c_lflag &= ~ICANON & ~ECHO;
+    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+}
 
-/**
- * The LC-3 uses only 3 condition flags which indicate the sign of the previous calculation.
- */
-enum
+void restore_input_buffering()
 {
-    FL_POS = 1 << 0, /* P */
-    FL_ZRO = 1 << 1, /* Z */
-    FL_NEG = 1 << 2, /* N */
-};
+    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+}
+#else
+HANDLE hStdin = INVALID_HANDLE_VALUE;
+DWORD fdwMode, fdwOldMode;
 
-/**
- *
- */
-enum
+void disable_input_buffering()
 {
-    TRAP_GETC = 0x20,  /* get character from keyboard, not echoed onto the terminal */
-    TRAP_OUT = 0x21,   /* output a character */
-    TRAP_PUTS = 0x22,  /* output a word string */
-    TRAP_IN = 0x23,    /* get character from keyboard, echoed onto the terminal */
-    TRAP_PUTSP = 0x24, /* output a byte string */
-    TRAP_HALT = 0x25   /* halt the program */
-};
+    hStdin = GetStdHandle(STD_INPUT_HANDLE);
+    GetConsoleMode(hStdin, &fdwOldMode);     /* save old mode */
+    fdwMode = fdwOldMode ^ ENABLE_ECHO_INPUT /* no input echo */
+              ^ ENABLE_LINE_INPUT;           /* return when one or
+                                                more characters are available */
+    SetConsoleMode(hStdin, fdwMode);         /* set new mode */
+    FlushConsoleInputBuffer(hStdin);         /* clear buffer */
+}
 
-/**
- * Memory mapped register
- */
-enum
+void restore_input_buffering()
 {
-    MR_KBSR = 0xFE00, /* keyboard status */
-    MR_KBDR = 0xFE02  /* keyboard data */
-};
+    SetConsoleMode(hStdin, fdwOldMode);
+}
+#endif
+
+struct lc3_vm *vm = NULL;
+const char *profile_path = NULL;
+int show_fusions = 0;
+int show_routines = 0;
+int show_analysis = 0; /* --cfg */
+const char *trace_path = NULL;
+int debugging = 0;                    /* --debug */
+volatile sig_atomic_t interrupted = 0; /* Ctrl-C while debugging: back to the prompt */
+int terminal_raw = 0; /* disable_input_buffering() ran, --headless leaves the terminal alone */
 
 /**
- * Update register R_COND
+ * --profile: hot spots to stderr, all counts to the file
  */
-void update_flags(uint16_t r)
+void finish_profile()
 {
-    if (reg[r] == 0)
+    if (!profile_path)
     {
-        reg[R_COND] = FL_ZRO;
+        return;
     }
-    else if (reg[r] >> 15 /* a `1` in the left-most bit indicates negative number in `Two's complement` */)
+    lc3_print_hot_spots(vm, stderr, 10);
+    FILE *file = fopen(profile_path, "w");
+    if (!file || !lc3_write_profile(vm, file))
     {
-        reg[R_COND] = FL_NEG;
+        fprintf(stderr, "failed to write profile: %s\n", profile_path);
     }
-    else
+    if (file)
     {
-        reg[R_COND] = FL_POS;
+        fclose(file);
     }
 }
 
-uint16_t sign_extend(uint16_t x, int bit_count)
+/**
+ * --fusions: superinstruction counts to stderr
+ */
+void finish_fusions()
 {
-    if ((x >> (bit_count - 1)) & 1 /* a `1` in the left-most bit indicates negative number in `Two's complement` */)
+    if (show_fusions)
     {
-        x |= (0xFFFF << bit_count); /* Fill missing bit to 1 upto 16 bits for negative number */
+        lc3_write_fusions(vm, stderr);
     }
-    return x /* Keep x if x is positive*/;
 }
 
-uint16_t swap16(uint16_t x)
+/**
+ * --routines: native subroutine counts to stderr
+ */
+void finish_routines()
 {
-    return (x << 8) | (x >> 8);
+    if (show_routines)
+    {
+        lc3_write_routines(vm, stderr);
+    }
 }
 
 /**
- * Load program into address
- *
- * The first 16 bits of the program file specify the address in memory where the program should start.
- * This address is called the origin. It must be read first,
- * after which the rest of the data can be read from the file into memory starting at the origin address.
+ * --trace: on Ctrl-C the trace is written here, the VM writes it itself when the guest halts or crashes
  */
-void read_image_file(FILE *file)
+void finish_trace()
 {
-    /* the origin tells us where in memory to place the image */
-    uint16_t origin;
-    fread(&origin, sizeof(origin), 1, file);
-    origin = swap16(origin);
-
-    /* we know the maximum file size so we only need one fread */
-    uint16_t max_read = MEMORY_MAX - origin;
-    uint16_t *p = memory + origin;
-    size_t read = fread(p, sizeof(uint16_t), max_read, file);
-
-    /* swap to little endian */
-    /* LC-3 programs are big-endian, but most modern computers are little-endian. So, we need to swap each uint16 that is loaded. */
-    while (read-- > 0)
+    if (!trace_path)
     {
-        *p = swap16(*p);
-        ++p;
+        return;
+    }
+    FILE *file = fopen(trace_path, "wb");
+    if (!file || !lc3_write_trace(vm, file))
+    {
+        fprintf(stderr, "failed to write trace: %s\n", trace_path);
+    }
+    if (file)
+    {
+        fclose(file);
     }
 }
 
-int read_image(const char *image_path)
+void handle_interrupt(int signal)
 {
-    FILE *file = fopen(image_path, "rb");
-    if (!file)
+    (void)signal;
+    if (debugging)
     {
-        return 0;
-    };
-
-    read_image_file(file);
-    fclose(file);
-    return 1;
+        interrupted = 1;
+        return;
+    }
+    if (vm)
+    {
+        lc3_flush(vm);
+    }
+    if (terminal_raw)
+    {
+        restore_input_buffering();
+    }
+    printf("\n");
+    if (vm)
+    {
+        finish_profile();
+        finish_fusions();
+        finish_routines();
+        finish_trace();
+    }
+    exit(-2);
 }
 
-#if defined(__APPLE__) || defined(__linux__)
-struct termios original_tio;
+#define DEBUG_SLICE 100000 /* instructions between looks at Ctrl-C */
 
-void disable_input_buffering()
+/**
+ * An address or value: x3000, 0x3000, #12 or 12
+ */
+int parse_word(const char *s, uint16_t *value)
 {
-    tcgetattr(STDIN_FILENO, &original_tio);
-    struct termios new_tio = original_tio;
-    new_tio.c_lflag &= ~ICANON & ~ECHO;
-    tcsetattr(STDIN_FILENO, TCSANOW, &new_tio);
+    char *end;
+    long v = *s == 'x' || *s == 'X' ? strtol(s + 1, &end, 16) : *s == '#' ? strtol(s + 1, &end, 10) : strtol(s, &end, 0);
+    if (end == s || *end != '\0' || v < -32768 || v > 0xFFFF)
+    {
+        return 0;
+    }
+    *value = (uint16_t)v;
+    return 1;
 }
 
-void restore_input_buffering()
+/** R0-R7, PC, COND or PSR; -1 for anything else */
+int parse_reg(const char *s)
 {
-    tcsetattr(STDIN_FILENO, TCSANOW, &original_tio);
+    if ((s[0] == 'R' || s[0] == 'r') && s[1] >= '0' && s[1] <= '7' && s[2] == '\0')
+    {
+        return s[1] - '0';
+    }
+    if (strcmp(s, "PC") == 0 || strcmp(s, "pc") == 0)
+    {
+        return LC3_REG_PC;
+    }
+    if (strcmp(s, "COND") == 0 || strcmp(s, "cond") == 0)
+    {
+        return LC3_REG_COND;
+    }
+    if (strcmp(s, "PSR") == 0 || strcmp(s, "psr") == 0)
+    {
+        return LC3_REG_PSR;
+    }
+    return -1;
 }
 
-uint16_t check_key()
+void debug_show(uint16_t addr)
 {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(STDIN_FILENO, &readfds);
-
-    struct timeval timeout;
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 0;
-    return select(1, &readfds, NULL, NULL, &timeout) != 0;
+    char text[48];
+    uint16_t instr = lc3_peek(vm, addr);
+    lc3_disassemble(addr, instr, text, sizeof(text));
+    fprintf(stderr, "  x%04X  x%04X  %s\n", addr, instr, text);
 }
-#else
-HANDLE hStdin = INVALID_HANDLE_VALUE;
-DWORD fdwMode, fdwOldMode;
 
-void disable_input_buffering()
+void debug_regs()
 {
-    hStdin = GetStdHandle(STD_INPUT_HANDLE);
-    GetConsoleMode(hStdin, &fdwOldMode);     /* save old mode */
-    fdwMode = fdwOldMode ^ ENABLE_ECHO_INPUT /* no input echo */
-              ^ ENABLE_LINE_INPUT;           /* return when one or
-                                                more characters are available */
-    SetConsoleMode(hStdin, fdwMode);         /* set new mode */
-    FlushConsoleInputBuffer(hStdin);         /* clear buffer */
+    for (int r = 0; r < 8; ++r)
+    {
+        fprintf(stderr, "R%d x%04X%s", r, lc3_get_reg(vm, r), r == 3 ? "\n" : "  ");
+    }
+    uint16_t cond = lc3_get_reg(vm, LC3_REG_COND);
+    fprintf(stderr, "\nPC x%04X  COND %s  PSR x%04X\n", lc3_get_reg(vm, LC3_REG_PC), cond & 4 ? "n" : cond & 2 ? "z" : "p",
+            lc3_get_reg(vm, LC3_REG_PSR));
 }
 
-void restore_input_buffering()
+/** what killed the guest, with its registers */
+void print_fault()
 {
-    SetConsoleMode(hStdin, fdwOldMode);
+    struct lc3_fault fault;
+    lc3_get_fault(vm, &fault);
+    fprintf(stderr, "%s x%04X at x%04X\n", lc3_fault_name(fault.code), fault.instr, fault.pc);
+    for (int r = 0; r < 8; ++r)
+    {
+        fprintf(stderr, "R%d x%04X%s", r, fault.reg[r], r == 3 || r == 7 ? "\n" : "  ");
+    }
+    fprintf(stderr, "PSR x%04X\n", fault.psr);
 }
 
-uint16_t check_key()
+/**
+ * Read commands until one of them runs the guest: returns the number of instructions to step, 0 to continue,
+ * -1 to quit
+ */
+long long debug_prompt()
 {
-    return WaitForSingleObject(hStdin, 1000) == WAIT_OBJECT_0 && _kbhit();
+    static const char *const help =
+        "c                   continue\n"
+        "s [N]               step N instructions (default 1, also an empty line)\n"
+        "b ADDR              set a breakpoint\n"
+        "w ADDR [r|w|rw]     watch accesses (default w: stores)\n"
+        "d ADDR              delete the breakpoint and the watchpoint at ADDR\n"
+        "r                   registers\n"
+        "x ADDR [N]          N words of memory as instructions (default 8)\n"
+        "set R0-R7|PC|COND|PSR|ADDR VALUE\n"
+        "q                   quit\n";
+    char line[256];
+    debug_show(lc3_get_reg(vm, LC3_REG_PC));
+    for (;;)
+    {
+        fprintf(stderr, "(lc3) ");
+        if (!fgets(line, sizeof(line), stdin))
+        {
+            return -1;
+        }
+        char cmd[16] = "", a[64] = "", b[64] = "";
+        int n = sscanf(line, "%15s %63s %63s", cmd, a, b);
+        uint16_t addr, value;
+        if (n <= 0 || strcmp(cmd, "s") == 0 || strcmp(cmd, "step") == 0)
+        {
+            long long steps = n >= 2 ? atoll(a) : 1;
+            return steps > 0 ? steps : 1;
+        }
+        if (strcmp(cmd, "c") == 0 || strcmp(cmd, "continue") == 0)
+        {
+            return 0;
+        }
+        if (strcmp(cmd, "q") == 0 || strcmp(cmd, "quit") == 0)
+        {
+            return -1;
+        }
+        if (strcmp(cmd, "r") == 0 || strcmp(cmd, "regs") == 0)
+        {
+            debug_regs();
+        }
+        else if (strcmp(cmd, "b") == 0 && n == 2 && parse_word(a, &addr))
+        {
+            if (!lc3_set_breakpoint(vm, addr, 1))
+            {
+                fprintf(stderr, "no breakpoints on device addresses\n");
+            }
+        }
+        else if (strcmp(cmd, "w") == 0 && n >= 2 && parse_word(a, &addr))
+        {
+            unsigned kinds = n == 2 || strcmp(b, "w") == 0 ? LC3_WATCH_WRITE
+                             : strcmp(b, "r") == 0        ? LC3_WATCH_READ
+                             : strcmp(b, "rw") == 0       ? LC3_WATCH_READ | LC3_WATCH_WRITE
+                                                          : 0;
+            if (kinds)
+            {
+                lc3_set_watchpoint(vm, addr, kinds);
+            }
+            else
+            {
+                fprintf(stderr, "watch r, w or rw\n");
+            }
+        }
+        else if (strcmp(cmd, "d") == 0 && n == 2 && parse_word(a, &addr))
+        {
+            lc3_set_breakpoint(vm, addr, 0);
+            lc3_set_watchpoint(vm, addr, 0);
+        }
+        else if (strcmp(cmd, "x") == 0 && n >= 2 && parse_word(a, &addr))
+        {
+            int count = n == 3 ? atoi(b) : 8;
+            for (int i = 0; i < count; ++i)
+            {
+                debug_show((uint16_t)(addr + i));
+            }
+        }
+        else if (strcmp(cmd, "set") == 0 && n == 3 && parse_word(b, &value))
+        {
+            int reg = parse_reg(a);
+            if (reg >= 0)
+            {
+                lc3_set_reg(vm, reg, value);
+            }
+            else if (parse_word(a, &addr))
+            {
+                lc3_poke(vm, addr, value);
+            }
+            else
+            {
+                fprintf(stderr, "set what?\n");
+            }
+        }
+        else
+        {
+            fputs(help, stderr);
+        }
+    }
 }
-#endif
 
-void handle_interrupt(int signal)
+/**
+ * --debug: the guest runs between prompts, which come before the first instruction,
+ * at breakpoints and watchpoints, after steps and on Ctrl-C
+ */
+void debug_run()
 {
-    restore_input_buffering();
-    printf("\n");
-    exit(-2);
-}
+    for (;;)
+    {
+        lc3_flush(vm);
+        if (terminal_raw)
+        {
+            restore_input_buffering(); /* the prompt reads lines */
+        }
+        long long steps = debug_prompt();
+        if (steps < 0)
+        {
+            return;
+        }
+        if (terminal_raw)
+        {
+            disable_input_buffering();
+        }
 
-void mem_write(uint16_t addr, uint16_t val)
-{
-    memory[addr] = val;
-}
+        interrupted = 0;
+        uint64_t left = (uint64_t)steps;
+        int status;
+        do
+        {
+            uint64_t slice = steps && left < DEBUG_SLICE ? left : DEBUG_SLICE;
+            status = lc3_run(vm, slice);
+            left -= steps ? slice : 0;
+        } while (status == LC3_YIELD && !interrupted && (!steps || left > 0));
 
-uint16_t mem_read(uint16_t address)
-{
-    if (address == MR_KBSR)
-    {
-        if (check_key())
+        if (status == LC3_HALTED)
         {
-            memory[MR_KBSR] = (1 << 15);
-            memory[MR_KBDR] = getchar();
+            return;
         }
-        else
+        if (status == LC3_BREAKPOINT)
         {
-            memory[MR_KBSR] = 0;
+            fprintf(stderr, "\nbreakpoint\n");
+        }
+        else if (status == LC3_FAULT)
+        {
+            fprintf(stderr, "\n");
+            print_fault(); /* the guest cannot continue */
+        }
+        else if (status == LC3_WATCHPOINT)
+        {
+            uint16_t addr;
+            unsigned kind = lc3_watch_hit(vm, &addr);
+            fprintf(stderr, "\nwatchpoint: %s x%04X, now x%04X\n", kind == LC3_WATCH_READ ? "read" : "write", addr,
+                    lc3_peek(vm, addr));
+        }
+        else if (interrupted)
+        {
+            fprintf(stderr, "\ninterrupted\n");
         }
     }
-    return memory[address];
 }
 
 int main(int argc, const char *argv[])
@@ -272,305 +398,277 @@ int main(int argc, const char *argv[])
      */
 
 #pragma region Load arguments
-    if (argc < 2)
-    {
-        /* show usage string */
-        printf("lc3 [image-file1] ...\n");
-        exit(2);
-    }
+    struct lc3_config config;
+    lc3_default_config(&config);
+    const char *restore_path = NULL;
+    const char *input_path = NULL, *output_path = NULL;
+    const char *record_path = NULL, *replay_path = NULL;
+    int image_count = 0; /* the images are moved to the front of argv, they are loaded once the VM exists */
 
     for (int j = 1; j < argc; ++j)
     {
-        if (!read_image(argv[j]))
+        if (strncmp(argv[j], "--engine=", 9) == 0)
         {
-            printf("failed to load image: %s\n", argv[j]);
-            exit(1);
+            const char *name = argv[j] + 9;
+            if (!lc3_parse_engine(name, &config.engine))
+            {
+                printf("unknown engine: %s\n", name);
+                exit(2);
+            }
+            continue;
         }
-    }
-#pragma endregion
-
-#pragma region setup
-    signal(SIGINT, handle_interrupt);
-    disable_input_buffering();
-#pragma endregion
-
-    /** since exactly one condition flag should be set at any given time, set the Z flag  */
-    reg[R_COND] = FL_ZRO;
-
-    enum
-    {
-        PC_START = 0x3000
-    };
-    /** set the PC to starting position, 0x3000 is the default */
-    reg[R_PC] = PC_START;
-
-    int running = 1;
-    while (running)
-    {
-        /* FETCH*/
-        uint16_t instr = mem_read(reg[R_PC]++);
-        uint16_t op = instr >> 12; // 4 most significant bits is opcode
-
-        switch (op)
+        if (strcmp(argv[j], "--unbuffered") == 0)
         {
-        case OP_ADD: /* 0001 */
+            config.unbuffered = 1;
+            continue;
+        }
+        if (strncmp(argv[j], "--flush=", 8) == 0)
         {
-            uint16_t r0 = (instr >> 9) & 0x7;       /* destination register (DR) - bit 9..11 */
-            uint16_t r1 = (instr >> 6) & 0x7;       /* first operand (SR1) - bit 6..8 */
-            uint16_t imm_flag = (instr >> 5) & 0x1; /* bit 5, whether we are in immediate mode */
-
-            if (imm_flag /* immediate mode */)
-            {
-                uint16_t imm5 = sign_extend(
-                    instr & 0x1F /* Mask with 0001 1111 (or 0x1F). Or in other words, keep only instr's lowest 5 bits, set all other bits to 0. */,
-                    5);
-                reg[r0] = reg[r1] + imm5;
-            }
-            else /* register mode */
+            if (!lc3_parse_flush_policy(argv[j] + 8, &config.flush_policy))
             {
-                uint16_t r2 = instr & 0x7; /* right-most 3 bits is second operand (SR2) in register mode */
-                reg[r0] = reg[r1] + reg[r2];
+                printf("unknown flush policy: %s\n", argv[j] + 8);
+                exit(2);
             }
-
-            update_flags(r0);
-
-            break;
+            continue;
         }
-        case OP_AND: /* 0101*/
+        if (strncmp(argv[j], "--flush-ms=", 11) == 0)
         {
-            uint16_t r0 = (instr >> 9) & 0x7;       /* destination register (DR) - bit 9..11 */
-            uint16_t r1 = (instr >> 6) & 0x7;       /* first operand (SR1) - bit 6..8 */
-            uint16_t imm_flag = (instr >> 5) & 0x1; /* bit 5, whether we are in immediate mode */
-
-            if (imm_flag /* immediate mode */)
-            {
-                uint16_t imm5 = sign_extend(
-                    instr & 0x1F /* Mask with 0001 1111 (or 0x1F). Or in other words, keep only instr's lowest 5 bits, set all other bits to 0. */,
-                    5);
-                reg[r0] = reg[r1] & imm5;
-            }
-            else /* register mode */
-            {
-                uint16_t r2 = instr & 0x7; /* right-most 3 bits is second operand (SR2) in register mode */
-                reg[r0] = reg[r1] & reg[r2];
-            }
-
-            update_flags(r0);
-
-            break;
+            config.flush_ms = (unsigned)strtoul(argv[j] + 11, NULL, 10);
+            continue;
         }
-        case OP_NOT: /* 1001 */
+#if defined(__APPLE__) || defined(__linux__)
+        if (strcmp(argv[j], "--image-cache") == 0)
         {
-            uint16_t r0 = (instr >> 9) & 0x7; // bit [9:11]
-            uint16_t r1 = (instr >> 6) & 0x7; // bit [6:8]
-
-            reg[r0] = ~reg[r1];
-            update_flags(r0);
-
-            break;
+            config.image_cache = 1;
+            continue;
         }
-        case OP_BR: /* 0000 */
+#endif
+        if (strncmp(argv[j], "--snapshot=", 11) == 0)
         {
-            uint16_t pc_offset = sign_extend(instr & 0x1FF, 9); // pc offset, bit [0:8]
-            uint16_t cond_flag = (instr >> 9) & 0x7;            // condition flag, bit [9:11] (bit 9 is p, bit 10 is z, bit 11 is n)
-            if (cond_flag & reg[R_COND])
-            {
-                reg[R_PC] += pc_offset;
-            }
-
-            break;
+            config.snapshot_path = argv[j] + 11;
+            continue;
         }
-        case OP_JMP: /* 1100 */
+        if (strncmp(argv[j], "--restore=", 10) == 0)
         {
-            /**
-             * RET is a special case of JMP. RET happens whenever R1 is 7
-             */
-
-            uint16_t r1 = (instr >> 6) & 0x7;
-            reg[R_PC] = reg[r1];
-
-            break;
+            restore_path = argv[j] + 10;
+            continue;
         }
-        case OP_JSR: /* 0100 */
+        if (strncmp(argv[j], "--kbd-poll=", 11) == 0)
         {
-            uint16_t long_flag = (instr >> 11) & 1; // bit 11
-            reg[R_R7] = reg[R_PC];
-
-            if (long_flag)
-            {
-                uint16_t long_pc_offset = sign_extend(instr & 0x7FF, 11);
-                reg[R_PC] += long_pc_offset; /* JSR */
-            }
-            else
-            {
-                uint16_t r1 = (instr >> 6) & 0x7;
-                reg[R_PC] = reg[r1]; /* JSRR */
-            }
-
-            break;
+            config.kbd_poll = (unsigned)strtoul(argv[j] + 11, NULL, 10);
+            continue;
         }
-        case OP_LD: /* 0010 */
+        if (strncmp(argv[j], "--profile=", 10) == 0)
         {
-            uint16_t r0 = (instr >> 9) & 0x7;                   // bit [9:11]
-            uint16_t pc_offset = sign_extend(instr & 0x1FF, 9); // bit [0:8]
-            reg[r0] = mem_read(reg[R_PC] + pc_offset);
-            update_flags(r0);
-
-            break;
+            profile_path = argv[j] + 10;
+            config.profile = 1;
+            continue;
         }
-        case OP_LDI: /* 1010 */
+        if (strcmp(argv[j], "--headless") == 0)
         {
-            /**
-             * Load value from a location of memory into a register.
-             * An address is computed by sign-extending bits [8:0] to 16 bits and adding this value to the incremented PC.
-             * The resulting sum is an address to a location in memory, and that address contains, yet another value which is the address of the value to load.
-             * Also, the condition codes are set based on whether the value loaded is negative, zero, or positive.
-             */
-
-            uint16_t r0 = (instr >> 9) & 0x7; /* destination register (DR) - bit 9..11 */
-            uint16_t pc_offset = sign_extend(instr & 0x1FF, 9);
-
-            reg[r0] = mem_read(mem_read(reg[R_PC] + pc_offset));
-            update_flags(r0);
-
-            break;
+            config.headless = 1;
+            continue;
         }
-        case OP_LDR: /* 0110 */
+        if (strncmp(argv[j], "--input=", 8) == 0)
         {
-            uint16_t r0 = (instr >> 9) & 0x7;               // bit [9:11]
-            uint16_t r1 = (instr >> 6) & 0x7;               // bit [6:8]
-            uint16_t offset = sign_extend(instr & 0x3F, 6); // bit [0:5]
-            reg[r0] = mem_read(reg[r1] + offset);
-            update_flags(r0);
-
-            break;
+            input_path = argv[j] + 8;
+            config.headless = 1;
+            continue;
         }
-        case OP_LEA: /* 1110 */
+        if (strncmp(argv[j], "--output=", 9) == 0)
         {
-            uint16_t r0 = (instr >> 9) & 0x7; // bit [9:11]
-            uint16_t pc_offset = sign_extend(instr & 0x1FF /* bit [0:8] */, 9);
-            reg[r0] = reg[R_PC] + pc_offset;
-            update_flags(r0);
-
-            break;
+            output_path = argv[j] + 9;
+            continue;
         }
-        case OP_ST: /* 0011 */
+        if (strcmp(argv[j], "--no-idle") == 0)
         {
-            uint16_t r0 = (instr >> 9) & 0x7; // bit [9:11]
-            uint16_t pc_offset = sign_extend(instr & 0x1FF /* bit [0:8] */, 9);
-            mem_write(reg[R_PC] + pc_offset, reg[r0]);
-
-            break;
+            config.idle_sleep = 0;
+            continue;
         }
-        case OP_STI: /* 1011 */
+        if (strcmp(argv[j], "--no-fuse") == 0)
         {
-            uint16_t r0 = (instr >> 9) & 0x7; // bit [9:11]
-            uint16_t pc_offset = sign_extend(instr & 0x1FF /* bit [0:8] */, 9);
-            mem_write(mem_read(reg[R_PC] + pc_offset), reg[r0]);
-
-            break;
+            config.fuse = 0;
+            continue;
         }
-        case OP_STR: /* 0111 */
+        if (strcmp(argv[j], "--fusions") == 0)
         {
-            uint16_t r0 = (instr >> 9) & 0x7;               // bit [9:11]
-            uint16_t r1 = (instr >> 6) & 0x7;               // bit [6:8]
-            uint16_t offset = sign_extend(instr & 0x3F, 6); // bit [0:5]
-
-            mem_write(reg[r1] + offset, reg[r0]);
-
-            break;
+            show_fusions = 1;
+            continue;
+        }
+        if (strcmp(argv[j], "--no-routines") == 0)
+        {
+            config.native_routines = 0;
+            continue;
+        }
+        if (strcmp(argv[j], "--routines") == 0)
+        {
+            show_routines = 1;
+            continue;
+        }
+        if (strcmp(argv[j], "--analyze") == 0)
+        {
+            config.analyze = 1;
+            continue;
         }
-        case OP_TRAP: /* 1111 */
+        if (strcmp(argv[j], "--cfg") == 0)
         {
-            reg[R_R7] = reg[R_PC];
+            config.analyze = 1;
+            show_analysis = 1;
+            continue;
+        }
+        if (strncmp(argv[j], "--trace=", 8) == 0)
+        {
+            trace_path = config.trace_path = argv[j] + 8;
+            continue;
+        }
+        if (strcmp(argv[j], "--host-calls") == 0)
+        {
+            config.host_calls = 1;
+            continue;
+        }
+        if (strcmp(argv[j], "--interrupts") == 0)
+        {
+            config.interrupts = 1;
+            continue;
+        }
+        if (strcmp(argv[j], "--debug") == 0)
+        {
+            debugging = 1;
+            continue;
+        }
+        if (strncmp(argv[j], "--trace-size=", 13) == 0)
+        {
+            config.trace_size = (unsigned)strtoul(argv[j] + 13, NULL, 10);
+            continue;
+        }
+        if (strncmp(argv[j], "--record=", 9) == 0)
+        {
+            record_path = argv[j] + 9;
+            continue;
+        }
+        if (strncmp(argv[j], "--replay=", 9) == 0)
+        {
+            replay_path = argv[j] + 9;
+            config.headless = 1; /* the keys come from the recording */
+            continue;
+        }
 
-            switch (instr & 0xFF /*  */)
-            {
-            case TRAP_GETC:
-            {
-                /* read a single ASCII char */
-                reg[R_R0] = (uint16_t)getchar();
-                update_flags(R_R0);
+        argv[image_count++] = argv[j];
+    }
+    if (debugging && !config.headless && config.kbd_poll == 0)
+    {
+        config.kbd_poll = 1; /* no reader thread, the prompt reads stdin while the guest is stopped */
+    }
+    if (!trace_path)
+    {
+        config.trace_size = 0; /* --trace-size alone traces nothing */
+    }
+    else if (!config.trace_size)
+    {
+        config.trace_size = 65536;
+    }
 
-                break;
-            }
-            case TRAP_OUT:
-            {
-                /* Output character */
-                putc((char)reg[R_R0], stdout);
-                fflush(stdout);
+    if (config.headless)
+    {
+        /* no terminal: the keyboard reads the input file or stdin like any other stream */
+        config.input = input_path ? fopen(input_path, "rb") : stdin;
+        if (!config.input)
+        {
+            printf("failed to open input: %s\n", input_path);
+            exit(1);
+        }
+    }
+    if (output_path && !(config.output = fopen(output_path, "wb")))
+    {
+        printf("failed to open output: %s\n", output_path);
+        exit(1);
+    }
+    if (record_path && !(config.record = fopen(record_path, "wb")))
+    {
+        printf("failed to open recording: %s\n", record_path);
+        exit(1);
+    }
 
-                break;
-            }
-            case TRAP_PUTS:
-            {
-                /* one char per word */
+    vm = lc3_create(&config);
+    if (!vm)
+    {
+        printf("out of memory\n");
+        exit(1);
+    }
+    for (int j = 0; j < image_count; ++j)
+    {
+        if (!lc3_load_image(vm, argv[j]))
+        {
+            printf("failed to load image: %s\n", argv[j]);
+            exit(1);
+        }
+    }
+    if (show_analysis)
+    {
+        lc3_write_analysis(vm, stderr);
+    }
 
-                uint16_t *c = memory + reg[R_R0];
-                while (*c)
-                {
-                    putc((char)*c, stdout);
-                    ++c;
-                }
-                fflush(stdout);
+    if (replay_path)
+    {
+        FILE *file = fopen(replay_path, "rb");
+        if (!file || !lc3_replay(vm, file))
+        {
+            printf("failed to replay recording: %s\n", replay_path);
+            exit(1);
+        }
+        fclose(file);
+    }
 
-                break;
-            }
-            case TRAP_IN:
-            {
-                /* Prompt for input character */
-                printf("Enter a character: ");
-                char c = getchar();
-                putc(c, stdout);
-                fflush(stdout);
-                reg[R_R0] = (uint16_t)c;
-                update_flags(R_R0);
-
-                break;
-            }
-            case TRAP_PUTSP:
-            {
-                /**
-                 * one char per byte (two bytes per word)
-                 * here we need to swap back to
-                 * big endian format
-                 */
-
-                uint16_t *c = memory + reg[R_R0];
-                while (*c)
-                {
-                    char char1 = (*c) & 0xFF;
-                    putc(char1, stdout);
-                    char char2 = (*c) >> 8;
-                    if (char2)
-                        putc(char2, stdout);
-                    ++c;
-                }
-                fflush(stdout);
-
-                break;
-            }
-            case TRAP_HALT:
-            {
-                puts("HALT");
-                fflush(stdout);
-                running = 0;
+    if (restore_path)
+    {
+        /* the snapshot brings its own images */
+        if (image_count > 0 || !lc3_restore(vm, restore_path))
+        {
+            printf("failed to restore snapshot: %s\n", restore_path);
+            exit(1);
+        }
+    }
+    else if (image_count == 0)
+    {
+        /* show usage string */
+        printf("lc3 [--engine=switch|threaded|jit] [--kbd-poll=N] [--unbuffered] [--flush=newline,input,time] [--flush-ms=N] [--image-cache] [--snapshot=FILE] [--profile=FILE] [--no-fuse] [--fusions] [--no-routines] [--routines] [--analyze] [--cfg] [--trace=FILE] [--trace-size=N] [--record=FILE] [--replay=FILE] [--host-calls] [--interrupts] [--debug] [--no-idle] [--headless] [--input=FILE] [--output=FILE] [--restore=FILE | image-file1 ...]\n");
+        exit(2);
+    }
+#pragma endregion
 
-                break;
-            }
-            }
+#pragma region setup
+    signal(SIGINT, handle_interrupt);
+    if (!config.headless)
+    {
+        disable_input_buffering();
+        terminal_raw = 1;
+    }
+    lc3_start_input(vm);
+#pragma endregion
 
-            break;
-        }
-        case OP_RES: /* unused */
-        case OP_RTI: /* unused*/
-        default:
-            abort(); // Bad opcode
-            break;
-        }
+    int status = LC3_HALTED;
+    if (debugging)
+    {
+        debug_run();
+    }
+    else
+    {
+        status = lc3_run(vm, 0);
     }
 
-    restore_input_buffering(); // shutdown
+    lc3_flush(vm);
+    if (terminal_raw)
+    {
+        restore_input_buffering(); // shutdown
+    }
+    if (status == LC3_FAULT)
+    {
+        print_fault();
+    }
+    finish_profile();
+    finish_fusions();
+    finish_routines();
+    lc3_destroy(vm);
 
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    return status == LC3_FAULT ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,94 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "lc3.h"
+
+/**
+ * lc3-trace: print a trace file written by `main --trace=FILE` as disassembly, one instruction per line:
+ *
+ *     #1234567  x3004  x6241  LDR R1, R1, #1      R1=x0041  [x4001]
+ *     #1234568  x3005  x7042  STR R0, R1, #2      [x4043]<-x0012
+ *
+ * with the instruction number, its address and encoding, what it wrote to registers and which memory it accessed.
+ * `--last=N` prints only the last N instructions, the ones right before the guest halted, crashed or was interrupted.
+ */
+
+void print_record(const struct lc3_trace_record *r, uint64_t number, FILE *out)
+{
+    char text[48];
+    lc3_disassemble(r->pc, r->instr, text, sizeof(text));
+    fprintf(out, "#%-9llu x%04X  x%04X  %-24s", (unsigned long long)number, r->pc, r->instr, text);
+    if (r->flags & LC3_TRACE_REG)
+    {
+        fprintf(out, "  R%u=x%04X", r->reg, r->reg_value);
+    }
+    if (r->flags & LC3_TRACE_LINK)
+    {
+        fprintf(out, "  R7=x%04X", (uint16_t)(r->pc + 1));
+    }
+    if (r->flags & LC3_TRACE_LOAD)
+    {
+        fprintf(out, "  [x%04X]", r->addr);
+    }
+    if (r->flags & LC3_TRACE_STORE)
+    {
+        fprintf(out, "  [x%04X]<-x%04X", r->addr, r->value);
+    }
+    fputc('\n', out);
+}
+
+int main(int argc, const char *argv[])
+{
+    const char *path = NULL;
+    uint64_t last = UINT64_MAX;
+    for (int j = 1; j < argc; ++j)
+    {
+        if (strncmp(argv[j], "--last=", 7) == 0)
+        {
+            last = strtoull(argv[j] + 7, NULL, 10);
+        }
+        else
+        {
+            path = argv[j];
+        }
+    }
+    if (!path)
+    {
+        printf("lc3-trace [--last=N] trace-file\n");
+        exit(2);
+    }
+
+    FILE *file = fopen(path, "rb");
+    if (!file)
+    {
+        printf("failed to open trace: %s\n", path);
+        exit(1);
+    }
+    struct lc3_trace_header header;
+    if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != LC3_TRACE_MAGIC ||
+        header.version != LC3_TRACE_VERSION)
+    {
+        printf("not an LC-3 trace: %s\n", path);
+        exit(1);
+    }
+
+    uint64_t skip = header.count > last ? header.count - last : 0;
+    struct lc3_trace_record r;
+    for (uint64_t i = 0; i < header.count; ++i)
+    {
+        if (fread(&r, sizeof(r), 1, file) != 1 || r.seq != (uint32_t)(header.first + i))
+        {
+            printf("trace is broken after %llu of %llu records: %s\n", (unsigned long long)i,
+                   (unsigned long long)header.count, path);
+            exit(1);
+        }
+        if (i >= skip)
+        {
+            print_record(&r, header.first + i, stdout);
+        }
+    }
+    fclose(file);
+    return EXIT_SUCCESS;
+}